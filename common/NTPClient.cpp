@@ -25,6 +25,18 @@
 #  define LEAP_YEAR(Y)     ( (Y>0) && !(Y%4) && ( (Y%100) || !(Y%400) ) )
 #endif
 
+// An NTP timestamp - seconds since 1900, and a fraction of 2^32 - in us since 1970.
+static int64_t ntpToMicros(const byte* stamp) {
+  uint64_t secs = (uint32_t)stamp[0] << 24 | (uint32_t)stamp[1] << 16 | (uint32_t)stamp[2] << 8 | stamp[3];
+  uint64_t fraction = (uint32_t)stamp[4] << 24 | (uint32_t)stamp[5] << 16 | (uint32_t)stamp[6] << 8 | stamp[7];
+
+  // The seconds wrap in 2036; anything before 1970 is from after that.
+  if (secs < SEVENZYYEARS)
+    secs += 0x100000000ULL;
+
+  return (int64_t)(secs - SEVENZYYEARS) * 1000000 + (int64_t)((fraction * 1000000) >> 32);
+}
+
 
 NTPClient::NTPClient(UDP& udp) {
   this->_udp            = &udp;
@@ -80,52 +92,182 @@ bool NTPClient::forceUpdate() {
     Serial.println("Update from NTP Server");
   #endif
 
+  if (!this->_udpSetup) this->begin();                           // setup the UDP client if needed
+
   if ( on_before )
     on_before();
 
-  this->sendNTPPacket();
+  // Any earlier request is abandoned; its reply will be ignored.
+  this->_requestSent = millis();
+  this->_waiting = this->sendNTPPacket();
 
-  // Wait till data is there or timeout...
-  byte timeout = 0;
-  int cb = 0;
-  do {
-    delay ( 10 );
-    cb = this->_udp->parsePacket();
-    if (timeout > 100) return false; // timeout after 1000 ms
-    timeout++;
-  } while (cb == 0);
+  if (!this->_waiting)
+    this->_syncFailures++;
 
-  this->_lastUpdate = millis() - (10 * (timeout + 1)); // Account for delay in reading the time
+  return this->_waiting;
+}
 
-  this->_udp->read(this->_packetBuffer, NTP_PACKET_SIZE);
+// Read whatever replies have arrived, without waiting.  Only the answer to
+// our outstanding request is used, so late and duplicate replies are dropped.
+void NTPClient::receiveNTPPacket() {
+  while (this->_udp->parsePacket() > 0) {
+    int len = this->_udp->read(this->_packetBuffer, NTP_PACKET_SIZE);
 
-  unsigned long highWord = word(this->_packetBuffer[40], this->_packetBuffer[41]);
-  unsigned long lowWord = word(this->_packetBuffer[42], this->_packetBuffer[43]);
-  // combine the four bytes (two words) into a long integer
-  // this is NTP time (seconds since Jan 1 1900):
-  unsigned long secsSince1900 = highWord << 16 | lowWord;
+    // The server returns our transmit timestamp as its originate timestamp.
+    if (!this->_waiting || len < NTP_PACKET_SIZE ||
+        memcmp(this->_packetBuffer + 24, this->_requestStamp, sizeof(this->_requestStamp)) != 0)
+      continue;
 
-  this->_currentEpoc = secsSince1900 - SEVENZYYEARS;
+    // Only a server's reply will do; stratum zero is a kiss-of-death.
+    if ((this->_packetBuffer[0] & 0x07) != 4 || this->_packetBuffer[1] == 0)
+      continue;
 
-  if ( on_after )
-      on_after();
+    this->_waiting = false;
 
-  return true;
+    unsigned long now = millis();
+
+    // The four timestamps: our clock when we sent the request (T1), the
+    // server's when it received it (T2) and replied (T3), and ours now (T4).
+    int64_t t1 = this->clockAt(this->_requestSent);
+    int64_t t2 = ntpToMicros(this->_packetBuffer + 32);
+    int64_t t3 = ntpToMicros(this->_packetBuffer + 40);
+    int64_t t4 = this->clockAt(now);
+
+    // Assuming the network is as quick in each direction, how far our clock
+    // is from the server's, and how long we spent on the network.
+    int64_t offset = ((t2 - t1) + (t3 - t4)) / 2;
+    int64_t delay = (t4 - t1) - (t3 - t2);
+
+    this->_lastDelay = delay < 0 ? 0 : (long)(delay / 1000);
+
+    if (this->_syncCount > 0) {
+      this->_lastOffsetMs = (long)(offset / 1000);
+      this->_lastOffset = (long)(offset / 1000000);
+    }
+
+    this->discipline(now, t4, offset);
+
+    this->_lastUpdate = now;
+    this->_syncCount++;
+
+    if ( on_after )
+        on_after();
+  }
 }
 
 bool NTPClient::update() {
+  if (this->_udpSetup)
+    this->receiveNTPPacket();
+
+  if (this->_waiting) {
+    if (millis() - this->_requestSent < NTP_TIMEOUT)
+      return true;
+
+    this->_waiting = false;                                      // Give up; a late reply is ignored
+    this->_syncFailures++;
+    return false;
+  }
+
+  if (this->_requestCount > 0 && millis() - this->_requestSent < NTP_TIMEOUT)
+    return true;                                                 // Don't retry a failure at once
+
   if ((millis() - this->_lastUpdate >= this->_updateInterval)     // Update after _updateInterval
     || this->_lastUpdate == 0) {                                // Update if there was no update yet.
-    if (!this->_udpSetup) this->begin();                         // setup the UDP client if needed
     return this->forceUpdate();
   }
   return true;
 }
 
+// Correct our clock, given that it was offset us behind at now, when it read clock.
+void NTPClient::discipline(unsigned long now, int64_t clock, int64_t offset) {
+  int64_t size = offset < 0 ? -offset : offset;
+
+  // Step the first time, or when we're too far out to slew before the next
+  // update without running backwards.
+  if (this->_syncCount == 0 || size > NTP_STEP_THRESHOLD * 1000LL || size > (int64_t)this->_updateInterval * 500) {
+    this->_baseEpoch = clock + offset;
+    this->_baseMillis = now;
+    this->_slew = 0;
+    this->_driftError = 0;
+    this->_driftElapsed = 0;
+    return;
+  }
+
+  // Whatever we hadn't slewed yet was known before this update, so the rest
+  // of the offset is our oscillator's error since the last.  A few ms over a
+  // minute says little, so gather it over NTP_DRIFT_INTERVAL, then move our
+  // estimate half of the way towards what we saw.
+  this->_driftError += offset - (this->_slew - this->slewAt(now));
+  this->_driftElapsed += now - this->_lastUpdate;
+
+  if (this->_driftElapsed >= NTP_DRIFT_INTERVAL) {
+    int64_t drift = this->_drift + (this->_driftError * 1000000 / (int64_t)this->_driftElapsed) / 2;
+
+    if (drift > NTP_MAX_DRIFT)
+      drift = NTP_MAX_DRIFT;
+    if (drift < -NTP_MAX_DRIFT)
+      drift = -NTP_MAX_DRIFT;
+    this->_drift = (long)drift;
+    this->_driftError = 0;
+    this->_driftElapsed = 0;
+  }
+
+  // Carry on from where we are, slewing the offset in until the next update.
+  this->_baseEpoch = clock;
+  this->_baseMillis = now;
+  this->_slew = (long)offset;
+}
+
+// How much of the offset we've slewed in by now, in us.
+long NTPClient::slewAt(unsigned long now) {
+  unsigned long elapsed = now - this->_baseMillis;
+
+  if (this->_slew == 0 || elapsed >= this->_updateInterval)
+    return this->_slew;
+
+  return (long)((int64_t)this->_slew * (int64_t)elapsed / (int64_t)this->_updateInterval);
+}
+
+// Our clock at now, in us since 1970.
+int64_t NTPClient::clockAt(unsigned long now) {
+  unsigned long elapsed = now - this->_baseMillis;
+
+  return this->_baseEpoch + (int64_t)elapsed * 1000 +
+         (int64_t)elapsed * this->_drift / 1000000 +
+         this->slewAt(now);
+}
+
 unsigned long NTPClient::getEpochTime() {
   return this->_timeOffset + // User offset
-         this->_currentEpoc + // Epoc returned by the NTP server
-         ((millis() - this->_lastUpdate) / 1000); // Time since last update
+         (unsigned long)(this->clockAt(millis()) / 1000000); // Our clock
+}
+
+uint64_t NTPClient::getEpochMillis() {
+  return (int64_t)this->_timeOffset * 1000 + this->clockAt(millis()) / 1000;
+}
+
+unsigned long NTPClient::getSyncCount() {
+  return this->_syncCount;
+}
+
+unsigned long NTPClient::getSyncFailures() {
+  return this->_syncFailures;
+}
+
+long NTPClient::getLastOffset() {
+  return this->_lastOffset;
+}
+
+long NTPClient::getLastOffsetMillis() {
+  return this->_lastOffsetMs;
+}
+
+long NTPClient::getLastDelay() {
+  return this->_lastDelay;
+}
+
+long NTPClient::getDrift() {
+  return this->_drift;
 }
 
 int NTPClient::getDay() {
@@ -260,7 +402,7 @@ void NTPClient::setUpdateInterval(unsigned long updateInterval) {
   this->_updateInterval = updateInterval;
 }
 
-void NTPClient::sendNTPPacket() {
+bool NTPClient::sendNTPPacket() {
   // set all bytes in the buffer to 0
   memset(this->_packetBuffer, 0, NTP_PACKET_SIZE);
   // Initialize values needed to form NTP request
@@ -275,9 +417,25 @@ void NTPClient::sendNTPPacket() {
   this->_packetBuffer[14]  = 49;
   this->_packetBuffer[15]  = 52;
 
+  // Our transmit timestamp is unique to this request, so that we can
+  // recognise its reply.
+  this->_requestCount++;
+  unsigned long stamp = millis();
+  this->_packetBuffer[40] = this->_requestCount >> 24;
+  this->_packetBuffer[41] = this->_requestCount >> 16;
+  this->_packetBuffer[42] = this->_requestCount >> 8;
+  this->_packetBuffer[43] = this->_requestCount;
+  this->_packetBuffer[44] = stamp >> 24;
+  this->_packetBuffer[45] = stamp >> 16;
+  this->_packetBuffer[46] = stamp >> 8;
+  this->_packetBuffer[47] = stamp;
+  memcpy(this->_requestStamp, this->_packetBuffer + 40, sizeof(this->_requestStamp));
+
   // all NTP fields have been given values, now
   // you can send a packet requesting a timestamp:
-  this->_udp->beginPacket(this->_poolServerName, 123); //NTP requests are to port 123
+  if (!this->_udp->beginPacket(this->_poolServerName, 123)) //NTP requests are to port 123
+    return false;
+  this->_requestSent = millis();                                 // T1, after any DNS lookup
   this->_udp->write(this->_packetBuffer, NTP_PACKET_SIZE);
-  this->_udp->endPacket();
+  return this->_udp->endPacket() == 1;
 }
@@ -8,6 +8,26 @@
 #define NTP_PACKET_SIZE 48
 #define NTP_DEFAULT_LOCAL_PORT 1337
 
+// How long we wait for a reply, in ms
+#ifndef NTP_TIMEOUT
+#define NTP_TIMEOUT 1000
+#endif
+
+// Larger offsets, in ms, are corrected at once rather than slewed
+#ifndef NTP_STEP_THRESHOLD
+#define NTP_STEP_THRESHOLD 1000
+#endif
+
+// How long we measure our oscillator's error over, in ms, and the most
+// we'll believe it to be, in parts per billion
+#ifndef NTP_DRIFT_INTERVAL
+#define NTP_DRIFT_INTERVAL 600000
+#endif
+
+#ifndef NTP_MAX_DRIFT
+#define NTP_MAX_DRIFT 500000
+#endif
+
 
 extern "C" {
     /*
@@ -41,12 +61,36 @@ class NTPClient {
 
     unsigned long _updateInterval = 60000;  // In ms
 
-    unsigned long _currentEpoc    = 0;      // In s
+    // Our clock: its time at _baseMillis, in us since 1970, which advances
+    // at the rate of millis() corrected by _drift.  The last offset is
+    // slewed in over the following _updateInterval, rather than stepped.
+    // Microseconds, so that rounding doesn't add up over many updates.
+    int64_t       _baseEpoch      = 0;      // In us
+    unsigned long _baseMillis     = 0;      // In ms
+    long          _slew           = 0;      // In us
+    long          _drift          = 0;      // In parts per billion
+    int64_t       _driftError     = 0;      // In us
+    unsigned long _driftElapsed   = 0;      // In ms
     unsigned long _lastUpdate     = 0;      // In ms
 
+    unsigned long _syncCount      = 0;      // Successful updates
+    unsigned long _syncFailures   = 0;      // Updates which timed out
+    long          _lastOffset     = 0;      // In s
+    long          _lastOffsetMs   = 0;      // In ms
+    long          _lastDelay      = 0;      // Round-trip, in ms
+
+    bool          _waiting        = false;  // A request awaits its reply
+    unsigned long _requestSent    = 0;      // In ms
+    uint32_t      _requestCount   = 0;
+    byte          _requestStamp[8];         // Identifies the reply to our request
+
     byte          _packetBuffer[NTP_PACKET_SIZE];
 
-    void          sendNTPPacket();
+    bool          sendNTPPacket();
+    void          receiveNTPPacket();
+    void          discipline(unsigned long now, int64_t clock, int64_t offset);
+    long          slewAt(unsigned long now);
+    int64_t       clockAt(unsigned long now);
 
     /*
      * Callback handles.
@@ -90,14 +134,17 @@ class NTPClient {
      * This should be called in the main loop of your application. By default an update from the NTP Server is only
      * made every 60 seconds. This can be configured in the NTPClient constructor.
      *
-     * @return true on success, false on failure
+     * This never blocks: one call sends a request, and later calls read its reply.  Replies which arrive after
+     * NTP_TIMEOUT, or which don't answer our latest request, are ignored.
+     *
+     * @return false if our request timed out, true otherwise
      */
     bool update();
 
     /**
-     * This will force the update from the NTP Server.
+     * This will request an update from the NTP Server now, which update() will read.
      *
-     * @return true on success, false on failure
+     * @return true if the request was sent
      */
     bool forceUpdate();
 
@@ -147,6 +194,30 @@ class NTPClient {
      */
     unsigned long getEpochTime();
 
+    /**
+     * @return time in milliseconds since Jan. 1, 1970, corrected smoothly rather than jumping
+     */
+    uint64_t getEpochMillis();
+
+    /**
+     * @return the number of successful, and failed, updates
+     */
+    unsigned long getSyncCount();
+    unsigned long getSyncFailures();
+
+    /**
+     * @return how far our clock had drifted, in seconds, when it was last updated
+     */
+    long getLastOffset();
+
+    /**
+     * @return that offset in ms, the round-trip delay of the update in ms, and our
+     * estimate of the error of our oscillator in parts per billion
+     */
+    long getLastOffsetMillis();
+    long getLastDelay();
+    long getDrift();
+
     /**
      * Stops the underlying UDP client
      */
@@ -7,9 +7,84 @@
 #include "PubSubClient.h"
 #include "Arduino.h"
 
+#if MQTT_VERSION == MQTT_VERSION_5
+// Reads a variable byte integer, as used for lengths, returning the
+// number of bytes it occupied - or zero if it is malformed.
+static uint8_t readVarInt(const uint8_t* buf, uint32_t available, uint32_t* value)
+{
+    uint32_t multiplier = 1;
+    *value = 0;
+
+    for (uint8_t i = 0; (i < 4) && (i < available); i++)
+    {
+        *value += (buf[i] & 127) * multiplier;
+        multiplier *= 128;
+
+        if (!(buf[i] & 128))
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+// The size of the value of the given property, or zero if it is
+// unknown or runs past the end of the packet.
+static uint32_t propertySize(uint8_t id, const uint8_t* value, uint32_t available)
+{
+    uint32_t size = 0;
+    uint32_t v;
+
+    switch (id)
+    {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        size = 1;
+        break;
+
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        size = 2;
+        break;
+
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        size = 4;
+        break;
+
+    case 0x0B:
+        size = readVarInt(value, available, &v);
+        break;
+
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        size = (available >= 2) ? 2 + ((value[0] << 8) | value[1]) : 0;
+        break;
+
+    case 0x26:
+        // A pair of strings
+        if (available >= 2)
+        {
+            size = 2 + ((value[0] << 8) | value[1]);
+
+            if (available >= size + 2)
+            {
+                size += 2 + ((value[size] << 8) | value[size + 1]);
+            }
+            else
+            {
+                size = 0;
+            }
+        }
+
+        break;
+    }
+
+    return (size <= available) ? size : 0;
+}
+#endif
+
 PubSubClient::PubSubClient()
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     this->_client = NULL;
     this->stream = NULL;
     setCallback(NULL);
@@ -18,27 +93,34 @@ PubSubClient::PubSubClient()
 PubSubClient::PubSubClient(Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setClient(client);
     this->stream = NULL;
+    setCallback(NULL);
 }
 
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setClient(client);
     this->stream = NULL;
+    setCallback(NULL);
 }
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setClient(client);
     setStream(stream);
+    setCallback(NULL);
 }
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setCallback(callback);
     setClient(client);
@@ -47,6 +129,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(addr, port);
     setCallback(callback);
     setClient(client);
@@ -56,20 +139,25 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setClient(client);
     this->stream = NULL;
+    setCallback(NULL);
 }
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setClient(client);
     setStream(stream);
+    setCallback(NULL);
 }
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setCallback(callback);
     setClient(client);
@@ -78,6 +166,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(ip, port);
     setCallback(callback);
     setClient(client);
@@ -87,20 +176,25 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
 PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setClient(client);
     this->stream = NULL;
+    setCallback(NULL);
 }
 PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setClient(client);
     setStream(stream);
+    setCallback(NULL);
 }
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setCallback(callback);
     setClient(client);
@@ -109,12 +203,19 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream)
 {
     this->_state = MQTT_DISCONNECTED;
+    setBufferSize(MQTT_MAX_PACKET_SIZE);
     setServer(domain, port);
     setCallback(callback);
     setClient(client);
     setStream(stream);
 }
 
+PubSubClient::~PubSubClient()
+{
+    free(this->buffer);
+    free(this->batchBuffer);
+}
+
 boolean PubSubClient::connect(const char *id)
 {
     return connect(id, NULL, NULL, 0, 0, 0, 0);
@@ -132,317 +233,731 @@ boolean PubSubClient::connect(const char *id, const char* willTopic, uint8_t wil
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
 {
-    if (!connected())
+    if (connected())
+    {
+        return true;
+    }
+
+    if (!beginConnect(id, user, pass, willTopic, willQos, willRetain, willMessage))
     {
-        int result = 0;
+        return false;
+    }
 
-        if (domain != NULL)
-        {
-            result = _client->connect(this->domain, this->port);
-        }
-        else
+    while (_state == MQTT_CONNECTING)
+    {
+        if (pollConnect())
         {
-            result = _client->connect(this->ip, this->port);
+            return true;
         }
 
-        if (result == 1)
-        {
-            nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = 5;
-            unsigned int j;
+        yield();
+    }
 
-#if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 7
-#endif
+    return false;
+}
 
-            for (j = 0; j < MQTT_HEADER_VERSION_LENGTH; j++)
-            {
-                buffer[length++] = d[j];
-            }
+boolean PubSubClient::beginConnect(const char *id)
+{
+    return beginConnect(id, NULL, NULL, 0, 0, 0, 0);
+}
 
-            uint8_t v;
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
+{
+    int result = 0;
 
-            if (willTopic)
-            {
-                v = 0x06 | (willQos << 3) | (willRetain << 5);
-            }
-            else
-            {
-                v = 0x02;
-            }
+    if (this->bufferSize == 0)
+    {
+        // Our buffer couldn't be allocated
+        return connectFailed(MQTT_CONNECT_FAILED);
+    }
 
-            if (user != NULL)
-            {
-                v = v | 0x80;
+    // Any attempt still awaiting its CONNACK is abandoned.
+    if (_state == MQTT_CONNECTING)
+    {
+        _client->stop();
+    }
 
-                if (pass != NULL)
-                {
-                    v = v | (0x80 >> 1);
-                }
-            }
+    if (domain != NULL)
+    {
+        result = _client->connect(this->domain, this->port);
+    }
+    else
+    {
+        result = _client->connect(this->ip, this->port);
+    }
 
-            buffer[length++] = v;
+    if (result != 1)
+    {
+        return connectFailed(MQTT_CONNECT_FAILED);
+    }
 
-            buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
-            buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
-            length = writeString(id, buffer, length);
+    // A batch begun before connecting is kept open for what we send
+    // once connected.
+    boolean keepBatch = batching;
+
+    nextMsgId = 1;
+    rxState = RX_HEADER;
+    rxChunked = false;
+    // Anything batched for the previous connection is lost.
+    batching = false;
+    batchLength = 0;
+    batchPackets = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+    // As are the topic aliases; the broker's limits are in the CONNACK.
+    receiveMaximum = 65535;
+    aliasMaximum = 0;
+    aliasNext = 0;
+    memset(aliasTopics, 0, sizeof(aliasTopics));
+    rxProps = false;
+#endif
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = 5;
+    unsigned int j;
 
-            if (willTopic)
-            {
-                length = writeString(willTopic, buffer, length);
-                length = writeString(willMessage, buffer, length);
-            }
+#if MQTT_VERSION == MQTT_VERSION_3_1
+    uint8_t d[9] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 9
+#elif (MQTT_VERSION == MQTT_VERSION_3_1_1) || (MQTT_VERSION == MQTT_VERSION_5)
+    uint8_t d[7] = {0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 7
+#endif
 
-            if (user != NULL)
-            {
-                length = writeString(user, buffer, length);
+    // The header, flags, keepalive and each string must fit.
+    size_t needed = length + MQTT_HEADER_VERSION_LENGTH + 3 + 2 + strlen(id);
 
-                if (pass != NULL)
-                {
-                    length = writeString(pass, buffer, length);
-                }
-            }
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Our properties
+    needed += 6;
+#endif
 
-            write(MQTTCONNECT, buffer, length - 5);
+    if (willTopic)
+    {
+        needed += MQTT_NO_PROPERTIES_SIZE + 2 + strlen(willTopic) + 2 + strlen(willMessage);
+    }
 
-            lastInActivity = lastOutActivity = millis();
+    if (user != NULL)
+    {
+        needed += 2 + strlen(user) + ((pass != NULL) ? 2 + strlen(pass) : 0);
+    }
 
-            while (!_client->available())
-            {
-                unsigned long t = millis();
+    if (needed > bufferSize)
+    {
+        return connectFailed(MQTT_CONNECT_FAILED);
+    }
 
-                if (t - lastInActivity >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000UL))
-                {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
-            }
+    for (j = 0; j < MQTT_HEADER_VERSION_LENGTH; j++)
+    {
+        buffer[length++] = d[j];
+    }
 
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
+    uint8_t v;
 
-            if (len == 4)
-            {
-                if (buffer[3] == 0)
-                {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                }
-                else
-                {
-                    _state = buffer[3];
-                }
-            }
+    if (willTopic)
+    {
+        v = 0x06 | (willQos << 3) | (willRetain << 5);
+    }
+    else
+    {
+        v = 0x02;
+    }
 
-            _client->stop();
-        }
-        else
+    if (user != NULL)
+    {
+        v = v | 0x80;
+
+        if (pass != NULL)
         {
-            _state = MQTT_CONNECT_FAILED;
+            v = v | (0x80 >> 1);
         }
-
-        return false;
     }
 
-    return true;
-}
+    buffer[length++] = v;
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result)
-{
-    uint32_t previousMillis = millis();
+    buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
+    buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Properties: the largest packet we'll accept.
+    buffer[length++] = 5;
+    buffer[length++] = 0x27;
+    buffer[length++] = 0;
+    buffer[length++] = 0;
+    buffer[length++] = (bufferSize >> 8);
+    buffer[length++] = (bufferSize & 0xFF);
+#endif
+
+    length = writeString(id, buffer, length);
+
+    if (willTopic)
+    {
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No will properties
+        buffer[length++] = 0;
+#endif
+        length = writeString(willTopic, buffer, length);
+        length = writeString(willMessage, buffer, length);
+    }
 
-    while (!_client->available())
+    if (user != NULL)
     {
-        uint32_t currentMillis = millis();
+        length = writeString(user, buffer, length);
 
-        if (currentMillis - previousMillis >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000))
+        if (pass != NULL)
         {
-            return false;
+            length = writeString(pass, buffer, length);
         }
     }
 
-    *result = _client->read();
+    write(MQTTCONNECT, buffer, length - 5);
+
+    lastInActivity = lastOutActivity = millis();
+    batching = keepBatch;
+    _state = MQTT_CONNECTING;
     return true;
 }
 
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index)
+boolean PubSubClient::pollConnect(unsigned long timeout)
 {
-    uint16_t current_index = *index;
-    uint8_t * write_address = &(result[current_index]);
-
-    if (readByte(write_address))
+    if (_state != MQTT_CONNECTING)
     {
-        *index = current_index + 1;
-        return true;
+        return connected();
     }
 
-    return false;
-}
-
-uint16_t PubSubClient::readPacket(uint8_t* lengthLength)
-{
-    uint16_t len = 0;
-
-    if (!readByte(buffer, &len)) return 0;
-
-    bool isPublish = (buffer[0] & 0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint16_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint8_t start = 0;
+    uint8_t llen;
+    uint16_t len;
 
-    do
+    if (!pollPacket(&len, &llen))
     {
-        if (!readByte(&digit)) return 0;
+        if (!_client->connected() || (millis() - lastInActivity >= timeout))
+        {
+            rxState = RX_HEADER;
+            stats.connectTimeouts++;
+            return connectFailed(MQTT_CONNECTION_TIMEOUT);
+        }
 
-        buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier *= 128;
+        return false;
     }
-    while ((digit & 128) != 0);
 
-    *lengthLength = len - 1;
+    int reason = -1;
 
-    if (isPublish)
+    if ((rxBuffer[0] & 0xF0) == MQTTCONNACK)
     {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if (!readByte(buffer, &len)) return 0;
-
-        if (!readByte(buffer, &len)) return 0;
-
-        skip = (buffer[*lengthLength + 1] << 8) + buffer[*lengthLength + 2];
-        start = 2;
+#if MQTT_VERSION == MQTT_VERSION_5
+        // Flags and reason code, then properties.
+        if (len >= llen + 4)
+        {
+            reason = rxBuffer[llen + 2];
 
-        if (buffer[0]&MQTTQOS1)
+            if (reason == 0)
+            {
+                readConnack(rxBuffer + llen + 3, len - llen - 3);
+            }
+        }
+#else
+        if (len == 4)
         {
-            // skip message id
-            skip += 2;
+            reason = rxBuffer[3];
         }
+#endif
     }
 
-    for (uint16_t i = start; i < length; i++)
+    if (reason < 0)
     {
-        if (!readByte(&digit)) return 0;
+        stats.connectTimeouts++;
+        return connectFailed(MQTT_CONNECTION_TIMEOUT);
+    }
 
-        if (this->stream)
-        {
-            if (isPublish && len - *lengthLength - 2 > skip)
-            {
-                this->stream->write(digit);
-            }
-        }
+    if (reason != 0)
+    {
+        stats.connectRefused++;
+        return connectFailed(reason);
+    }
 
-        if (len < MQTT_MAX_PACKET_SIZE)
+    // A batch begun before this call is kept open for the caller.
+    boolean keepBatch = batching;
+
+    lastInActivity = millis();
+    pingOutstanding = false;
+    _state = MQTT_CONNECTED;
+    stats.connects++;
+
+    // Restore our subscriptions, before anything else, and
+    // send anything unacknowledged again, in one write.
+    beginBatch();
+    resubscribe();
+
+    for (uint8_t i = 0; i < inflightWindow; i++)
+    {
+        if (inflight[i].msgId != 0)
         {
-            buffer[len] = digit;
+            resend(i);
         }
-
-        len++;
     }
 
-    if (!this->stream && len > MQTT_MAX_PACKET_SIZE)
+    if (!keepBatch)
     {
-        len = 0; // This will cause the packet to be ignored.
+        endBatch();
     }
 
-    return len;
+    return true;
 }
 
-boolean PubSubClient::loop()
+// Gives up on a connection attempt, noting why.
+boolean PubSubClient::connectFailed(int state)
 {
-    if (connected())
-    {
-        unsigned long t = millis();
+    _state = state;
+    _client->stop();
+    batching = false;
+    batchLength = 0;
+    batchPackets = 0;
+    stats.connectFailures++;
+    stats.lastConnectFailure = state;
+    return false;
+}
 
-        if ((t - lastInActivity > MQTT_KEEPALIVE * 1000UL) || (t - lastOutActivity > MQTT_KEEPALIVE * 1000UL))
+// Reads whatever bytes are available into rxBuffer, without waiting.
+// Partial packets are kept until the next call.  Returns true when a
+// packet is complete, setting length to its size - or to zero if it
+// didn't fit in the buffer and must be ignored.  Packets which are too
+// large are counted in stats.oversizedPackets, see setBufferSize().
+boolean PubSubClient::pollPacket(uint16_t* length, uint8_t* lengthLength)
+{
+    while (_client->available())
+    {
+        if ((rxState == RX_BODY) && rxChunked && rxChunkStart)
         {
-            if (pingOutstanding)
+            // The payload of a chunked publish; read as much as fits.
+            uint32_t want = bufferSize - rxChunkStart - rxChunkFill;
+
+            if (want > rxRemaining)
             {
-                this->_state = MQTT_CONNECTION_TIMEOUT;
-                _client->stop();
-                return false;
+                want = rxRemaining;
             }
-            else
+
+            int got = _client->read(rxBuffer + rxChunkStart + rxChunkFill, want);
+
+            if (got <= 0)
             {
-                buffer[0] = MQTTPINGREQ;
-                buffer[1] = 0;
-                _client->write(buffer, 2);
-                lastOutActivity = t;
-                lastInActivity = t;
-                pingOutstanding = true;
+                break;
+            }
+
+            rxChunkFill += got;
+            rxLength += got;
+            rxRemaining -= got;
+
+            if ((rxChunkStart + rxChunkFill == bufferSize) || (rxRemaining == 0))
+            {
+                deliverChunk();
             }
         }
+        else if ((rxState == RX_BODY) && !this->stream && !rxChunked && (rxLength < bufferSize))
+        {
+            // Nothing to inspect; copy as much as we can at once.
+            uint32_t want = bufferSize - rxLength;
+
+            if (want > rxRemaining)
+            {
+                want = rxRemaining;
+            }
+
+            int got = _client->read(rxBuffer + rxLength, want);
+
+            if (got <= 0)
+            {
+                break;
+            }
 
-        if (_client->available())
+            rxLength += got;
+            rxRemaining -= got;
+        }
+        else
         {
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
-            uint16_t msgId = 0;
-            uint8_t *payload;
+            int c = _client->read();
 
-            if (len > 0)
+            if (c < 0)
             {
-                lastInActivity = t;
-                uint8_t type = buffer[0] & 0xF0;
+                break;
+            }
 
-                if (type == MQTTPUBLISH)
+            uint8_t digit = c;
+
+            if (rxState == RX_HEADER)
+            {
+                rxBuffer[0] = digit;
+                rxLength = 1;
+                rxRemaining = 0;
+                rxMultiplier = 1;
+                rxSkip = 0;
+                rxState = RX_LENGTH;
+                continue;
+            }
+            else if (rxState == RX_LENGTH)
+            {
+                // The remaining length is at most four bytes.
+                if ((rxLength == 4) && (digit & 128))
                 {
-                    if (callback)
-                    {
-                        uint16_t tl = (buffer[llen + 1] << 8) + buffer[llen + 2];
-                        char topic[tl + 1];
+                    rxState = RX_HEADER;
+                    _client->stop();
+                    return false;
+                }
 
-                        for (uint16_t i = 0; i < tl; i++)
-                        {
-                            topic[i] = buffer[llen + 3 + i];
-                        }
+                rxBuffer[rxLength++] = digit;
+                rxRemaining += (digit & 127) * rxMultiplier;
+                rxMultiplier *= 128;
 
-                        topic[tl] = 0;
+                if (digit & 128)
+                {
+                    continue;
+                }
 
-                        // msgId only present for QOS>0
-                        if ((buffer[0] & 0x06) == MQTTQOS1)
-                        {
-                            msgId = (buffer[llen + 3 + tl] << 8) + buffer[llen + 3 + tl + 1];
-                            payload = buffer + llen + 3 + tl + 2;
-                            callback(topic, payload, len - llen - 3 - tl - 2);
+                rxLengthLength = rxLength - 1;
+                rxState = RX_BODY;
+
+                // Publishes too large for the buffer may be passed on in
+                // parts, once their topic has been read.
+                rxChunked = chunkHandler && !this->stream &&
+                            ((rxBuffer[0] & 0xF0) == MQTTPUBLISH) &&
+                            (rxLength + rxRemaining > bufferSize);
+                rxChunkStart = 0;
+                rxChunkFill = 0;
+                rxChunkOffset = 0;
+            }
+            else
+            {
+                if (rxLength < bufferSize)
+                {
+                    rxBuffer[rxLength] = digit;
+                }
+
+                // Publishes are written to the stream, or chunked, after
+                // the topic and message-ID have been skipped.
+                if ((this->stream || rxChunked) && ((rxBuffer[0] & 0xF0) == MQTTPUBLISH))
+                {
+                    uint32_t pos = rxLength - rxLengthLength - 1;
 
-                            buffer[0] = MQTTPUBACK;
-                            buffer[1] = 2;
-                            buffer[2] = (msgId >> 8);
-                            buffer[3] = (msgId & 0xFF);
-                            _client->write(buffer, 4);
-                            lastOutActivity = t;
+                    if (pos == 1)
+                    {
+                        rxSkip = (rxBuffer[rxLengthLength + 1] << 8) + digit;
 
+                        if (rxBuffer[0] & MQTTQOS1)
+                        {
+                            rxSkip += 2;
                         }
-                        else
+
+#if MQTT_VERSION == MQTT_VERSION_5
+                        rxProps = true;
+                        rxPropsLength = 0;
+                        rxPropsMultiplier = 1;
+#endif
+                    }
+                    else if (pos >= 2 + (uint32_t)rxSkip)
+                    {
+#if MQTT_VERSION == MQTT_VERSION_5
+                        if (rxProps)
                         {
-                            payload = buffer + llen + 3 + tl;
-                            callback(topic, payload, len - llen - 3 - tl);
+                            // Skip the properties, once we know their length.
+                            rxPropsLength += (digit & 127) * rxPropsMultiplier;
+                            rxPropsMultiplier *= 128;
+                            rxSkip++;
+
+                            if (!(digit & 128))
+                            {
+                                rxProps = false;
+                                rxSkip += rxPropsLength;
+                            }
                         }
+                        else
+#endif
+                            if (this->stream)
+                            {
+                                this->stream->write(digit);
+                            }
+                            else if (rxLength < bufferSize)
+                            {
+                                // The first byte of the payload; the rest
+                                // is read in bulk, above.
+                                rxChunkStart = rxLength;
+                                rxChunkTotal = rxRemaining;
+                                rxChunkFill = 1;
+                            }
+                            else
+                            {
+                                // The topic filled the buffer; discard it all.
+                                rxChunked = false;
+                            }
                     }
                 }
-                else if (type == MQTTPINGREQ)
+
+                rxLength++;
+                rxRemaining--;
+
+                if (rxChunkFill && ((rxChunkStart + rxChunkFill == bufferSize) || (rxRemaining == 0)))
                 {
-                    buffer[0] = MQTTPINGRESP;
-                    buffer[1] = 0;
-                    _client->write(buffer, 2);
+                    deliverChunk();
                 }
-                else if (type == MQTTPINGRESP)
-                {
-                    pingOutstanding = false;
+            }
+        }
+
+        if ((rxState == RX_BODY) && (rxRemaining == 0))
+        {
+            rxState = RX_HEADER;
+            *lengthLength = rxLengthLength;
+            stats.packetsIn[rxBuffer[0] >> 4]++;
+            stats.bytesIn[rxBuffer[0] >> 4] += rxLength;
+
+            if (rxLength <= bufferSize)
+            {
+                *length = rxLength;
+            }
+            else
+            {
+                // Too large; with a stream the payload has been written
+                // there, or it has been chunked, otherwise the packet is
+                // ignored.
+                stats.oversizedPackets++;
+
+                if (rxLength > stats.largestOversizedPacket)
+                {
+                    stats.largestOversizedPacket = rxLength;
+                }
+
+                *length = this->stream ? bufferSize : 0;
+            }
+
+            if (rxChunked && (rxBuffer[0] & MQTTQOS1))
+            {
+                uint16_t msgPos = rxLengthLength + 3 + (rxBuffer[rxLengthLength + 1] << 8) + rxBuffer[rxLengthLength + 2];
+                buffer[0] = MQTTPUBACK;
+                buffer[1] = 2;
+                buffer[2] = rxBuffer[msgPos];
+                buffer[3] = rxBuffer[msgPos + 1];
+                _client->write(buffer, 4);
+                countSent(MQTTPUBACK, 4);
+                lastOutActivity = millis();
+            }
+
+            rxChunked = false;
+            return true;
+        }
+    }
+
+    // Pass on whatever part of a chunked payload has arrived.
+    if (rxChunked && rxChunkFill)
+    {
+        deliverChunk();
+    }
+
+    return false;
+}
+
+// Passes the part of a chunked payload gathered in rxBuffer to the
+// chunk handler, along with its topic.
+void PubSubClient::deliverChunk()
+{
+    uint16_t tl = (rxBuffer[rxLengthLength + 1] << 8) + rxBuffer[rxLengthLength + 2];
+    char topic[tl + 1];
+
+    memcpy(topic, rxBuffer + rxLengthLength + 3, tl);
+    topic[tl] = 0;
+
+    chunkHandler(topic, rxBuffer + rxChunkStart, rxChunkFill, rxChunkOffset, rxChunkTotal, chunkContext);
+    rxChunkOffset += rxChunkFill;
+    rxChunkFill = 0;
+}
+
+boolean PubSubClient::loop()
+{
+    unsigned long started = micros();
+    boolean rc = service();
+
+    stats.loops++;
+    stats.loopTime += micros() - started;
+    return rc;
+}
+
+boolean PubSubClient::service()
+{
+    if (connected())
+    {
+        unsigned long t = millis();
+
+        if ((t - lastInActivity > MQTT_KEEPALIVE * 1000UL) || (t - lastOutActivity > MQTT_KEEPALIVE * 1000UL))
+        {
+            if (pingOutstanding)
+            {
+                this->_state = MQTT_CONNECTION_TIMEOUT;
+                _client->stop();
+                stats.keepaliveTimeouts++;
+                return false;
+            }
+            else
+            {
+                buffer[0] = MQTTPINGREQ;
+                buffer[1] = 0;
+                _client->write(buffer, 2);
+                countSent(MQTTPINGREQ, 2);
+                pingSentAt = micros();
+                lastOutActivity = t;
+                lastInActivity = t;
+                pingOutstanding = true;
+            }
+        }
+
+        // Handle each packet which has arrived in full; anything
+        // partial is kept for next time.
+        uint8_t llen;
+        uint16_t len;
+
+        while (pollPacket(&len, &llen))
+        {
+            uint16_t msgId = 0;
+            uint8_t *payload;
+
+            if (len == 0)
+            {
+                continue;
+            }
+
+            lastInActivity = t;
+            uint8_t type = rxBuffer[0] & 0xF0;
+
+            if (type == MQTTPUBLISH)
+            {
+                uint16_t tl = (rxBuffer[llen + 1] << 8) + rxBuffer[llen + 2];
+                char topic[tl + 1];
+
+                for (uint16_t i = 0; i < tl; i++)
+                {
+                    topic[i] = rxBuffer[llen + 3 + i];
+                }
+
+                topic[tl] = 0;
+
+                // msgId only present for QOS>0
+                if ((rxBuffer[0] & 0x06) == MQTTQOS1)
+                {
+                    msgId = (rxBuffer[llen + 3 + tl] << 8) + rxBuffer[llen + 3 + tl + 1];
+                    payload = rxBuffer + llen + 3 + tl + 2;
+                }
+                else
+                {
+                    payload = rxBuffer + llen + 3 + tl;
+                }
+
+#if MQTT_VERSION == MQTT_VERSION_5
+                // Skip the properties.
+                uint32_t props;
+                uint8_t propsLength = readVarInt(payload, len - (payload - rxBuffer), &props);
+
+                if ((propsLength == 0) || (payload + propsLength + props > rxBuffer + len))
+                {
+                    continue;
+                }
+
+                payload += propsLength + props;
+#endif
+
+                unsigned int plength = len - (payload - rxBuffer);
+
+                if ((dispatch(trieRoot, topic, topic, payload, plength) == 0) && callback)
+                {
+                    callback(topic, payload, plength);
+                }
+
+                if (msgId != 0)
+                {
+                    buffer[0] = MQTTPUBACK;
+                    buffer[1] = 2;
+                    buffer[2] = (msgId >> 8);
+                    buffer[3] = (msgId & 0xFF);
+                    _client->write(buffer, 4);
+                    countSent(MQTTPUBACK, 4);
+                    lastOutActivity = t;
+                }
+            }
+            else if (type == MQTTPINGREQ)
+            {
+                buffer[0] = MQTTPINGRESP;
+                buffer[1] = 0;
+                _client->write(buffer, 2);
+                countSent(MQTTPINGRESP, 2);
+            }
+            else if ((type == MQTTPINGRESP) && pingOutstanding)
+            {
+                unsigned long rtt = micros() - pingSentAt;
+
+                pingOutstanding = false;
+                stats.pings++;
+                stats.pingTime = rtt;
+                stats.pingTimeTotal += rtt;
+
+                if (rtt > stats.pingTimeMax)
+                {
+                    stats.pingTimeMax = rtt;
+                }
+            }
+            else if ((type == MQTTPUBACK) && (len >= llen + 3))
+            {
+                msgId = (rxBuffer[llen + 1] << 8) + rxBuffer[llen + 2];
+
+#if MQTT_VERSION == MQTT_VERSION_5
+                // A reason code follows, unless the publish succeeded.
+                if ((len > llen + 3) && (rxBuffer[llen + 3] >= 0x80))
+                {
+                    stats.rejected++;
+                }
+#endif
+
+                for (uint8_t i = 0; i < inflightWindow; i++)
+                {
+                    if (inflight[i].msgId == msgId)
+                    {
+                        inflight[i].msgId = 0;
+                        inflightCount--;
+                        stats.acknowledged++;
+                        break;
+                    }
                 }
             }
+            else if ((type == MQTTSUBACK) && (len >= llen + 4))
+            {
+                // A result for each topic follows the msgId.
+                uint32_t pos = llen + 3;
+
+#if MQTT_VERSION == MQTT_VERSION_5
+                uint32_t props;
+                uint8_t propsLength = readVarInt(rxBuffer + pos, len - pos, &props);
+                pos = propsLength ? (pos + propsLength + props) : len;
+#endif
+
+                msgId = (rxBuffer[llen + 1] << 8) + rxBuffer[llen + 2];
+
+                for (uint8_t position = 0; pos < len; pos++, position++)
+                {
+                    if (rxBuffer[pos] >= 0x80)
+                    {
+                        stats.rejected++;
+                    }
+
+                    for (uint8_t i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+                    {
+                        if ((subscriptions[i].msgId == msgId) && (subscriptions[i].position == position) && (subscriptions[i].filter[0] != '\0'))
+                        {
+                            subscriptions[i].result = rxBuffer[pos];
+                            subscriptions[i].msgId = 0;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Resend anything which has waited too long for its PUBACK.
+        for (uint8_t i = 0; (i < inflightWindow) && inflightCount; i++)
+        {
+            if ((inflight[i].msgId != 0) && (millis() - inflight[i].sentAt >= MQTT_RETRY_TIMEOUT * 1000UL))
+            {
+                resend(i);
+            }
         }
 
         return true;
@@ -468,34 +983,176 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained)
 {
-    if (connected())
+    return publish(topic, payload, plength, retained, 0);
+}
+
+boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained, uint8_t qos)
+{
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retained, qos);
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos)
+{
+    return publish(MQTTTopic(topic), payload, plength, retained, qos);
+}
+
+boolean PubSubClient::publish(const MQTTTopic& topic, const char* payload, boolean retained, uint8_t qos)
+{
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retained, qos);
+}
+
+boolean PubSubClient::publish(const MQTTTopic& topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos)
+{
+    unsigned long started = micros();
+    boolean rc = publishPacket(topic, payload, plength, retained, qos);
+
+    stats.publishCalls++;
+    stats.publishTime += micros() - started;
+    return rc;
+}
+
+boolean PubSubClient::publishPacket(const MQTTTopic& topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos)
+{
+    if (connected() && (qos <= 1))
     {
-        if (MQTT_MAX_PACKET_SIZE < 5 + 2 + strlen(topic) + plength)
+        // QoS 1 adds a message-ID, MQTT 5 properties; perhaps an alias.
+        size_t needed = 5 + 2 + topic.length + (qos ? 2 : 0) + MQTT_NO_PROPERTIES_SIZE + plength;
+
+#if MQTT_VERSION == MQTT_VERSION_5
+        needed += 3;
+#endif
+
+        if (bufferSize < needed)
         {
             // Too long
+            stats.publishFailures++;
             return false;
         }
 
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = 5;
-        length = writeString(topic, buffer, length);
-        uint16_t i;
+        uint8_t slot = 0;
 
-        for (i = 0; i < plength; i++)
+        if (qos)
         {
-            buffer[length++] = payload[i];
+            while ((slot < inflightWindow) && (inflight[slot].msgId != 0))
+            {
+                slot++;
+            }
+
+#if MQTT_VERSION == MQTT_VERSION_5
+            if (inflightCount >= receiveMaximum)
+            {
+                slot = inflightWindow;
+            }
+#endif
+
+            if (slot == inflightWindow)
+            {
+                // The window is full
+                stats.publishFailures++;
+                return false;
+            }
         }
 
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = writeTopic(topic, buffer, 5);
+        uint16_t msgId = 0;
         uint8_t header = MQTTPUBLISH;
 
+        if (qos)
+        {
+            msgId = nextMessageId();
+            buffer[length++] = (msgId >> 8);
+            buffer[length++] = (msgId & 0xFF);
+            header |= MQTTQOS1;
+        }
+
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No properties
+        buffer[length++] = 0;
+#endif
+
+        memcpy(buffer + length, payload, plength);
+        length += plength;
+
         if (retained)
         {
             header |= 1;
         }
 
-        return write(header, buffer, length - 5);
+        if (qos)
+        {
+            // Keep a copy, until it is acknowledged.
+            inflight[slot].msgId = msgId;
+            inflight[slot].header = header;
+            inflight[slot].length = length - 5;
+            inflight[slot].sentAt = millis();
+            memcpy(inflightBuffer + slot * bufferSize, buffer + 5, length - 5);
+            inflightCount++;
+
+            if (inflightCount > stats.maxInflight)
+            {
+                stats.maxInflight = inflightCount;
+            }
+        }
+
+#if MQTT_VERSION == MQTT_VERSION_5
+        boolean known = false;
+        uint16_t alias = topicAlias(topic, &known);
+
+        if (alias)
+        {
+            // The first publish to a topic gives its alias, later ones
+            // carry only the alias.  Retransmissions are made from the
+            // copy above, with the topic in full.
+            uint16_t tlen = known ? 0 : topic.length;
+            uint16_t pos = 5 + 2 + tlen + (qos ? 2 : 0);
+
+            memmove(buffer + pos + 4, buffer + length - plength, plength);
+            buffer[5] = (tlen >> 8);
+            buffer[6] = (tlen & 0xFF);
+            memcpy(buffer + 7, topic.name, tlen);
+
+            if (qos)
+            {
+                buffer[pos - 2] = (msgId >> 8);
+                buffer[pos - 1] = (msgId & 0xFF);
+            }
+
+            buffer[pos++] = 3;
+            buffer[pos++] = 0x23;
+            buffer[pos++] = (alias >> 8);
+            buffer[pos++] = (alias & 0xFF);
+            length = pos + plength;
+
+            if (known)
+            {
+                stats.aliasedPublishes++;
+            }
+        }
+#endif
+
+        if (write(header, buffer, length - 5))
+        {
+            stats.publishes++;
+            return true;
+        }
+
+#if MQTT_VERSION == MQTT_VERSION_5
+        if (alias && !known)
+        {
+            // The broker may not have learned this alias.
+            aliasTopics[alias - 1][0] = '\0';
+        }
+#endif
+
+        if (qos)
+        {
+            // It will be sent again later.
+            return true;
+        }
     }
 
+    stats.publishFailures++;
     return false;
 }
 
@@ -512,6 +1169,14 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
 
     if (!connected())
     {
+        stats.publishFailures++;
+        return false;
+    }
+
+    // This is written directly, so anything batched must go first.
+    if (!flushBatch())
+    {
+        stats.publishFailures++;
         return false;
     }
 
@@ -525,7 +1190,84 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
     }
 
     buffer[pos++] = header;
-    len = plength + 2 + tlen;
+    len = plength + 2 + tlen + MQTT_NO_PROPERTIES_SIZE;
+
+    do
+    {
+        digit = len % 128;
+        len = len / 128;
+
+        if (len > 0)
+        {
+            digit |= 0x80;
+        }
+
+        buffer[pos++] = digit;
+        llen++;
+    }
+    while (len > 0);
+
+    pos = writeString(topic, buffer, pos);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+    // No properties
+    buffer[pos++] = 0;
+#endif
+
+    rc += _client->write(buffer, pos);
+
+    for (i = 0; i < plength; i++)
+    {
+        rc += _client->write((char)pgm_read_byte_near(payload + i));
+    }
+
+    lastOutActivity = millis();
+    countSent(buffer[0], rc);
+
+    if (rc == tlen + 4 + MQTT_NO_PROPERTIES_SIZE + plength)
+    {
+        stats.publishes++;
+        return true;
+    }
+
+    stats.publishFailures++;
+    return false;
+}
+
+boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained)
+{
+    return beginPublish(MQTTTopic(topic), plength, retained);
+}
+
+boolean PubSubClient::beginPublish(const MQTTTopic& topic, unsigned int plength, boolean retained)
+{
+    uint16_t tlen = topic.length;
+
+    if (!connected() || (bufferSize < 5 + 2 + tlen + MQTT_NO_PROPERTIES_SIZE))
+    {
+        stats.publishFailures++;
+        return false;
+    }
+
+    // This is written directly, so anything batched must go first.
+    if (!flushBatch())
+    {
+        stats.publishFailures++;
+        return false;
+    }
+
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = writeTopic(topic, buffer, 5);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+    // No properties
+    buffer[length++] = 0;
+#endif
+
+    uint8_t lenBuf[4];
+    uint8_t llen = 0;
+    uint8_t digit;
+    unsigned long len = 2 + tlen + MQTT_NO_PROPERTIES_SIZE + (unsigned long)plength;
 
     do
     {
@@ -537,92 +1279,381 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
             digit |= 0x80;
         }
 
-        buffer[pos++] = digit;
-        llen++;
+        lenBuf[llen++] = digit;
+    }
+    while ((len > 0) && (llen < 4));
+
+    buffer[4 - llen] = MQTTPUBLISH | (retained ? 1 : 0);
+
+    for (int i = 0; i < llen; i++)
+    {
+        buffer[5 - llen + i] = lenBuf[i];
+    }
+
+    streamRemaining = plength;
+    streamFailed = false;
+
+    if (!send(buffer + (4 - llen), length - (4 - llen)))
+    {
+        stats.publishFailures++;
+        return false;
+    }
+
+    // Counted in full, as though the payload were already written.
+    countSent(MQTTPUBLISH, 1 + llen + 2 + tlen + MQTT_NO_PROPERTIES_SIZE + (unsigned long)plength);
+    return true;
+}
+
+boolean PubSubClient::endPublish()
+{
+    if ((streamRemaining == 0) && !streamFailed)
+    {
+        stats.publishes++;
+        return true;
+    }
+
+    // The broker is still waiting for the rest of the packet, so the
+    // connection can't be used again.
+    streamRemaining = 0;
+    stats.publishFailures++;
+    _client->stop();
+    return false;
+}
+
+size_t PubSubClient::write(uint8_t data)
+{
+    return write(&data, 1);
+}
+
+size_t PubSubClient::write(const uint8_t *buf, size_t size)
+{
+    if (size > streamRemaining)
+    {
+        // Writing more than we promised would corrupt the stream.
+        streamFailed = true;
+        return 0;
+    }
+
+    size_t rc = _client->write(buf, size);
+
+    if (rc != size)
+    {
+        streamFailed = true;
+    }
+
+    streamRemaining -= rc;
+    lastOutActivity = millis();
+    return rc;
+}
+
+boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length)
+{
+    uint8_t lenBuf[4];
+    uint8_t llen = 0;
+    uint8_t digit;
+    uint8_t pos = 0;
+    uint16_t len = length;
+
+    do
+    {
+        digit = len % 128;
+        len = len / 128;
+
+        if (len > 0)
+        {
+            digit |= 0x80;
+        }
+
+        lenBuf[pos++] = digit;
+        llen++;
+    }
+    while (len > 0);
+
+    buf[4 - llen] = header;
+
+    for (int i = 0; i < llen; i++)
+    {
+        buf[5 - llen + i] = lenBuf[i];
+    }
+
+    uint8_t* packet = buf + (4 - llen);
+    uint16_t packetLength = length + 1 + llen;
+
+    countSent(header, packetLength);
+
+    if (batching)
+    {
+        if ((batchLength + packetLength > MQTT_BATCH_SIZE) && !flushBatch())
+        {
+            return false;
+        }
+
+        if (packetLength <= MQTT_BATCH_SIZE)
+        {
+            memcpy(batchBuffer + batchLength, packet, packetLength);
+            batchLength += packetLength;
+            batchPackets++;
+            return true;
+        }
+    }
+
+    return send(packet, packetLength);
+}
+
+boolean PubSubClient::send(const uint8_t* buf, uint16_t length)
+{
+    uint16_t rc;
+
+#ifdef MQTT_MAX_TRANSFER_SIZE
+    const uint8_t* writeBuf = buf;
+    uint16_t bytesRemaining = length; //Match the length type
+    uint8_t bytesToWrite;
+    boolean result = true;
+
+    while ((bytesRemaining > 0) && result)
+    {
+        bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE) ? MQTT_MAX_TRANSFER_SIZE : bytesRemaining;
+        rc = _client->write(writeBuf, bytesToWrite);
+        result = (rc == bytesToWrite);
+        bytesRemaining -= rc;
+        writeBuf += rc;
+    }
+
+    lastOutActivity = millis();
+    return result;
+#else
+    rc = _client->write(buf, length);
+    lastOutActivity = millis();
+    return (rc == length);
+#endif
+}
+
+// Counts a packet we've written, or are about to, by its type.
+void PubSubClient::countSent(uint8_t header, uint32_t length)
+{
+    stats.packetsOut[header >> 4]++;
+    stats.bytesOut[header >> 4] += length;
+}
+
+boolean PubSubClient::beginBatch()
+{
+    if (batchBuffer == NULL)
+    {
+        batchBuffer = (uint8_t*)malloc(MQTT_BATCH_SIZE);
+
+        if (batchBuffer == NULL)
+        {
+            return false;
+        }
+    }
+
+    batching = true;
+    return true;
+}
+
+boolean PubSubClient::endBatch()
+{
+    batching = false;
+    return flushBatch();
+}
+
+boolean PubSubClient::flushBatch()
+{
+    if (batchLength == 0)
+    {
+        return true;
+    }
+
+    boolean result = send(batchBuffer, batchLength);
+    stats.batches++;
+    stats.batchedPackets += batchPackets;
+    batchLength = 0;
+    batchPackets = 0;
+    return result;
+}
+
+boolean PubSubClient::subscribe(const char* topic)
+{
+    return subscribe(topic, 0);
+}
+
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
+{
+    return subscribe(&topic, &qos, 1);
+}
+
+boolean PubSubClient::subscribe(const char* const topics[], const uint8_t qos[], uint8_t count)
+{
+    boolean remembered = true;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (qos[i] > 1)
+        {
+            return false;
+        }
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        remembered = rememberSubscription(topics[i], qos[i]) && remembered;
+    }
+
+    if (connected())
+    {
+        return sendSubscribe(topics, qos, count);
+    }
+
+    return remembered;
+}
+
+// Writes a single SUBSCRIBE for the given filters, noting where each
+// remembered filter lies within it so its result can be found.
+boolean PubSubClient::sendSubscribe(const char* const filters[], const uint8_t qos[], uint8_t count)
+{
+    // Leave room in the buffer for header and variable length field
+    size_t needed = 5 + 2 + MQTT_NO_PROPERTIES_SIZE;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        needed += 2 + strlen(filters[i]) + 1;
+    }
+
+    if ((count == 0) || (bufferSize < needed))
+    {
+        // Too long
+        return false;
+    }
+
+    if (!connected())
+    {
+        return false;
+    }
+
+    uint16_t length = 5;
+    uint16_t msgId = nextMessageId();
+    buffer[length++] = (msgId >> 8);
+    buffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+    // No properties
+    buffer[length++] = 0;
+#endif
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        length = writeString(filters[i], buffer, length);
+        buffer[length++] = qos[i];
+
+        MQTTSubscription* sub = findSubscription(filters[i]);
+
+        if (sub)
+        {
+            sub->result = MQTT_SUBSCRIPTION_PENDING;
+            sub->msgId = msgId;
+            sub->position = i;
+        }
+    }
+
+    return write(MQTTSUBSCRIBE | MQTTQOS1, buffer, length - 5);
+}
+
+// Subscribes to each remembered filter, following a connection.  As
+// many are sent in each packet as the buffer will hold.
+boolean PubSubClient::resubscribe()
+{
+    const char* filters[MQTT_MAX_SUBSCRIPTIONS];
+    uint8_t qos[MQTT_MAX_SUBSCRIPTIONS];
+    uint8_t count = 0;
+    size_t length = 5 + 2 + MQTT_NO_PROPERTIES_SIZE;
+    boolean rc = true;
+
+    for (uint8_t i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    {
+        if (subscriptions[i].filter[0] == '\0')
+        {
+            continue;
+        }
+
+        size_t size = 2 + strlen(subscriptions[i].filter) + 1;
+
+        if (count && (length + size > bufferSize))
+        {
+            rc = sendSubscribe(filters, qos, count) && rc;
+            count = 0;
+            length = 5 + 2 + MQTT_NO_PROPERTIES_SIZE;
+        }
+
+        filters[count] = subscriptions[i].filter;
+        qos[count++] = subscriptions[i].qos;
+        length += size;
     }
-    while (len > 0);
-
-    pos = writeString(topic, buffer, pos);
-
-    rc += _client->write(buffer, pos);
 
-    for (i = 0; i < plength; i++)
+    if (count)
     {
-        rc += _client->write((char)pgm_read_byte_near(payload + i));
+        rc = sendSubscribe(filters, qos, count) && rc;
     }
 
-    lastOutActivity = millis();
-
-    return rc == tlen + 4 + plength;
+    return rc;
 }
 
-boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length)
+PubSubClient::MQTTSubscription* PubSubClient::findSubscription(const char* filter)
 {
-    uint8_t lenBuf[4];
-    uint8_t llen = 0;
-    uint8_t digit;
-    uint8_t pos = 0;
-    uint16_t rc;
-    uint16_t len = length;
-
-    do
+    for (uint8_t i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
     {
-        digit = len % 128;
-        len = len / 128;
-
-        if (len > 0)
+        if ((subscriptions[i].filter[0] != '\0') && (strcmp(subscriptions[i].filter, filter) == 0))
         {
-            digit |= 0x80;
+            return &subscriptions[i];
         }
-
-        lenBuf[pos++] = digit;
-        llen++;
     }
-    while (len > 0);
 
-    buf[4 - llen] = header;
+    return NULL;
+}
 
-    for (int i = 0; i < llen; i++)
+// Adds a filter to those we subscribe to on each connection, or updates
+// its QoS.  Returns false if it is too long, or there's no room.
+boolean PubSubClient::rememberSubscription(const char* filter, uint8_t qos)
+{
+    MQTTSubscription* sub = findSubscription(filter);
+
+    if ((sub == NULL) && (strlen(filter) < MQTT_SUBSCRIPTION_LENGTH))
     {
-        buf[5 - llen + i] = lenBuf[i];
+        for (uint8_t i = 0; (i < MQTT_MAX_SUBSCRIPTIONS) && (sub == NULL); i++)
+        {
+            if (subscriptions[i].filter[0] == '\0')
+            {
+                sub = &subscriptions[i];
+                strcpy(sub->filter, filter);
+                sub->result = MQTT_SUBSCRIPTION_PENDING;
+                sub->msgId = 0;
+            }
+        }
     }
 
-#ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf + (4 - llen);
-    uint16_t bytesRemaining = length + 1 + llen; //Match the length type
-    uint8_t bytesToWrite;
-    boolean result = true;
-
-    while ((bytesRemaining > 0) && result)
+    if (sub == NULL)
     {
-        bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE) ? MQTT_MAX_TRANSFER_SIZE : bytesRemaining;
-        rc = _client->write(writeBuf, bytesToWrite);
-        result = (rc == bytesToWrite);
-        bytesRemaining -= rc;
-        writeBuf += rc;
+        return false;
     }
 
-    return result;
-#else
-    rc = _client->write(buf + (4 - llen), length + 1 + llen);
-    lastOutActivity = millis();
-    return (rc == 1 + llen + length);
-#endif
+    sub->qos = qos;
+    return true;
 }
 
-boolean PubSubClient::subscribe(const char* topic)
+uint8_t PubSubClient::getSubscriptionResult(const char* topic)
 {
-    return subscribe(topic, 0);
+    MQTTSubscription* sub = findSubscription(topic);
+    return sub ? sub->result : MQTT_SUBSCRIPTION_PENDING;
 }
 
-boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
+boolean PubSubClient::unsubscribe(const char* topic)
 {
-    if (qos < 0 || qos > 1)
+    MQTTSubscription* sub = findSubscription(topic);
+
+    if (sub)
     {
-        return false;
+        sub->filter[0] = '\0';
     }
 
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic))
+    if (bufferSize < 9 + MQTT_NO_PROPERTIES_SIZE + strlen(topic))
     {
         // Too long
         return false;
@@ -630,36 +1661,107 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
 
     if (connected())
     {
-        // Leave room in the buffer for header and variable length field
         uint16_t length = 5;
-        nextMsgId++;
+        uint16_t msgId = nextMessageId();
+        buffer[length++] = (msgId >> 8);
+        buffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No properties
+        buffer[length++] = 0;
+#endif
+        length = writeString(topic, buffer, length);
+        return write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, length - 5);
+    }
 
-        if (nextMsgId == 0)
+    return false;
+}
+
+void PubSubClient::disconnect()
+{
+    batching = false;
+    flushBatch();
+    buffer[0] = MQTTDISCONNECT;
+    buffer[1] = 0;
+    _client->write(buffer, 2);
+    countSent(MQTTDISCONNECT, 2);
+    _state = MQTT_DISCONNECTED;
+    _client->stop();
+    lastInActivity = lastOutActivity = millis();
+}
+
+#if MQTT_VERSION == MQTT_VERSION_5
+// The broker's limits, from the properties of its CONNACK.
+void PubSubClient::readConnack(uint8_t* props, uint32_t length)
+{
+    uint32_t total;
+    uint8_t size = readVarInt(props, length, &total);
+
+    if ((size == 0) || (size + total > length))
+    {
+        return;
+    }
+
+    uint8_t* end = props + size + total;
+    props += size;
+
+    while (props < end)
+    {
+        uint8_t id = *props++;
+        uint32_t value = propertySize(id, props, end - props);
+
+        if (value == 0)
         {
-            nextMsgId = 1;
+            return;
         }
 
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString((char*)topic, buffer, length);
-        buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE | MQTTQOS1, buffer, length - 5);
-    }
+        if (id == 0x21)
+        {
+            receiveMaximum = (props[0] << 8) | props[1];
+        }
+        else if (id == 0x22)
+        {
+            uint16_t maximum = (props[0] << 8) | props[1];
+            aliasMaximum = (maximum < MQTT_TOPIC_ALIASES) ? maximum : MQTT_TOPIC_ALIASES;
+        }
 
-    return false;
+        props += value;
+    }
 }
 
-boolean PubSubClient::unsubscribe(const char* topic)
+// The alias for a topic, or zero if it can't have one.  known is set
+// if the broker has already been told of it.
+uint16_t PubSubClient::topicAlias(const MQTTTopic& topic, boolean* known)
 {
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic))
+    if ((aliasMaximum == 0) || (topic.length == 0) || (topic.length >= MQTT_ALIAS_TOPIC_LENGTH))
     {
-        // Too long
-        return false;
+        return 0;
     }
 
-    if (connected())
+    for (uint8_t i = 0; i < aliasMaximum; i++)
+    {
+        if (strcmp(aliasTopics[i], topic.name) == 0)
+        {
+            *known = true;
+            return i + 1;
+        }
+    }
+
+    // The next alias, replacing the oldest topic once all are in use.
+    uint8_t i = aliasNext;
+    aliasNext = (aliasNext + 1) % aliasMaximum;
+    strcpy(aliasTopics[i], topic.name);
+    *known = false;
+    return i + 1;
+}
+#endif
+
+// The next message-ID, skipping any still awaiting a PUBACK.
+uint16_t PubSubClient::nextMessageId()
+{
+    boolean inUse;
+
+    do
     {
-        uint16_t length = 5;
         nextMsgId++;
 
         if (nextMsgId == 0)
@@ -667,23 +1769,28 @@ boolean PubSubClient::unsubscribe(const char* topic)
             nextMsgId = 1;
         }
 
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString(topic, buffer, length);
-        return write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, length - 5);
+        inUse = false;
+
+        for (uint8_t i = 0; i < inflightWindow; i++)
+        {
+            if (inflight[i].msgId == nextMsgId)
+            {
+                inUse = true;
+            }
+        }
     }
+    while (inUse);
 
-    return false;
+    return nextMsgId;
 }
 
-void PubSubClient::disconnect()
+// Send an unacknowledged publish again, with the DUP flag set.
+boolean PubSubClient::resend(uint8_t slot)
 {
-    buffer[0] = MQTTDISCONNECT;
-    buffer[1] = 0;
-    _client->write(buffer, 2);
-    _state = MQTT_DISCONNECTED;
-    _client->stop();
-    lastInActivity = lastOutActivity = millis();
+    memcpy(buffer + 5, inflightBuffer + slot * bufferSize, inflight[slot].length);
+    inflight[slot].sentAt = millis();
+    stats.retransmits++;
+    return write(inflight[slot].header | 0x08, buffer, inflight[slot].length);
 }
 
 uint16_t PubSubClient::writeString(const char* string, uint8_t* buf, uint16_t pos)
@@ -703,6 +1810,14 @@ uint16_t PubSubClient::writeString(const char* string, uint8_t* buf, uint16_t po
     return pos;
 }
 
+uint16_t PubSubClient::writeTopic(const MQTTTopic& topic, uint8_t* buf, uint16_t pos)
+{
+    buf[pos++] = (topic.length >> 8);
+    buf[pos++] = (topic.length & 0xFF);
+    memcpy(buf + pos, topic.name, topic.length);
+    return pos + topic.length;
+}
+
 
 boolean PubSubClient::connected()
 {
@@ -721,10 +1836,16 @@ boolean PubSubClient::connected()
             if (this->_state == MQTT_CONNECTED)
             {
                 this->_state = MQTT_CONNECTION_LOST;
+                stats.connectionsLost++;
                 _client->flush();
                 _client->stop();
             }
         }
+        else if (this->_state == MQTT_CONNECTING)
+        {
+            // Not until the broker has accepted us.
+            rc = false;
+        }
     }
 
     return rc;
@@ -757,6 +1878,176 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE)
     return *this;
 }
 
+boolean PubSubClient::addHandler(const char* filter, MQTTHandler handler, void* context)
+{
+    uint8_t node = findNode(filter, true);
+
+    if (node == TRIE_NONE)
+    {
+        return false;
+    }
+
+    uint8_t h = trie[node].handler;
+
+    if (h == TRIE_NONE)
+    {
+        for (h = 0; (h < MQTT_MAX_HANDLERS) && (handlers[h].handler != NULL); h++)
+        {
+        }
+
+        if (h == MQTT_MAX_HANDLERS)
+        {
+            return false;
+        }
+
+        trie[node].handler = h;
+    }
+
+    handlers[h].handler = handler;
+    handlers[h].context = context;
+    return true;
+}
+
+boolean PubSubClient::removeHandler(const char* filter)
+{
+    // The nodes remain, to be reused if the filter is added again.
+    uint8_t node = findNode(filter, false);
+
+    if ((node == TRIE_NONE) || (trie[node].handler == TRIE_NONE))
+    {
+        return false;
+    }
+
+    handlers[trie[node].handler].handler = NULL;
+    trie[node].handler = TRIE_NONE;
+    return true;
+}
+
+// Find the node for the last level of the filter, optionally adding
+// nodes for any levels which are missing.
+uint8_t PubSubClient::findNode(const char* filter, boolean create)
+{
+    uint8_t* link = &trieRoot;
+    const char* level = filter;
+
+    while (true)
+    {
+        const char* end = strchr(level, '/');
+        uint16_t len = end ? (end - level) : strlen(level);
+
+        // Wildcards must be a whole level, and "#" the last.
+        for (uint16_t i = 0; i < len; i++)
+        {
+            if (((level[i] == '+') || (level[i] == '#')) && ((len != 1) || (end && (level[i] == '#'))))
+            {
+                return TRIE_NONE;
+            }
+        }
+
+        uint8_t node;
+
+        for (node = *link; node != TRIE_NONE; node = trie[node].sibling)
+        {
+            if ((trie[node].labelLength == len) && (memcmp(trieLabels + trie[node].label, level, len) == 0))
+            {
+                break;
+            }
+        }
+
+        if (node == TRIE_NONE)
+        {
+            if (!create || (trieUsed == MQTT_TRIE_NODES) || (trieLabelsUsed + len > MQTT_TRIE_LABELS))
+            {
+                return TRIE_NONE;
+            }
+
+            node = trieUsed++;
+            memcpy(trieLabels + trieLabelsUsed, level, len);
+            trie[node].label = trieLabelsUsed;
+            trie[node].labelLength = len;
+            trie[node].child = TRIE_NONE;
+            trie[node].sibling = *link;
+            trie[node].handler = TRIE_NONE;
+            trieLabelsUsed += len;
+            *link = node;
+        }
+
+        if (end == NULL)
+        {
+            return node;
+        }
+
+        link = &trie[node].child;
+        level = end + 1;
+    }
+}
+
+// Pass a message to the handlers of each filter it matches, among the
+// node and its siblings, and their children.  Returns the number called.
+uint8_t PubSubClient::dispatch(uint8_t node, const char* level, const char* topic, const uint8_t* payload, unsigned int length)
+{
+    uint8_t called = 0;
+    const char* end = strchr(level, '/');
+    uint16_t len = end ? (end - level) : strlen(level);
+
+    // Wildcards don't match topics such as "$SYS/...".
+    boolean wild = (level != topic) || (topic[0] != '$');
+
+    for (; node != TRIE_NONE; node = trie[node].sibling)
+    {
+        const char* label = trieLabels + trie[node].label;
+        uint8_t labelLength = trie[node].labelLength;
+
+        if ((labelLength == 1) && (label[0] == '#'))
+        {
+            if (wild)
+            {
+                called += callHandler(node, topic, payload, length);
+            }
+
+            continue;
+        }
+
+        if (!((wild && (labelLength == 1) && (label[0] == '+')) ||
+                ((labelLength == len) && (memcmp(label, level, len) == 0))))
+        {
+            continue;
+        }
+
+        if (end != NULL)
+        {
+            called += dispatch(trie[node].child, end + 1, topic, payload, length);
+            continue;
+        }
+
+        called += callHandler(node, topic, payload, length);
+
+        // "a/#" matches "a" too.
+        for (uint8_t child = trie[node].child; child != TRIE_NONE; child = trie[child].sibling)
+        {
+            if ((trie[child].labelLength == 1) && (trieLabels[trie[child].label] == '#'))
+            {
+                called += callHandler(child, topic, payload, length);
+            }
+        }
+    }
+
+    return called;
+}
+
+uint8_t PubSubClient::callHandler(uint8_t node, const char* topic, const uint8_t* payload, unsigned int length)
+{
+    uint8_t h = trie[node].handler;
+
+    if ((h == TRIE_NONE) || (handlers[h].handler == NULL))
+    {
+        return 0;
+    }
+
+    handlers[h].handler(topic, payload, length, handlers[h].context);
+    return 1;
+}
+
 PubSubClient& PubSubClient::setClient(Client& client)
 {
     this->_client = &client;
@@ -769,7 +2060,68 @@ PubSubClient& PubSubClient::setStream(Stream& stream)
     return *this;
 }
 
+PubSubClient& PubSubClient::setChunkHandler(MQTTChunkHandler handler, void* context)
+{
+    this->chunkHandler = handler;
+    this->chunkContext = context;
+    return *this;
+}
+
 int PubSubClient::state()
 {
     return this->_state;
 }
+
+boolean PubSubClient::setBufferSize(uint16_t size)
+{
+    return allocate(size, this->inflightWindow);
+}
+
+boolean PubSubClient::setInflightWindow(uint8_t window)
+{
+    return allocate(this->bufferSize, window);
+}
+
+boolean PubSubClient::allocate(uint16_t size, uint8_t window)
+{
+    // Resizing would lose the copies of in-flight publishes.
+    if ((size == 0) || (window > MQTT_MAX_INFLIGHT) || (this->inflightCount > 0))
+    {
+        return false;
+    }
+
+    // One allocation; outgoing packets first, then incoming ones,
+    // then a slot for each QoS 1 publish in flight.
+    uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, (2 + window) * (size_t)size);
+
+    if (newBuffer == NULL)
+    {
+        // The previous buffer, if any, remains in use.
+        return false;
+    }
+
+    this->buffer = newBuffer;
+    this->rxBuffer = newBuffer + size;
+    this->inflightBuffer = newBuffer + 2 * size;
+    this->bufferSize = size;
+    this->inflightWindow = window;
+
+    // Any partially-read packet has been lost.
+    this->rxState = RX_HEADER;
+    return true;
+}
+
+uint16_t PubSubClient::getBufferSize()
+{
+    return this->bufferSize;
+}
+
+uint8_t PubSubClient::getInflightCount()
+{
+    return this->inflightCount;
+}
+
+const MQTTStats& PubSubClient::getStats()
+{
+    return this->stats;
+}
@@ -12,8 +12,14 @@
 #include "Client.h"
 #include "Stream.h"
 
+// Beyond these headers we use only millis(), micros(), yield() and
+// pgm_read_byte_near(), and reach the network through the Client
+// interface alone.  So the client can also be built on a Linux host;
+// see ../host for a fake broker, and benchmarks.
+
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
+#define MQTT_VERSION_5        5
 
 // MQTT_VERSION : Pick the version
 //#define MQTT_VERSION MQTT_VERSION_3_1
@@ -21,11 +27,47 @@
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
-// MQTT_MAX_PACKET_SIZE : Maximum packet size
+#if MQTT_VERSION == MQTT_VERSION_5
+// MQTT_TOPIC_ALIASES : The most topics we'll publish to by alias
+#ifndef MQTT_TOPIC_ALIASES
+#define MQTT_TOPIC_ALIASES 4
+#endif
+
+// MQTT_ALIAS_TOPIC_LENGTH : Longer topics are never given an alias
+#ifndef MQTT_ALIAS_TOPIC_LENGTH
+#define MQTT_ALIAS_TOPIC_LENGTH 32
+#endif
+
+// Packets carry properties; ours are usually empty, costing a byte.
+#define MQTT_NO_PROPERTIES_SIZE 1
+#else
+#define MQTT_NO_PROPERTIES_SIZE 0
+#endif
+
+// MQTT_MAX_PACKET_SIZE : Default maximum packet size, see setBufferSize()
 #ifndef MQTT_MAX_PACKET_SIZE
 #define MQTT_MAX_PACKET_SIZE 128
 #endif
 
+// MQTT_MAX_INFLIGHT : Maximum QoS 1 publishes awaiting a PUBACK, see setInflightWindow()
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+
+// MQTT_RETRY_TIMEOUT : Seconds to wait for a PUBACK before resending
+#ifndef MQTT_RETRY_TIMEOUT
+#define MQTT_RETRY_TIMEOUT 10
+#endif
+
+// MQTT_BATCH_SIZE : Bytes of packets gathered between beginBatch() and endBatch()
+#ifndef MQTT_BATCH_SIZE
+#ifdef TCP_MSS
+#define MQTT_BATCH_SIZE TCP_MSS
+#else
+#define MQTT_BATCH_SIZE 536
+#endif
+#endif
+
 // MQTT_KEEPALIVE : keepAlive interval in Seconds
 #ifndef MQTT_KEEPALIVE
 #define MQTT_KEEPALIVE 15
@@ -41,7 +83,9 @@
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
-// Possible values for client.state()
+// Possible values for client.state(); with MQTT 5 a failed connection
+// gives the reason code from the broker, 0x80 or above, instead.
+#define MQTT_CONNECTING             -5
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -73,33 +117,227 @@
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
 
-#ifdef ESP8266
-#include <functional>
-#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
-#else
-#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+// MQTT_MAX_SUBSCRIPTIONS : Topic filters we'll subscribe to again on each connection
+#ifndef MQTT_MAX_SUBSCRIPTIONS
+#define MQTT_MAX_SUBSCRIPTIONS 4
+#endif
+
+// MQTT_SUBSCRIPTION_LENGTH : Longer filters are subscribed to only once
+#ifndef MQTT_SUBSCRIPTION_LENGTH
+#define MQTT_SUBSCRIPTION_LENGTH 32
+#endif
+
+// The result of a subscription, when it isn't the QoS the broker granted
+#define MQTT_SUBSCRIPTION_FAILED  0x80 // Or above; refused by the broker
+#define MQTT_SUBSCRIPTION_PENDING 0xFF // No SUBACK yet, or not subscribed
+
+// MQTT_MAX_HANDLERS : Topic filters which may have a handler, see addHandler()
+#ifndef MQTT_MAX_HANDLERS
+#define MQTT_MAX_HANDLERS 8
+#endif
+
+// MQTT_TRIE_NODES : Levels of topic filters we can hold, shared between them
+#ifndef MQTT_TRIE_NODES
+#define MQTT_TRIE_NODES 24
 #endif
 
-class PubSubClient
+// MQTT_TRIE_LABELS : Bytes of topic filters we can hold, shared between them
+#ifndef MQTT_TRIE_LABELS
+#define MQTT_TRIE_LABELS 128
+#endif
+
+#if (MQTT_TRIE_NODES > 254) || (MQTT_MAX_HANDLERS > 254)
+#error "The topic-filter trie is indexed with bytes"
+#endif
+
+// Called for messages which match no handler.
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+
+// Called for messages matching the topic filter it was added with.
+typedef void (*MQTTHandler)(const char* topic, const uint8_t* payload, unsigned int length, void* context);
+
+// Called with each part of a message too large for the buffer, as it
+// arrives: length bytes at offset, of a payload of total bytes.
+typedef void (*MQTTChunkHandler)(const char* topic, const uint8_t* data, unsigned int length, uint32_t offset, uint32_t total, void* context);
+
+// A topic whose length is found once, rather than on each publish, for
+// the topics a sketch publishes to again and again.  The name isn't
+// copied, so must remain valid.
+class MQTTTopic
+{
+public:
+    explicit MQTTTopic(const char* name) : name(name), length(strlen(name)) {}
+    const char* const name;
+    const uint16_t length;
+};
+
+// Counters, for monitoring
+typedef struct
+{
+    unsigned long publishes;        // Messages published
+    unsigned long publishFailures;  // Messages which could not be published
+    unsigned long connects;         // Successful connections
+    unsigned long connectFailures;  // Failed connection attempts
+    unsigned long oversizedPackets; // Received packets too large for our buffer
+    unsigned long largestOversizedPacket; // The size of the largest of those
+    unsigned long acknowledged;     // QoS 1 publishes acknowledged by the broker
+    unsigned long retransmits;      // QoS 1 publishes sent again, with DUP set
+    unsigned long maxInflight;      // The most QoS 1 publishes awaiting a PUBACK
+    unsigned long batches;          // Batches written, each with a single write
+    unsigned long batchedPackets;   // Packets written as part of those batches
+    unsigned long rejected;         // Publishes & subscriptions refused by the broker
+    unsigned long aliasedPublishes; // Publishes sent with a topic alias, not the topic
+    // Why connection attempts failed, and connections ended
+    unsigned long connectRefused;   // Attempts the broker refused, in its CONNACK
+    unsigned long connectTimeouts;  // Attempts the broker didn't answer in time
+    long lastConnectFailure;        // The state() following the last failed attempt
+    unsigned long keepaliveTimeouts; // Connections dropped for want of a PINGRESP
+    unsigned long connectionsLost;  // Connections closed beneath us
+    // Packets & bytes sent and received, indexed by type: MQTTPUBLISH >> 4, etc
+    unsigned long packetsIn[16];
+    unsigned long packetsOut[16];
+    unsigned long bytesIn[16];
+    unsigned long bytesOut[16];
+    // The round-trip time of our PINGREQs, in microseconds
+    unsigned long pings;            // PINGRESPs received
+    unsigned long pingTime;         // The most recent
+    unsigned long pingTimeMax;
+    unsigned long pingTimeTotal;
+    // Time spent inside loop() & publish(), in microseconds
+    unsigned long loops;
+    uint64_t loopTime;
+    unsigned long publishCalls;
+    uint64_t publishTime;
+} MQTTStats;
+
+class PubSubClient : public Print
 {
 private:
     Client* _client;
-    uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+    uint8_t* buffer = NULL;
+    // Incoming packets are assembled separately, so that publishing
+    // between calls to loop() can't disturb a partially-read packet.
+    // Both halves share a single allocation; see setBufferSize().
+    uint8_t* rxBuffer = NULL;
+    uint16_t bufferSize = 0;
+    // QoS 1 publishes awaiting a PUBACK.  Each has a slot of bufferSize
+    // bytes, following rxBuffer, holding its topic, msgId & payload.
+    typedef struct
+    {
+        uint16_t msgId;             // Zero when the slot is free
+        uint8_t header;
+        uint16_t length;
+        unsigned long sentAt;
+    } MQTTInflight;
+    MQTTInflight inflight[MQTT_MAX_INFLIGHT] = {};
+    uint8_t* inflightBuffer = NULL;
+    uint8_t inflightWindow = 0;
+    uint8_t inflightCount = 0;
+    boolean allocate(uint16_t size, uint8_t window);
+    boolean resend(uint8_t slot);
+    uint16_t nextMessageId();
+    // Packets gathered by beginBatch(), allocated on first use.
+    uint8_t* batchBuffer = NULL;
+    uint16_t batchLength = 0;
+    uint16_t batchPackets = 0;
+    boolean batching = false;
+    boolean flushBatch();
+    // Topic filters, held as a trie with a node for each level, linked
+    // by index.  Each node's label is held in trieLabels.
+    enum { TRIE_NONE = 0xFF };
+    typedef struct
+    {
+        uint16_t label;
+        uint8_t labelLength;
+        uint8_t child;
+        uint8_t sibling;
+        uint8_t handler;            // Index in handlers, or TRIE_NONE
+    } MQTTTrieNode;
+    typedef struct
+    {
+        MQTTHandler handler;
+        void* context;
+    } MQTTHandlerEntry;
+    MQTTTrieNode trie[MQTT_TRIE_NODES];
+    uint8_t trieRoot = TRIE_NONE;
+    uint8_t trieUsed = 0;
+    char trieLabels[MQTT_TRIE_LABELS];
+    uint16_t trieLabelsUsed = 0;
+    MQTTHandlerEntry handlers[MQTT_MAX_HANDLERS] = {};
+    uint8_t findNode(const char* filter, boolean create);
+    uint8_t dispatch(uint8_t node, const char* level, const char* topic, const uint8_t* payload, unsigned int length);
+    uint8_t callHandler(uint8_t node, const char* topic, const uint8_t* payload, unsigned int length);
+    // Topic filters to subscribe to on each connection, and the result
+    // of their latest SUBSCRIBE: the packet's msgId, and their position
+    // within it, identify their result in the SUBACK.
+    typedef struct
+    {
+        char filter[MQTT_SUBSCRIPTION_LENGTH]; // Empty when the slot is free
+        uint8_t qos;
+        uint8_t result;
+        uint16_t msgId;
+        uint8_t position;
+    } MQTTSubscription;
+    MQTTSubscription subscriptions[MQTT_MAX_SUBSCRIPTIONS] = {};
+    MQTTSubscription* findSubscription(const char* filter);
+    boolean rememberSubscription(const char* filter, uint8_t qos);
+    boolean sendSubscribe(const char* const filters[], const uint8_t qos[], uint8_t count);
+    boolean resubscribe();
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Limits the broker sent in its CONNACK, and the topics we've
+    // given aliases to on this connection.
+    uint16_t receiveMaximum;
+    uint8_t aliasMaximum;
+    uint8_t aliasNext;
+    char aliasTopics[MQTT_TOPIC_ALIASES][MQTT_ALIAS_TOPIC_LENGTH];
+    uint16_t topicAlias(const MQTTTopic& topic, boolean* known);
+    void readConnack(uint8_t* props, uint32_t length);
+    // Reading the properties of a PUBLISH which is being streamed.
+    boolean rxProps;
+    uint32_t rxPropsLength;
+    uint32_t rxPropsMultiplier;
+#endif
+    // Payload bytes still expected by a streamed publish.
+    unsigned int streamRemaining = 0;
+    boolean streamFailed = false;
+    // An oversized publish being passed to the chunk handler: where its
+    // payload is gathered in rxBuffer, and how much has been passed on.
+    MQTTChunkHandler chunkHandler = NULL;
+    void* chunkContext = NULL;
+    boolean rxChunked = false;
+    uint16_t rxChunkStart;
+    uint16_t rxChunkFill;
+    uint32_t rxChunkOffset;
+    uint32_t rxChunkTotal;
+    void deliverChunk();
+    enum { RX_HEADER, RX_LENGTH, RX_BODY };
+    uint8_t rxState = RX_HEADER;
+    uint8_t rxLengthLength;
+    uint32_t rxLength;
+    uint32_t rxRemaining;
+    uint32_t rxMultiplier;
+    uint16_t rxSkip;
     uint16_t nextMsgId;
     unsigned long lastOutActivity;
     unsigned long lastInActivity;
     bool pingOutstanding;
+    unsigned long pingSentAt;
     MQTT_CALLBACK_SIGNATURE;
-    uint16_t readPacket(uint8_t*);
-    boolean readByte(uint8_t * result);
-    boolean readByte(uint8_t * result, uint16_t * index);
+    boolean pollPacket(uint16_t* length, uint8_t* lengthLength);
+    boolean connectFailed(int state);
     boolean write(uint8_t header, uint8_t* buf, uint16_t length);
+    boolean send(const uint8_t* buf, uint16_t length);
+    void countSent(uint8_t header, uint32_t length);
+    boolean service();
+    boolean publishPacket(const MQTTTopic& topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos);
     uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
+    uint16_t writeTopic(const MQTTTopic& topic, uint8_t* buf, uint16_t pos);
     IPAddress ip;
     const char* domain;
     uint16_t port;
     Stream* stream;
     int _state;
+    MQTTStats stats = {};
 public:
     PubSubClient();
     PubSubClient(Client& client);
@@ -115,30 +353,107 @@ public:
     PubSubClient(const char*, uint16_t, Client& client, Stream&);
     PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE, Client& client);
     PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE, Client& client, Stream&);
+    ~PubSubClient();
 
     PubSubClient& setServer(IPAddress ip, uint16_t port);
     PubSubClient& setServer(uint8_t * ip, uint16_t port);
     PubSubClient& setServer(const char * domain, uint16_t port);
     PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+
+    // Call handler, with the given context, for each message whose topic
+    // matches filter, which may include the wildcards "+" and "#".  Each
+    // filter has one handler; adding another replaces it.  Returns false
+    // if the filter is invalid, or there's no room for it.
+    //
+    // This doesn't subscribe; a message matching several filters is
+    // passed to each of their handlers.
+    boolean addHandler(const char* filter, MQTTHandler handler, void* context = NULL);
+    boolean removeHandler(const char* filter);
     PubSubClient& setClient(Client& client);
     PubSubClient& setStream(Stream& stream);
 
+    // Pass messages which don't fit in the buffer to handler, in parts,
+    // rather than discarding them.  Each part is passed as soon as it
+    // has arrived, or the buffer is full, along with the topic - which
+    // must fit in the buffer.  Not used while a stream is set.
+    PubSubClient& setChunkHandler(MQTTChunkHandler handler, void* context = NULL);
+
+    // Resize the buffers used for outgoing and incoming packets, which
+    // default to MQTT_MAX_PACKET_SIZE bytes each.  Returns false, leaving
+    // the current buffers in place, if the memory can't be allocated or
+    // QoS 1 publishes are in flight.
+    boolean setBufferSize(uint16_t size);
+    uint16_t getBufferSize();
+
+    // Allow up to `window` QoS 1 publishes to await a PUBACK at once,
+    // at most MQTT_MAX_INFLIGHT.  The default of zero disables QoS 1.
+    // Each costs a further buffer, and the same rules apply.
+    boolean setInflightWindow(uint8_t window);
+    uint8_t getInflightCount();
+
     boolean connect(const char* id);
     boolean connect(const char* id, const char* user, const char* pass);
     boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
     boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+    // Connect without waiting for the broker: beginConnect() opens the
+    // connection and sends the CONNECT, leaving state() MQTT_CONNECTING,
+    // then each call to pollConnect() reads whatever of the CONNACK has
+    // arrived.  It returns true once connected.  While it returns false
+    // and the state is still MQTT_CONNECTING the answer is awaited;
+    // otherwise the attempt was refused, lost, or not answered within
+    // timeout milliseconds of the CONNECT.  connect() is the two, with
+    // a wait between.  Opening the connection may itself block, as the
+    // Client decides.
+    boolean beginConnect(const char* id);
+    boolean beginConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+    boolean pollConnect(unsigned long timeout = MQTT_SOCKET_TIMEOUT * 1000UL);
     void disconnect();
     boolean publish(const char* topic, const char* payload);
     boolean publish(const char* topic, const char* payload, boolean retained);
     boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
     boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+    // For QoS 1 these return true once the message is in the in-flight
+    // window; it is resent until acknowledged, even across reconnects.
+    // They return false, without waiting, when the window is full.
+    boolean publish(const char* topic, const char* payload, boolean retained, uint8_t qos);
+    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, uint8_t qos);
+    boolean publish(const MQTTTopic& topic, const char* payload, boolean retained = false, uint8_t qos = 0);
+    boolean publish(const MQTTTopic& topic, const uint8_t * payload, unsigned int plength, boolean retained = false, uint8_t qos = 0);
     boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+    // Stream a QoS 0 publish of plength bytes straight to the network;
+    // after beginPublish() write the payload, in as many pieces as you
+    // like, then call endPublish().  The payload isn't copied, so it
+    // isn't limited by the buffer-size.  endPublish() returns false if
+    // fewer, or more, than plength bytes were written.
+    boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
+    boolean beginPublish(const MQTTTopic& topic, unsigned int plength, boolean retained);
+    boolean endPublish();
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    // Gather the packets of the following publishes & subscriptions,
+    // up to MQTT_BATCH_SIZE bytes, and send them with a single write
+    // when endBatch() is called.  Returns false if the batch could not
+    // be written.  A batch begun before connect() also holds the packets
+    // sent on connecting, so they may go out along with the caller's.
+    boolean beginBatch();
+    boolean endBatch();
+    // Subscriptions are remembered, and made again on each connection,
+    // in as few packets as possible.  Returns false if the SUBSCRIBE
+    // couldn't be sent - unless we're disconnected, and the filters have
+    // been remembered for when we connect.
     boolean subscribe(const char* topic);
     boolean subscribe(const char* topic, uint8_t qos);
+    // Subscribe to several filters, each with its own QoS, in one packet.
+    boolean subscribe(const char* const topics[], const uint8_t qos[], uint8_t count);
     boolean unsubscribe(const char* topic);
+    // The QoS the broker granted a subscription, or MQTT_SUBSCRIPTION_FAILED
+    // and above if it was refused, or MQTT_SUBSCRIPTION_PENDING.
+    uint8_t getSubscriptionResult(const char* topic);
     boolean loop();
     boolean connected();
     int state();
+    const MQTTStats& getStats();
 };
 
 
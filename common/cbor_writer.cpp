@@ -0,0 +1,215 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// Our header.
+//
+#include "cbor_writer.h"
+
+
+/*
+ * The major types, in the top three bits of an item's initial byte.
+ */
+#define CBOR_UNSIGNED 0x00
+#define CBOR_NEGATIVE 0x20
+#define CBOR_BYTES    0x40
+#define CBOR_TEXT     0x60
+#define CBOR_ARRAY    0x80
+#define CBOR_MAP      0xA0
+
+/*
+ * The simple values, and the other initial bytes we write.
+ */
+#define CBOR_FALSE      0xF4
+#define CBOR_TRUE       0xF5
+#define CBOR_NULL       0xF6
+#define CBOR_FLOAT      0xFA
+#define CBOR_INDEFINITE 0x1F
+#define CBOR_BREAK      0xFF
+
+
+/*
+ * Write to the given output.
+ */
+CBORWriter::CBORWriter(Print &out) : m_out(&out)
+{
+}
+
+
+/*
+ * Write to the given buffer.
+ */
+CBORWriter::CBORWriter(uint8_t *buf, size_t size) : m_buf(buf), m_size(size)
+{
+}
+
+
+void CBORWriter::begin_object()
+{
+    put(CBOR_MAP | CBOR_INDEFINITE);
+}
+
+void CBORWriter::end_object()
+{
+    put(CBOR_BREAK);
+}
+
+void CBORWriter::begin_array()
+{
+    put(CBOR_ARRAY | CBOR_INDEFINITE);
+}
+
+void CBORWriter::end_array()
+{
+    put(CBOR_BREAK);
+}
+
+
+/*
+ * Write the name of the next member of an object.
+ */
+void CBORWriter::key(const char *name)
+{
+    value(name);
+}
+
+
+void CBORWriter::value(const char *str)
+{
+    if (str == NULL)
+    {
+        null_value();
+        return;
+    }
+
+    size_t len = strlen(str);
+
+    head(CBOR_TEXT, len);
+    put((const uint8_t *)str, len);
+}
+
+
+void CBORWriter::value(long num)
+{
+    //
+    // Negative numbers are stored as -1 - n.
+    //
+    if (num < 0)
+        head(CBOR_NEGATIVE, (unsigned long)(-1 - num));
+    else
+        head(CBOR_UNSIGNED, (unsigned long)num);
+}
+
+void CBORWriter::value(unsigned long num)
+{
+    head(CBOR_UNSIGNED, num);
+}
+
+void CBORWriter::value(int num)
+{
+    value((long)num);
+}
+
+void CBORWriter::value(unsigned int num)
+{
+    value((unsigned long)num);
+}
+
+void CBORWriter::value(double num)
+{
+    float f = num;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+
+    put(CBOR_FLOAT);
+    put(bits >> 24);
+    put(bits >> 16);
+    put(bits >> 8);
+    put(bits);
+}
+
+void CBORWriter::value(bool flag)
+{
+    put(flag ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void CBORWriter::value(const uint8_t *data, size_t len)
+{
+    head(CBOR_BYTES, len);
+    put(data, len);
+}
+
+void CBORWriter::null_value()
+{
+    put(CBOR_NULL);
+}
+
+
+/*
+ * The number of bytes written.
+ */
+size_t CBORWriter::length()
+{
+    return m_length;
+}
+
+
+/*
+ * Did the output fail to fit in our buffer?
+ */
+bool CBORWriter::overflow()
+{
+    return (m_out == NULL) && (m_length > m_size);
+}
+
+
+/*
+ * Write the initial byte of an item, followed by its argument in as
+ * few bytes as will hold it.
+ */
+void CBORWriter::head(uint8_t major, unsigned long arg)
+{
+    if (arg < 24)
+    {
+        put(major | arg);
+    }
+    else if (arg <= 0xFF)
+    {
+        put(major | 24);
+        put(arg);
+    }
+    else if (arg <= 0xFFFF)
+    {
+        put(major | 25);
+        put(arg >> 8);
+        put(arg);
+    }
+    else
+    {
+        put(major | 26);
+        put(arg >> 24);
+        put(arg >> 16);
+        put(arg >> 8);
+        put(arg);
+    }
+}
+
+
+void CBORWriter::put(uint8_t c)
+{
+    if (m_out != NULL)
+        m_out->write(c);
+    else if (m_length < m_size)
+        m_buf[m_length] = c;
+
+    m_length += 1;
+}
+
+
+void CBORWriter::put(const uint8_t *data, size_t len)
+{
+    while (len--)
+        put(*data++);
+}
@@ -0,0 +1,120 @@
+#ifndef CBOR_WRITER_H
+#define CBOR_WRITER_H
+
+#include <Arduino.h>
+
+
+/*
+ * A streaming CBOR writer, which makes no heap allocations.
+ *
+ * CBOR (RFC 8949) is a binary encoding of the same data as JSON, so
+ * this follows `JSONWriter`, writing either to a `Print` or to a fixed
+ * buffer:
+ *
+ *   uint8_t payload[64];
+ *   CBORWriter cbor(payload, sizeof(payload));
+ *
+ *   cbor.begin_object();
+ *   cbor.add("temperature", 21.5);
+ *   cbor.add("id", ESP.getChipId());
+ *   cbor.end_object();
+ *
+ *   client.publish("temperature", payload, cbor.length());
+ *
+ * Objects and arrays are written with an indefinite length, so their
+ * size needn't be known in advance.  Integers take as few bytes as
+ * their value allows, and doubles are written as single-precision
+ * floats - which still hold more precision than our sensors offer.
+ *
+ * When writing to a buffer output which doesn't fit is discarded, and
+ * `overflow()` will return true.  A NULL buffer, of size zero, discards
+ * everything; `length()` then gives the size of the output.
+ */
+class CBORWriter
+{
+public:
+
+    /*
+     * Write to the given output.
+     */
+    CBORWriter(Print &out);
+
+    /*
+     * Write to the given buffer.
+     */
+    CBORWriter(uint8_t *buf, size_t size);
+
+    /*
+     * Start/end an object or array.
+     */
+    void begin_object();
+    void end_object();
+    void begin_array();
+    void end_array();
+
+    /*
+     * Write the name of the next member of an object.
+     */
+    void key(const char *name);
+
+    /*
+     * Write a value.
+     *
+     * A NULL string is written as `null`.
+     */
+    void value(const char *str);
+    void value(long num);
+    void value(unsigned long num);
+    void value(int num);
+    void value(unsigned int num);
+    void value(double num);
+    void value(bool flag);
+    void value(const uint8_t *data, size_t len);
+    void null_value();
+
+    /*
+     * Write a member of an object, its name & value.
+     */
+    template <typename T> void add(const char *name, T val)
+    {
+        key(name);
+        value(val);
+    }
+
+    /*
+     * The number of bytes written.
+     */
+    size_t length();
+
+    /*
+     * Did the output fail to fit in our buffer?
+     */
+    bool overflow();
+
+private:
+
+    /*
+     * Write the initial byte of an item, and its argument.
+     */
+    void head(uint8_t major, unsigned long arg);
+
+    /*
+     * Write raw output.
+     */
+    void put(uint8_t c);
+    void put(const uint8_t *data, size_t len);
+
+    /*
+     * Our output; either a Print or a buffer.
+     */
+    Print *m_out = NULL;
+    uint8_t *m_buf = NULL;
+    size_t m_size = 0;
+
+    /*
+     * The number of bytes written, or attempted.
+     */
+    size_t m_length = 0;
+};
+
+#endif /* CBOR_WRITER_H */
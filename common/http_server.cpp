@@ -0,0 +1,647 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// Our header.
+//
+#include "http_server.h"
+
+
+/*
+ * A Print which discards its output, counting the bytes.
+ *
+ * This is used to find the length of a response-body.
+ */
+class HTTPCounter : public Print
+{
+public:
+    size_t write(uint8_t c)
+    {
+        m_length += 1;
+        return 1;
+    }
+
+    size_t write(const uint8_t *buf, size_t len)
+    {
+        m_length += len;
+        return len;
+    }
+
+    long length()
+    {
+        return m_length;
+    }
+
+private:
+    long m_length = 0;
+};
+
+
+/*
+ * A Print which collects output into segment-sized blocks before
+ * writing it to the client.
+ */
+class HTTPOutput : public Print
+{
+public:
+    HTTPOutput(WiFiClient &client) : m_client(client)
+    {
+    }
+
+    size_t write(uint8_t c)
+    {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t *buf, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            if (m_used == sizeof(m_buffer))
+                send();
+
+            m_buffer[m_used++] = buf[i];
+        }
+
+        return len;
+    }
+
+    /*
+     * Write anything which is pending.
+     */
+    void send()
+    {
+        if (m_used > 0)
+            m_client.write(m_buffer, m_used);
+
+        m_used = 0;
+    }
+
+private:
+    WiFiClient &m_client;
+
+    /*
+     * Only one response is written at a time, so the buffer is shared.
+     */
+    static uint8_t m_buffer[HTTP_BUFFER_SIZE];
+    size_t m_used = 0;
+};
+
+uint8_t HTTPOutput::m_buffer[HTTP_BUFFER_SIZE];
+
+
+/*
+ * Return the text which describes the given status-code.
+ */
+static const char *status_text(int code)
+{
+    switch (code)
+    {
+    case 101:
+        return "Switching Protocols";
+
+    case 200:
+        return "OK";
+
+    case 302:
+        return "Found";
+
+    case 304:
+        return "Not Modified";
+
+    case 400:
+        return "Bad Request";
+
+    case 404:
+        return "Not Found";
+
+    case 408:
+        return "Request Timeout";
+
+    case 414:
+        return "URI Too Long";
+
+    case 503:
+        return "Service Unavailable";
+
+    default:
+        return "Unknown";
+    }
+}
+
+
+/*
+ * Does the given comma-separated header-value contain the given token?
+ */
+static bool header_has(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+
+    while (*value)
+    {
+        while (*value == ' ' || *value == ',')
+            value++;
+
+        if ((strncasecmp(value, token, len) == 0) &&
+                (value[len] == '\0' || value[len] == ',' || value[len] == ' '))
+            return true;
+
+        while (*value && *value != ',')
+            value++;
+    }
+
+    return false;
+}
+
+
+/*
+ * Copy a header-value into place, truncating it if we must.
+ */
+static void header_copy(char *dest, size_t size, const char *value)
+{
+    size_t length = strlen(value);
+
+    if (length > size - 1)
+        length = size - 1;
+
+    memcpy(dest, value, length);
+    dest[length] = '\0';
+}
+
+
+/////////////////////////////////////////////////////
+//
+// HTTPRequest
+//
+
+const char *HTTPRequest::method()
+{
+    return m_method;
+}
+
+const char *HTTPRequest::path()
+{
+    return m_path;
+}
+
+const char *HTTPRequest::if_none_match()
+{
+    return m_if_none_match;
+}
+
+const char *HTTPRequest::websocket_key()
+{
+    return m_websocket_key;
+}
+
+bool HTTPRequest::keep_alive()
+{
+    return m_keep_alive;
+}
+
+WiFiClient &HTTPRequest::client()
+{
+    return m_client;
+}
+
+
+/*
+ * Send a response, the body of which is generated by the given function.
+ */
+void HTTPRequest::send(int code, const char *type, HTTPRenderer body)
+{
+    //
+    // Find the length of the body, without storing it.
+    //
+    HTTPCounter counter;
+    body(counter);
+
+    HTTPOutput out(m_client);
+    out.printf("HTTP/1.1 %d %s\r\n", code, status_text(code));
+    out.printf("Content-Type: %s\r\n", type);
+    out.printf("Content-Length: %ld\r\n", counter.length());
+    out.printf("Connection: %s\r\n\r\n", m_keep_alive ? "keep-alive" : "close");
+
+    if (strcmp(m_method, "HEAD") != 0)
+        body(out);
+
+    out.send();
+}
+
+
+/*
+ * Send a response with the given, fixed, body.
+ */
+void HTTPRequest::send(int code, const char *type, const char *body)
+{
+    HTTPOutput out(m_client);
+    out.printf("HTTP/1.1 %d %s\r\n", code, status_text(code));
+    out.printf("Content-Type: %s\r\n", type);
+    out.printf("Content-Length: %ld\r\n", (long)strlen(body));
+    out.printf("Connection: %s\r\n\r\n", m_keep_alive ? "keep-alive" : "close");
+
+    if (strcmp(m_method, "HEAD") != 0)
+        out.print(body);
+
+    out.send();
+}
+
+
+/*
+ * Send a redirection.
+ */
+void HTTPRequest::redirect(const char *location)
+{
+    HTTPOutput out(m_client);
+    out.printf("HTTP/1.1 302 %s\r\n", status_text(302));
+    out.printf("Location: %s\r\n", location);
+    out.print("Content-Length: 0\r\n");
+    out.printf("Connection: %s\r\n\r\n", m_keep_alive ? "keep-alive" : "close");
+    out.send();
+}
+
+
+/*
+ * Send the status-line and headers of a response.
+ */
+void HTTPRequest::send_headers(int code, const char *type, long length, const char *extra)
+{
+    HTTPOutput out(m_client);
+    out.printf("HTTP/1.1 %d %s\r\n", code, status_text(code));
+
+    if (type != NULL)
+        out.printf("Content-Type: %s\r\n", type);
+
+    if (length >= 0)
+        out.printf("Content-Length: %ld\r\n", length);
+
+    out.print(extra);
+    out.printf("Connection: %s\r\n\r\n", m_keep_alive ? "keep-alive" : "close");
+    out.send();
+}
+
+
+/*
+ * Take ownership of the client.
+ */
+void HTTPRequest::detach()
+{
+    m_client = WiFiClient();
+    m_state = CLOSED;
+}
+
+
+/*
+ * Close the connection.
+ */
+void HTTPRequest::close()
+{
+    m_keep_alive = false;
+    m_client.stop();
+    m_state = CLOSED;
+}
+
+
+/*
+ * Forget the previous request.
+ */
+void HTTPRequest::reset()
+{
+    m_state = IDLE;
+    m_line_len = 0;
+    m_method[0] = '\0';
+    m_path[0] = '\0';
+    m_if_none_match[0] = '\0';
+    m_websocket_key[0] = '\0';
+    m_keep_alive = false;
+    m_content_length = 0;
+    m_in_request = false;
+}
+
+
+/*
+ * Handle a complete line of the request.
+ */
+void HTTPRequest::parse_line()
+{
+    //
+    // Terminate the line, removing the trailing "\r".
+    //
+    if ((m_line_len > 0) && (m_line[m_line_len - 1] == '\r'))
+        m_line_len -= 1;
+
+    m_line[m_line_len] = '\0';
+    m_line_len = 0;
+
+    if (m_state == IDLE)
+    {
+        //
+        // Blank lines between requests are ignored.
+        //
+        if (m_line[0] == '\0')
+            return;
+
+        //
+        // We expect "METHOD PATH VERSION".
+        //
+        char *path = strchr(m_line, ' ');
+        char *version = path ? strchr(path + 1, ' ') : NULL;
+
+        if ((path == NULL) || (version == NULL) || ((size_t)(path - m_line) >= sizeof(m_method)))
+        {
+            send(400, "text/plain", "Bad Request\n");
+            m_client.stop();
+            m_state = CLOSED;
+            return;
+        }
+
+        *path++ = '\0';
+        *version++ = '\0';
+
+        header_copy(m_method, sizeof(m_method), m_line);
+        header_copy(m_path, sizeof(m_path), path);
+
+        //
+        // HTTP/1.1 connections persist by default, HTTP/1.0 ones don't.
+        //
+        m_keep_alive = (strcmp(version, "HTTP/1.1") == 0);
+        m_state = HEADERS;
+        return;
+    }
+
+    //
+    // A blank line terminates the headers.
+    //
+    if (m_line[0] == '\0')
+    {
+        m_state = (m_content_length > 0) ? BODY : DONE;
+        return;
+    }
+
+    char *value = strchr(m_line, ':');
+
+    if (value == NULL)
+        return;
+
+    *value++ = '\0';
+
+    while (*value == ' ')
+        value++;
+
+    if (strcasecmp(m_line, "Connection") == 0)
+    {
+        if (header_has(value, "close"))
+            m_keep_alive = false;
+
+        if (header_has(value, "keep-alive"))
+            m_keep_alive = true;
+    }
+    else if (strcasecmp(m_line, "Content-Length") == 0)
+    {
+        m_content_length = atol(value);
+    }
+    else if (strcasecmp(m_line, "If-None-Match") == 0)
+    {
+        header_copy(m_if_none_match, sizeof(m_if_none_match), value);
+    }
+    else if (strcasecmp(m_line, "Sec-WebSocket-Key") == 0)
+    {
+        header_copy(m_websocket_key, sizeof(m_websocket_key), value);
+    }
+}
+
+
+/////////////////////////////////////////////////////
+//
+// HTTPServer
+//
+
+/*
+ * Constructor.
+ */
+HTTPServer::HTTPServer(int port) : m_server(port)
+{
+}
+
+
+/*
+ * Start listening.
+ */
+void HTTPServer::begin()
+{
+    m_server.begin();
+
+    //
+    // We buffer our own output, so there's no need to wait for
+    // small segments to be coalesced.
+    //
+    m_server.setNoDelay(true);
+}
+
+
+/*
+ * Set the function which handles each request.
+ */
+void HTTPServer::on_request(HTTPHandler handler)
+{
+    m_handler = handler;
+}
+
+
+/*
+ * Accept new connections, and handle any complete requests.
+ */
+void HTTPServer::handle()
+{
+    unsigned long started = millis();
+
+    while (m_server.hasClient())
+    {
+        WiFiClient client = m_server.available();
+        bool accepted = false;
+
+        for (int i = 0; i < HTTP_MAX_CLIENTS; i++)
+        {
+            if (m_requests[i].m_state == HTTPRequest::CLOSED)
+            {
+                m_requests[i].m_client = client;
+                m_requests[i].m_last_activity = millis();
+                m_requests[i].reset();
+
+                //
+                // The client must send its request promptly.
+                //
+                m_requests[i].m_in_request = true;
+                m_requests[i].m_started = millis();
+                accepted = true;
+                break;
+            }
+        }
+
+        //
+        // If we're busy say so, rather than leaving the client waiting.
+        //
+        if (!accepted)
+        {
+            client.print("HTTP/1.1 503 Service Unavailable\r\n"
+                         "Retry-After: 1\r\n"
+                         "Content-Length: 0\r\n"
+                         "Connection: close\r\n\r\n");
+            client.stop();
+            m_rejected += 1;
+        }
+    }
+
+    //
+    // Service each connection, starting from a different one each time
+    // so that a busy client can't starve the others of our budget.
+    //
+    for (int i = 0; i < HTTP_MAX_CLIENTS; i++)
+    {
+        HTTPRequest &r = m_requests[(m_next + i) % HTTP_MAX_CLIENTS];
+
+        if (r.m_state != HTTPRequest::CLOSED)
+            handle_connection(r, started);
+    }
+
+    m_next = (m_next + 1) % HTTP_MAX_CLIENTS;
+}
+
+
+/*
+ * Statistics.
+ */
+unsigned long HTTPServer::served()
+{
+    return m_served;
+}
+
+unsigned long HTTPServer::rejected()
+{
+    return m_rejected;
+}
+
+unsigned long HTTPServer::timed_out()
+{
+    return m_timed_out;
+}
+
+
+/*
+ * Read from the given connection, handling each request as it completes.
+ *
+ * Pipelined requests are handled in the order they arrived.
+ */
+void HTTPServer::handle_connection(HTTPRequest &r, unsigned long started)
+{
+    uint8_t buf[64];
+
+    while (r.m_client.available() && (millis() - started < HTTP_LOOP_BUDGET))
+    {
+        int len = r.m_client.read(buf, sizeof(buf));
+
+        if (len <= 0)
+            break;
+
+        r.m_last_activity = millis();
+
+        for (int i = 0; i < len; i++)
+        {
+            //
+            // The first byte of a request starts its clock.
+            //
+            if (!r.m_in_request)
+            {
+                r.m_in_request = true;
+                r.m_started = r.m_last_activity;
+            }
+
+            if (r.m_state == HTTPRequest::BODY)
+            {
+                //
+                // We don't handle request-bodies; skip them.
+                //
+                r.m_content_length -= 1;
+
+                if (r.m_content_length <= 0)
+                    r.m_state = HTTPRequest::DONE;
+            }
+            else if (buf[i] == '\n')
+            {
+                r.parse_line();
+            }
+            else if (r.m_line_len < sizeof(r.m_line) - 1)
+            {
+                r.m_line[r.m_line_len++] = buf[i];
+            }
+            else if (r.m_state == HTTPRequest::IDLE)
+            {
+                r.send(414, "text/plain", "URI Too Long\n");
+                r.m_client.stop();
+                r.m_state = HTTPRequest::CLOSED;
+            }
+
+            if (r.m_state == HTTPRequest::CLOSED)
+                return;
+
+            if (r.m_state != HTTPRequest::DONE)
+                continue;
+
+            //
+            // We have a complete request.
+            //
+            if (m_handler)
+                m_handler(r);
+            else
+                r.send(404, "text/plain", "Not Found\n");
+
+            m_served += 1;
+
+            //
+            // The handler might have taken the connection.
+            //
+            if (r.m_state == HTTPRequest::CLOSED)
+                return;
+
+            if (!r.m_keep_alive)
+            {
+                r.m_client.stop();
+                r.m_state = HTTPRequest::CLOSED;
+                return;
+            }
+
+            r.reset();
+        }
+    }
+
+    unsigned long now = millis();
+
+    //
+    // Give up on requests which are taking too long to arrive.
+    //
+    // If bytes are waiting it is because we ran out of budget, which
+    // isn't the client's fault.
+    //
+    if (r.m_in_request && !r.m_client.available() &&
+            (now - r.m_started > HTTP_REQUEST_TIMEOUT))
+    {
+        r.m_keep_alive = false;
+        r.send(408, "text/plain", "Request Timeout\n");
+        r.m_client.stop();
+        r.m_state = HTTPRequest::CLOSED;
+        m_timed_out += 1;
+        return;
+    }
+
+    //
+    // Close connections which have gone away, or sat idle too long.
+    //
+    if (!r.m_client.connected() ||
+            (now - r.m_last_activity > HTTP_IDLE_TIMEOUT))
+    {
+        r.m_client.stop();
+        r.m_state = HTTPRequest::CLOSED;
+    }
+}
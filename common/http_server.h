@@ -0,0 +1,312 @@
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include <ESP8266WiFi.h>
+
+/*
+ * The number of connections we'll keep open at once.
+ */
+#ifndef HTTP_MAX_CLIENTS
+#define HTTP_MAX_CLIENTS 2
+#endif
+
+/*
+ * How long a kept-alive connection may sit idle, in ms.
+ */
+#ifndef HTTP_IDLE_TIMEOUT
+#define HTTP_IDLE_TIMEOUT 5000
+#endif
+
+/*
+ * How long a client may take to send a complete request, in ms.
+ *
+ * Clients which take longer receive "408 Request Timeout".
+ */
+#ifndef HTTP_REQUEST_TIMEOUT
+#define HTTP_REQUEST_TIMEOUT 2000
+#endif
+
+/*
+ * The longest time a single call to `HTTPServer::handle()` will spend
+ * reading requests, in ms.  Anything left over waits for the next call.
+ */
+#ifndef HTTP_LOOP_BUDGET
+#define HTTP_LOOP_BUDGET 50
+#endif
+
+/*
+ * The longest request-line, or header, we'll read.
+ *
+ * Longer request-lines are refused, longer headers are truncated.
+ */
+#define HTTP_MAX_LINE 256
+
+/*
+ * Responses are written to the client in blocks of this size, which
+ * matches the TCP maximum segment size.
+ */
+#ifdef TCP_MSS
+#define HTTP_BUFFER_SIZE TCP_MSS
+#else
+#define HTTP_BUFFER_SIZE 1460
+#endif
+
+
+/*
+ * A function which prints the body of a response.
+ *
+ * This will be called twice: once to find the length of the body,
+ * and once to send it.  So it must produce the same output each time.
+ */
+typedef void (*HTTPRenderer)(Print &out);
+
+
+/*
+ * A single HTTP-request, which is also used to send the response.
+ */
+class HTTPRequest
+{
+    friend class HTTPServer;
+
+public:
+
+    /*
+     * The method - "GET", "HEAD", etc.
+     */
+    const char *method();
+
+    /*
+     * The requested path, including any query-string.
+     */
+    const char *path();
+
+    /*
+     * The value of the `If-None-Match` header, or "".
+     */
+    const char *if_none_match();
+
+    /*
+     * The value of the `Sec-WebSocket-Key` header, or "".
+     */
+    const char *websocket_key();
+
+    /*
+     * Will the connection be kept open after our response?
+     */
+    bool keep_alive();
+
+    /*
+     * The client which made the request.
+     */
+    WiFiClient &client();
+
+    /*
+     * Send a response, the body of which is generated by the given
+     * function.
+     */
+    void send(int code, const char *type, HTTPRenderer body);
+
+    /*
+     * Send a response with the given, fixed, body.
+     */
+    void send(int code, const char *type, const char *body);
+
+    /*
+     * Send a redirection to the given location.
+     */
+    void redirect(const char *location);
+
+    /*
+     * Send the status-line and headers of a response.
+     *
+     * `extra` may contain further header-lines, each terminated by
+     * "\r\n".  If `length` is negative no `Content-Length` is sent.
+     */
+    void send_headers(int code, const char *type, long length, const char *extra = "");
+
+    /*
+     * Take ownership of the client, after upgrading to another
+     * protocol.  The server will no longer read from it.
+     */
+    void detach();
+
+    /*
+     * Close the connection, such as when a response couldn't be sent
+     * in full and the client can no longer tell where the next begins.
+     */
+    void close();
+
+private:
+
+    /*
+     * Parsing states.
+     */
+    typedef enum {IDLE, HEADERS, BODY, DONE, CLOSED} parse_state;
+
+    /*
+     * Forget the previous request, ready for the next one.
+     */
+    void reset();
+
+    /*
+     * Handle a complete line of the request.
+     */
+    void parse_line();
+
+    /*
+     * The connection itself.
+     */
+    WiFiClient m_client;
+
+    /*
+     * Where we are in the current request.
+     */
+    parse_state m_state = CLOSED;
+
+    /*
+     * The line we're reading.
+     */
+    char m_line[HTTP_MAX_LINE];
+    size_t m_line_len = 0;
+
+    /*
+     * The details of the request.
+     */
+    char m_method[8];
+    char m_path[HTTP_MAX_LINE];
+    char m_if_none_match[16];
+    char m_websocket_key[32];
+    bool m_keep_alive;
+    long m_content_length;
+
+    /*
+     * The last time we saw activity upon the connection.
+     */
+    unsigned long m_last_activity;
+
+    /*
+     * When the current request started, and whether one has.
+     */
+    unsigned long m_started;
+    bool m_in_request;
+};
+
+
+/*
+ * A function which handles requests.
+ */
+typedef void (*HTTPHandler)(HTTPRequest &request);
+
+
+/*
+ * This is a small HTTP-server, which supports persistent connections
+ * and pipelined requests.
+ *
+ * Usage is as simple as:
+ *
+ *   HTTPServer server(80);
+ *
+ *   void handler(HTTPRequest &request)
+ *   {
+ *       request.send(200, "text/plain", "OK\n");
+ *   }
+ *
+ *   // In setup()
+ *   server.on_request(handler);
+ *   server.begin();
+ *
+ *   // In loop()
+ *   server.handle();
+ *
+ * Requests are read from whatever bytes are available, so a slow
+ * client never stalls the caller.
+ *
+ * The work done by each call to `handle()` is bounded:
+ *
+ *  * At most HTTP_MAX_CLIENTS connections are open at once, further
+ *    clients receive "503 Service Unavailable".
+ *
+ *  * A client which doesn't send a complete request within
+ *    HTTP_REQUEST_TIMEOUT receives "408 Request Timeout".
+ *
+ *  * Reading stops once HTTP_LOOP_BUDGET has been spent.
+ *
+ * The time spent inside the handler itself is not limited, so
+ * handlers should be quick.
+ *
+ */
+class HTTPServer
+{
+public:
+
+    /*
+     * Constructor.
+     */
+    HTTPServer(int port);
+
+    /*
+     * Start listening.
+     */
+    void begin();
+
+    /*
+     * Set the function which handles each request.
+     */
+    void on_request(HTTPHandler handler);
+
+    /*
+     * Accept new connections, and handle any complete requests.
+     */
+    void handle();
+
+    /*
+     * The number of requests we've handled.
+     */
+    unsigned long served();
+
+    /*
+     * The number of clients refused because we were busy.
+     */
+    unsigned long rejected();
+
+    /*
+     * The number of requests which were not completed in time.
+     */
+    unsigned long timed_out();
+
+private:
+
+    /*
+     * Read from the given connection, and handle any complete requests.
+     */
+    void handle_connection(HTTPRequest &request, unsigned long started);
+
+    /*
+     * The listening socket.
+     */
+    WiFiServer m_server;
+
+    /*
+     * Our connections.
+     */
+    HTTPRequest m_requests[HTTP_MAX_CLIENTS];
+
+    /*
+     * The request-handler.
+     */
+    HTTPHandler m_handler = NULL;
+
+    /*
+     * The connection we'll service first, next time.
+     */
+    int m_next = 0;
+
+    /*
+     * Statistics.
+     */
+    unsigned long m_served = 0;
+    unsigned long m_rejected = 0;
+    unsigned long m_timed_out = 0;
+};
+
+#endif /* HTTP_SERVER_H */
@@ -0,0 +1,251 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// Our header.
+//
+#include "json_writer.h"
+
+
+/*
+ * Write to the given output.
+ */
+JSONWriter::JSONWriter(Print &out) : m_out(&out)
+{
+}
+
+
+/*
+ * Write to the given buffer.
+ */
+JSONWriter::JSONWriter(char *buf, size_t size) : m_buf(buf), m_size(size)
+{
+    if (m_size > 0)
+        m_buf[0] = '\0';
+}
+
+
+void JSONWriter::begin_object()
+{
+    open('{');
+}
+
+void JSONWriter::end_object()
+{
+    close('}');
+}
+
+void JSONWriter::begin_array()
+{
+    open('[');
+}
+
+void JSONWriter::end_array()
+{
+    close(']');
+}
+
+
+/*
+ * Write the name of the next member of an object.
+ */
+void JSONWriter::key(const char *name)
+{
+    value(name);
+    put(':');
+    m_after_key = true;
+}
+
+
+/*
+ * Write a string, escaping as we go.
+ */
+void JSONWriter::value(const char *str)
+{
+    if (str == NULL)
+    {
+        null_value();
+        return;
+    }
+
+    separator();
+    put('"');
+
+    for (; *str; str++)
+    {
+        char c = *str;
+
+        if (c == '"' || c == '\\')
+        {
+            put('\\');
+            put(c);
+        }
+        else if (c == '\n')
+        {
+            put("\\n");
+        }
+        else if (c == '\r')
+        {
+            put("\\r");
+        }
+        else if (c == '\t')
+        {
+            put("\\t");
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char tmp[8];
+            snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            put(tmp);
+        }
+        else
+        {
+            put(c);
+        }
+    }
+
+    put('"');
+}
+
+
+void JSONWriter::value(long num)
+{
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), "%ld", num);
+
+    separator();
+    put(tmp);
+}
+
+void JSONWriter::value(unsigned long num)
+{
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), "%lu", num);
+
+    separator();
+    put(tmp);
+}
+
+void JSONWriter::value(int num)
+{
+    value((long)num);
+}
+
+void JSONWriter::value(unsigned int num)
+{
+    value((unsigned long)num);
+}
+
+void JSONWriter::value(double num, int digits)
+{
+    if (isnan(num) || isinf(num))
+    {
+        null_value();
+        return;
+    }
+
+    char tmp[24];
+    dtostrf(num, 1, digits, tmp);
+
+    separator();
+    put(tmp);
+}
+
+void JSONWriter::value(bool flag)
+{
+    separator();
+    put(flag ? "true" : "false");
+}
+
+void JSONWriter::null_value()
+{
+    separator();
+    put("null");
+}
+
+
+/*
+ * The number of bytes written.
+ */
+size_t JSONWriter::length()
+{
+    return m_length;
+}
+
+
+/*
+ * Did the output fail to fit in our buffer?
+ */
+bool JSONWriter::overflow()
+{
+    return (m_out == NULL) && (m_length >= m_size);
+}
+
+
+/*
+ * Write a comma if this isn't the first value at this level.
+ */
+void JSONWriter::separator()
+{
+    if (m_after_key)
+    {
+        m_after_key = false;
+        return;
+    }
+
+    if (m_depth == 0)
+        return;
+
+    uint16_t bit = 1 << (m_depth - 1);
+
+    if (m_has_value & bit)
+        put(',');
+
+    m_has_value |= bit;
+}
+
+
+void JSONWriter::open(char c)
+{
+    separator();
+    put(c);
+
+    if (m_depth < JSON_MAX_DEPTH)
+    {
+        m_depth += 1;
+        m_has_value &= ~(1 << (m_depth - 1));
+    }
+}
+
+
+void JSONWriter::close(char c)
+{
+    if (m_depth > 0)
+        m_depth -= 1;
+
+    m_after_key = false;
+    put(c);
+}
+
+
+void JSONWriter::put(char c)
+{
+    if (m_out != NULL)
+        m_out->write(c);
+    else if (m_length + 1 < m_size)
+    {
+        m_buf[m_length] = c;
+        m_buf[m_length + 1] = '\0';
+    }
+
+    m_length += 1;
+}
+
+
+void JSONWriter::put(const char *str)
+{
+    while (*str)
+        put(*str++);
+}
@@ -0,0 +1,140 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <Arduino.h>
+
+/*
+ * The deepest nesting of objects/arrays we support.
+ */
+#define JSON_MAX_DEPTH 16
+
+
+/*
+ * A streaming JSON writer, which makes no heap allocations.
+ *
+ * Output is written either to a `Print`, such as a client-socket, or
+ * to a fixed buffer:
+ *
+ *   JSONWriter json(client);
+ *
+ *   json.begin_object();
+ *   json.add("temperature", 21.5);
+ *   json.key("readings");
+ *   json.begin_array();
+ *   json.value(1);
+ *   json.value(2);
+ *   json.end_array();
+ *   json.end_object();
+ *
+ * Commas are inserted automatically.  When writing to a buffer output
+ * which doesn't fit is discarded, and `overflow()` will return true.
+ *
+ * A NULL buffer, of size zero, discards everything; `length()` then
+ * gives the size of the output, ahead of writing it elsewhere.
+ */
+class JSONWriter
+{
+public:
+
+    /*
+     * Write to the given output.
+     */
+    JSONWriter(Print &out);
+
+    /*
+     * Write to the given buffer, which will always be null-terminated.
+     */
+    JSONWriter(char *buf, size_t size);
+
+    /*
+     * Start/end an object or array.
+     */
+    void begin_object();
+    void end_object();
+    void begin_array();
+    void end_array();
+
+    /*
+     * Write the name of the next member of an object.
+     */
+    void key(const char *name);
+
+    /*
+     * Write a value.
+     *
+     * Strings are escaped, and a NULL string is written as `null`,
+     * as are doubles which are not finite.
+     */
+    void value(const char *str);
+    void value(long num);
+    void value(unsigned long num);
+    void value(int num);
+    void value(unsigned int num);
+    void value(double num, int digits = 2);
+    void value(bool flag);
+    void null_value();
+
+    /*
+     * Write a member of an object, its name & value.
+     */
+    template <typename T> void add(const char *name, T val)
+    {
+        key(name);
+        value(val);
+    }
+
+    /*
+     * The number of bytes written.
+     */
+    size_t length();
+
+    /*
+     * Did the output fail to fit in our buffer?
+     */
+    bool overflow();
+
+private:
+
+    /*
+     * Write a separator, if the next value needs one.
+     */
+    void separator();
+
+    /*
+     * Write raw output.
+     */
+    void put(char c);
+    void put(const char *str);
+
+    /*
+     * Open/close a level of nesting.
+     */
+    void open(char c);
+    void close(char c);
+
+    /*
+     * Our output; either a Print or a buffer.
+     */
+    Print *m_out = NULL;
+    char *m_buf = NULL;
+    size_t m_size = 0;
+
+    /*
+     * The number of bytes written, or attempted.
+     */
+    size_t m_length = 0;
+
+    /*
+     * The current depth, and a bit for each level recording whether
+     * it has had a value written yet.
+     */
+    uint8_t m_depth = 0;
+    uint16_t m_has_value = 0;
+
+    /*
+     * Have we just written a key?
+     */
+    bool m_after_key = false;
+};
+
+#endif /* JSON_WRITER_H */
@@ -0,0 +1,92 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// Our header.
+//
+#include "metrics.h"
+
+
+/*
+ * Record another iteration of the main loop.
+ */
+void Metrics::loop()
+{
+    unsigned long now = millis();
+
+    if (m_iterations > 0)
+    {
+        unsigned long duration = now - m_last_loop;
+
+        if (duration > m_max_loop)
+            m_max_loop = duration;
+    }
+
+    m_last_loop = now;
+    m_iterations += 1;
+
+    //
+    // Count the times we regain our WiFi connection.
+    //
+    bool connected = (WiFi.status() == WL_CONNECTED);
+
+    if (connected && !m_wifi_connected && m_wifi_seen)
+        m_wifi_reconnects += 1;
+
+    if (connected)
+        m_wifi_seen = true;
+
+    m_wifi_connected = connected;
+}
+
+
+/*
+ * Capture the current values of our gauges.
+ */
+void Metrics::snapshot()
+{
+    m_snapshot.uptime = millis() / 1000;
+    m_snapshot.free_heap = ESP.getFreeHeap();
+    m_snapshot.max_block = ESP.getMaxFreeBlockSize();
+    m_snapshot.iterations = m_iterations;
+    m_snapshot.max_loop = m_max_loop;
+    m_snapshot.rssi = WiFi.RSSI();
+    m_snapshot.wifi_reconnects = m_wifi_reconnects;
+
+    m_max_loop = 0;
+}
+
+
+/*
+ * Write the values captured by `snapshot()`.
+ */
+void Metrics::render(Print &out)
+{
+    gauge(out, "esp_uptime_seconds", m_snapshot.uptime);
+    gauge(out, "esp_free_heap_bytes", m_snapshot.free_heap);
+    gauge(out, "esp_max_free_block_bytes", m_snapshot.max_block);
+    counter(out, "esp_loop_iterations_total", m_snapshot.iterations);
+    gauge(out, "esp_loop_max_milliseconds", m_snapshot.max_loop);
+    gauge(out, "esp_wifi_rssi_dbm", m_snapshot.rssi);
+    counter(out, "esp_wifi_reconnects_total", m_snapshot.wifi_reconnects);
+}
+
+
+/*
+ * Write a single counter.
+ */
+void Metrics::counter(Print &out, const char *name, unsigned long value)
+{
+    out.printf("# TYPE %s counter\n%s %lu\n", name, name, value);
+}
+
+
+/*
+ * Write a single gauge.
+ */
+void Metrics::gauge(Print &out, const char *name, long value)
+{
+    out.printf("# TYPE %s gauge\n%s %ld\n", name, name, value);
+}
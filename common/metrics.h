@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <ESP8266WiFi.h>
+
+
+/*
+ * Runtime counters for the device, which may be served in the
+ * Prometheus text-format.
+ *
+ * Usage is as simple as:
+ *
+ *   Metrics metrics;
+ *
+ *   // At the start of loop()
+ *   metrics.loop();
+ *
+ *   // When serving "/metrics"
+ *   metrics.snapshot();
+ *   request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+ *
+ *   void serveMetrics(Print &out)
+ *   {
+ *       metrics.render(out);
+ *       Metrics::counter(out, "mqtt_publishes_total", ..);
+ *   }
+ *
+ * The values which change on their own, such as the free heap, are
+ * captured by `snapshot()`, so that rendering twice - once to find the
+ * length of the response - produces the same output each time.
+ */
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+class Metrics
+{
+public:
+
+    /*
+     * Record another iteration of the main loop.
+     */
+    void loop();
+
+    /*
+     * Capture the current values of our gauges, ready to render.
+     *
+     * This also resets the maximum loop-time, so that it covers the
+     * period since the previous scrape.
+     */
+    void snapshot();
+
+    /*
+     * Write the values captured by `snapshot()`.
+     */
+    void render(Print &out);
+
+    /*
+     * Write a single counter, or gauge.
+     */
+    static void counter(Print &out, const char *name, unsigned long value);
+    static void gauge(Print &out, const char *name, long value);
+
+private:
+
+    /*
+     * The main loop.
+     */
+    unsigned long m_iterations = 0;
+    unsigned long m_last_loop = 0;
+    unsigned long m_max_loop = 0;
+
+    /*
+     * WiFi connectivity.
+     */
+    bool m_wifi_connected = false;
+    bool m_wifi_seen = false;
+    unsigned long m_wifi_reconnects = 0;
+
+    /*
+     * The values captured by `snapshot()`.
+     */
+    struct
+    {
+        unsigned long uptime;
+        unsigned long free_heap;
+        unsigned long max_block;
+        unsigned long iterations;
+        unsigned long max_loop;
+        long rssi;
+        unsigned long wifi_reconnects;
+    } m_snapshot = { 0 };
+};
+
+#endif /* METRICS_H */
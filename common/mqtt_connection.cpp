@@ -0,0 +1,211 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// We don't try to connect without WiFi.
+//
+#include <ESP8266WiFi.h>
+
+//
+// Our header.
+//
+#include "mqtt_connection.h"
+
+
+/*
+ * Constructor.
+ */
+MQTTConnection::MQTTConnection(PubSubClient &client) : m_client(&client)
+{
+}
+
+
+/*
+ * Set the ID we connect with.
+ */
+void MQTTConnection::begin(const String &id)
+{
+    m_id = id;
+}
+
+
+/*
+ * Publish the result of the given function on each connection.
+ */
+void MQTTConnection::announce(const char *topic, MQTTAnnouncement payload)
+{
+    m_announce_topic = topic;
+    m_announce_payload = payload;
+}
+
+
+/*
+ * Connect, if we're not connected and it is time to try again.
+ */
+bool MQTTConnection::loop()
+{
+    if (m_client->connected())
+    {
+        m_connected = true;
+        return true;
+    }
+
+    //
+    // An attempt is under way; see if the broker has answered.
+    //
+    if (m_client->state() == MQTT_CONNECTING)
+        return poll();
+
+    unsigned long now = millis();
+
+    //
+    // If we've just lost our connection try again at once, since
+    // the broker is probably still there.
+    //
+    if (m_connected)
+    {
+        m_connected = false;
+        m_disconnects += 1;
+        m_delay = 0;
+    }
+
+    if ((m_delay != 0) && (now - m_last_attempt < m_delay))
+        return false;
+
+    if (WiFi.status() != WL_CONNECTED)
+        return false;
+
+    m_last_attempt = now;
+
+    if (!m_client->beginConnect(m_id.c_str()))
+    {
+        m_failures += 1;
+        schedule();
+        return false;
+    }
+
+    return poll();
+}
+
+
+/*
+ * Read the broker's answer to our attempt, if it has arrived.
+ */
+bool MQTTConnection::poll()
+{
+    //
+    // Our subscriptions are restored by the client as it connects; batch
+    // them with our announcement so they all go in a single write.
+    //
+    m_client->beginBatch();
+
+    if (!m_client->pollConnect(m_timeout))
+    {
+        m_client->endBatch();
+
+        //
+        // Our delay runs from when the broker failed to answer, not from
+        // when we asked.
+        //
+        if (m_client->state() != MQTT_CONNECTING)
+        {
+            m_last_attempt = millis();
+            m_failures += 1;
+            schedule();
+        }
+
+        return false;
+    }
+
+    m_connected = true;
+    m_connects += 1;
+    m_failures = 0;
+    m_delay = 0;
+
+    restore();
+    m_client->endBatch();
+    return true;
+}
+
+
+/*
+ * Drop our connection, and reconnect at once.
+ */
+void MQTTConnection::reconnect()
+{
+    m_client->disconnect();
+    m_delay = 0;
+}
+
+
+/*
+ * Change the range of our delay between attempts.
+ */
+void MQTTConnection::set_backoff(unsigned long min_ms, unsigned long max_ms)
+{
+    m_min_backoff = min_ms;
+    m_max_backoff = max(min_ms, max_ms);
+}
+
+
+/*
+ * Change how long we'll wait for the broker to answer an attempt.
+ */
+void MQTTConnection::set_timeout(unsigned long ms)
+{
+    m_timeout = ms;
+}
+
+
+unsigned long MQTTConnection::failures()
+{
+    return m_failures;
+}
+
+
+unsigned long MQTTConnection::connects()
+{
+    return m_connects;
+}
+
+
+unsigned long MQTTConnection::disconnects()
+{
+    return m_disconnects;
+}
+
+
+/*
+ * Choose when to next try, following a failure.
+ *
+ * The delay doubles with each failure, up to our limit, and we then
+ * wait somewhere between half of it and all of it.
+ */
+void MQTTConnection::schedule()
+{
+    unsigned long backoff = m_min_backoff;
+
+    for (unsigned long i = 1; (i < m_failures) && (backoff < m_max_backoff); i++)
+        backoff *= 2;
+
+    if (backoff > m_max_backoff)
+        backoff = m_max_backoff;
+
+    m_delay = backoff / 2 + random(backoff / 2 + 1);
+
+    if (m_delay == 0)
+        m_delay = 1;
+}
+
+
+/*
+ * Announce ourselves, in the batch holding the subscriptions which the
+ * client restored as it connected.
+ */
+void MQTTConnection::restore()
+{
+    if (m_announce_topic != NULL)
+        m_client->publish(m_announce_topic, m_announce_payload().c_str());
+}
@@ -0,0 +1,176 @@
+#ifndef MQTT_CONNECTION_H
+#define MQTT_CONNECTION_H
+
+#include <Arduino.h>
+
+#include "PubSubClient.h"
+
+/*
+ * The delay before our first retry, and the most we'll wait between
+ * attempts, in milliseconds.
+ */
+#ifndef MQTT_CONNECTION_MIN_BACKOFF
+#define MQTT_CONNECTION_MIN_BACKOFF 1000
+#endif
+
+#ifndef MQTT_CONNECTION_MAX_BACKOFF
+#define MQTT_CONNECTION_MAX_BACKOFF (5 * 60 * 1000)
+#endif
+
+/*
+ * How long we'll wait for the broker to accept an attempt, in
+ * milliseconds.
+ */
+#ifndef MQTT_CONNECTION_CONNACK_TIMEOUT
+#define MQTT_CONNECTION_CONNACK_TIMEOUT (MQTT_SOCKET_TIMEOUT * 1000UL)
+#endif
+
+
+/*
+ * Returns the payload to announce on each connection.
+ */
+typedef String (*MQTTAnnouncement)();
+
+
+/*
+ * Keeps a client connected to its broker, without blocking.
+ *
+ * Each call to `loop()` makes at most one connection attempt, and only
+ * once the delay since the previous failure has passed.  That delay
+ * doubles with each failure, up to a limit, and is randomised so that
+ * a room full of devices doesn't retry in step after the broker
+ * restarts.
+ *
+ * An attempt sends the CONNECT, and the broker's answer is read by the
+ * calls to `loop()` which follow, as it arrives.  It fails if there's
+ * none within MQTT_CONNECTION_CONNACK_TIMEOUT.
+ *
+ * Once connected our announcement is published, in the same write as
+ * the subscriptions which the client restores itself:
+ *
+ *   PubSubClient client(espClient);
+ *   MQTTConnection connection(client);
+ *
+ *   String meta() { return board_info.to_JSON(); }
+ *
+ *   // In setup(), after client.setServer()
+ *   connection.begin(id);
+ *   connection.announce("meta", meta);
+ *   client.subscribe("meta");
+ *
+ *   // In loop(), instead of reconnect()
+ *   connection.loop();
+ *   client.loop();
+ *
+ * Only opening the TCP connection may wait, as the WiFiClient does.
+ */
+class MQTTConnection
+{
+public:
+
+    /*
+     * Constructor.
+     */
+    MQTTConnection(PubSubClient &client);
+
+    /*
+     * Set the ID we connect with.
+     */
+    void begin(const String &id);
+
+    /*
+     * Publish the result of the given function on each connection.
+     */
+    void announce(const char *topic, MQTTAnnouncement payload);
+
+    /*
+     * Connect, if we're not connected and it is time to try again.
+     *
+     * Returns true if we're connected.
+     */
+    bool loop();
+
+    /*
+     * Drop our connection, and reconnect at once.
+     */
+    void reconnect();
+
+    /*
+     * Change the range of our delay between attempts.
+     */
+    void set_backoff(unsigned long min_ms, unsigned long max_ms);
+
+    /*
+     * Change how long we'll wait for the broker to answer an attempt.
+     */
+    void set_timeout(unsigned long ms);
+
+    /*
+     * The number of attempts which have failed since we were last
+     * connected.
+     */
+    unsigned long failures();
+
+    /*
+     * The number of times we've connected, and lost that connection.
+     */
+    unsigned long connects();
+    unsigned long disconnects();
+
+private:
+
+    /*
+     * Read the broker's answer to our attempt, if it has arrived.
+     */
+    bool poll();
+
+    /*
+     * Choose when to next try, following a failure.
+     */
+    void schedule();
+
+    /*
+     * Announce ourselves, following a connection.
+     */
+    void restore();
+
+    /*
+     * The client we manage.
+     */
+    PubSubClient *m_client;
+
+    /*
+     * The ID we connect with.
+     */
+    String m_id;
+
+    /*
+     * Our announcement.
+     */
+    const char *m_announce_topic = NULL;
+    MQTTAnnouncement m_announce_payload = NULL;
+
+    /*
+     * Whether we were connected when last checked, and when we may
+     * next try if we're not.
+     */
+    bool m_connected = false;
+    unsigned long m_last_attempt = 0;
+    unsigned long m_delay = 0;
+
+    /*
+     * Our configuration.
+     */
+    unsigned long m_min_backoff = MQTT_CONNECTION_MIN_BACKOFF;
+    unsigned long m_max_backoff = MQTT_CONNECTION_MAX_BACKOFF;
+    unsigned long m_timeout = MQTT_CONNECTION_CONNACK_TIMEOUT;
+
+    /*
+     * Counters.
+     */
+    unsigned long m_failures = 0;
+    unsigned long m_connects = 0;
+    unsigned long m_disconnects = 0;
+};
+
+#endif /* MQTT_CONNECTION_H */
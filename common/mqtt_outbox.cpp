@@ -0,0 +1,687 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// Queued messages spill over to SPIFFS.
+//
+#include <FS.h>
+
+//
+// Our header.
+//
+#include "mqtt_outbox.h"
+
+
+/*
+ * The flags stored with each message.
+ */
+#define OUTBOX_RETAINED 0x01
+#define OUTBOX_QOS1     0x02
+
+/*
+ * Each message in our file is preceded by its length, and flags.
+ */
+#define OUTBOX_HEADER 3
+
+/*
+ * The bytes the client's buffer needs beyond a message's topic and
+ * payload: the fixed header, the topic's length, a message-ID, and
+ * with MQTT 5 the properties and a topic alias.
+ */
+#if MQTT_VERSION == MQTT_VERSION_5
+#define OUTBOX_PACKET_OVERHEAD (5 + 2 + 2 + MQTT_NO_PROPERTIES_SIZE + 3)
+#else
+#define OUTBOX_PACKET_OVERHEAD (5 + 2 + 2)
+#endif
+
+
+/*
+ * Constructor.
+ */
+MQTTOutbox::MQTTOutbox(PubSubClient &client) : m_client(&client)
+{
+    set_rate(MQTT_OUTBOX_PRIORITY_HIGH, MQTT_OUTBOX_HIGH_RATE, MQTT_OUTBOX_HIGH_BURST);
+    set_rate(MQTT_OUTBOX_PRIORITY_NORMAL, MQTT_OUTBOX_RATE);
+}
+
+
+/*
+ * Restore any messages left in flash by a previous run.
+ */
+void MQTTOutbox::begin()
+{
+    File f = SPIFFS.open(MQTT_OUTBOX_FILE, "r");
+
+    if (!f)
+        return;
+
+    m_file_size = f.size();
+    m_file_position = 0;
+
+    File p = SPIFFS.open(MQTT_OUTBOX_POSITION, "r");
+
+    if (p)
+    {
+        p.read((uint8_t *)&m_file_position, sizeof(m_file_position));
+        p.close();
+    }
+
+    //
+    // Count the messages we've still to send, ignoring anything
+    // truncated by a reboot part-way through writing.
+    //
+    uint32_t pos = m_file_position;
+    m_file_count = 0;
+
+    while (pos + OUTBOX_HEADER <= m_file_size)
+    {
+        uint8_t header[OUTBOX_HEADER];
+
+        f.seek(pos, SeekSet);
+
+        if (f.read(header, OUTBOX_HEADER) != OUTBOX_HEADER)
+            break;
+
+        uint16_t length = header[0] | (header[1] << 8);
+
+        if ((length > MQTT_OUTBOX_MESSAGE_SIZE) ||
+                (pos + OUTBOX_HEADER + length > m_file_size))
+            break;
+
+        pos += OUTBOX_HEADER + length;
+        m_file_count += 1;
+    }
+
+    f.close();
+    m_file_size = pos;
+
+    if (m_file_count == 0)
+        discard();
+}
+
+
+/*
+ * Publish a message, or queue it if that isn't possible now.
+ */
+bool MQTTOutbox::publish(const char *topic, const char *payload, bool retained, uint8_t qos)
+{
+    return publish(topic, (const uint8_t *)payload, strlen(payload), retained, qos);
+}
+
+
+/*
+ * Publish a message with a binary payload.
+ */
+bool MQTTOutbox::publish(const char *topic, const uint8_t *payload, size_t length, bool retained, uint8_t qos)
+{
+    MQTTOutboxPriority p = priority(topic);
+    unsigned long now = millis();
+    size_t topic_len = strlen(topic);
+
+    //
+    // A message which can never fit in the client's buffer would sit at
+    // the head of the queue forever.
+    //
+    if ((topic_len + 1 + length > MQTT_OUTBOX_MESSAGE_SIZE) ||
+            (topic_len + length + OUTBOX_PACKET_OVERHEAD > m_client->getBufferSize()))
+    {
+        m_dropped += 1;
+        return false;
+    }
+
+    //
+    // Send it immediately, if nothing is waiting ahead of it.
+    //
+    bool first = (m_high_count == 0) &&
+                 ((p == MQTT_OUTBOX_PRIORITY_HIGH) || (queued() == 0));
+
+    if (first && m_client->connected() && ready(p, now) &&
+            m_client->publish(topic, payload, length, retained, qos))
+    {
+        sent(p, 0, true);
+        return true;
+    }
+
+    Message msg;
+    msg.length = topic_len + 1 + length;
+    msg.flags = (retained ? OUTBOX_RETAINED : 0) | (qos ? OUTBOX_QOS1 : 0);
+    msg.queued_at = now;
+    memcpy(msg.data, topic, topic_len + 1);
+    memcpy(msg.data + topic_len + 1, payload, length);
+
+    if (p == MQTT_OUTBOX_PRIORITY_HIGH)
+        return enqueue_high(msg);
+
+    return enqueue(msg);
+}
+
+
+/*
+ * Send the oldest queued messages, if we're connected and their rate
+ * allows.  High-priority messages always go first.
+ *
+ * While we're not connected, messages which have waited in RAM for long
+ * enough are moved to flash.
+ */
+void MQTTOutbox::loop()
+{
+    if (queued() == 0)
+        return;
+
+    unsigned long now = millis();
+
+    if (!m_client->connected())
+    {
+        if ((m_count > 0) &&
+                (now - m_ram[m_head].queued_at >= MQTT_OUTBOX_SPILL_DELAY) &&
+                (now - m_spilled_at >= MQTT_OUTBOX_SPILL_DELAY))
+        {
+            m_spilled_at = now;
+            spill();
+        }
+
+        return;
+    }
+
+    while ((m_high_count > 0) && ready(MQTT_OUTBOX_PRIORITY_HIGH, now))
+    {
+        if (!send(m_high[m_high_head], MQTT_OUTBOX_PRIORITY_HIGH, now, true))
+        {
+            if (retryable(m_high[m_high_head]))
+                return;
+
+            m_failed += 1;
+        }
+
+        m_high_head = (m_high_head + 1) % MQTT_OUTBOX_HIGH_SLOTS;
+        m_high_count -= 1;
+    }
+
+    if ((m_count + m_file_count == 0) || !ready(MQTT_OUTBOX_PRIORITY_NORMAL, now))
+        return;
+
+    Message *msg;
+
+    if (m_file_count > 0)
+    {
+        if (!read_next(m_scratch))
+        {
+            m_dropped += m_file_count;
+            discard();
+            return;
+        }
+
+        msg = &m_scratch;
+    }
+    else
+    {
+        msg = &m_ram[m_head];
+    }
+
+    //
+    // If this fails we'll try the same message again, later, unless
+    // that too is sure to fail.
+    //
+    if (!send(*msg, MQTT_OUTBOX_PRIORITY_NORMAL, now, msg != &m_scratch))
+    {
+        if (retryable(*msg))
+            return;
+
+        m_failed += 1;
+    }
+
+    if (m_file_count > 0)
+    {
+        advance(OUTBOX_HEADER + msg->length);
+    }
+    else
+    {
+        m_head = (m_head + 1) % MQTT_OUTBOX_SLOTS;
+        m_count -= 1;
+    }
+}
+
+
+/*
+ * Move everything to flash, and record our progress.
+ */
+void MQTTOutbox::flush()
+{
+    spill();
+
+    if (m_file_count > 0)
+        save_position();
+}
+
+
+void MQTTOutbox::set_policy(MQTTOutboxPolicy policy)
+{
+    m_policy = policy;
+}
+
+
+void MQTTOutbox::set_rate(unsigned int per_second)
+{
+    set_rate(MQTT_OUTBOX_PRIORITY_NORMAL, per_second);
+}
+
+
+void MQTTOutbox::set_rate(MQTTOutboxPriority priority, unsigned int per_second, unsigned int burst)
+{
+    Bucket &b = m_buckets[priority];
+
+    b.rate = per_second;
+    b.capacity = (unsigned long)max(burst, 1U) * 1000;
+    b.tokens = b.capacity;
+    b.refilled = millis();
+}
+
+
+/*
+ * Give the messages published to the given topic a priority.
+ */
+bool MQTTOutbox::set_priority(const char *topic, MQTTOutboxPriority priority)
+{
+    for (uint8_t i = 0; i < m_topic_count; i++)
+    {
+        if (strcmp(m_topics[i].topic, topic) == 0)
+        {
+            m_topics[i].priority = priority;
+            return true;
+        }
+    }
+
+    if (m_topic_count == MQTT_OUTBOX_TOPICS)
+        return false;
+
+    m_topics[m_topic_count].topic = topic;
+    m_topics[m_topic_count].priority = priority;
+    m_topic_count += 1;
+    return true;
+}
+
+
+unsigned long MQTTOutbox::queued()
+{
+    return m_high_count + m_count + m_file_count;
+}
+
+
+unsigned long MQTTOutbox::queued(MQTTOutboxPriority priority)
+{
+    if (priority == MQTT_OUTBOX_PRIORITY_HIGH)
+        return m_high_count;
+
+    return m_count + m_file_count;
+}
+
+
+unsigned long MQTTOutbox::dropped()
+{
+    return m_dropped;
+}
+
+
+unsigned long MQTTOutbox::failed()
+{
+    return m_failed;
+}
+
+
+const MQTTOutboxStats &MQTTOutbox::stats(MQTTOutboxPriority priority)
+{
+    return m_stats[priority];
+}
+
+
+/*
+ * The priority of the given topic.
+ */
+MQTTOutboxPriority MQTTOutbox::priority(const char *topic)
+{
+    for (uint8_t i = 0; i < m_topic_count; i++)
+    {
+        if (strcmp(m_topics[i].topic, topic) == 0)
+            return m_topics[i].priority;
+    }
+
+    return MQTT_OUTBOX_PRIORITY_NORMAL;
+}
+
+
+/*
+ * Refill the bucket for the given priority, and see whether it holds
+ * enough for another message.
+ */
+bool MQTTOutbox::ready(MQTTOutboxPriority priority, unsigned long now)
+{
+    Bucket &b = m_buckets[priority];
+
+    if (b.rate == 0)
+        return true;
+
+    unsigned long elapsed = now - b.refilled;
+    b.refilled = now;
+
+    //
+    // Avoid overflow after a long wait; the bucket is full anyway.
+    //
+    if (elapsed >= b.capacity)
+        b.tokens = b.capacity;
+    else
+        b.tokens = min(b.tokens + elapsed * b.rate, b.capacity);
+
+    return b.tokens >= 1000;
+}
+
+
+/*
+ * Send a queued message, recording it on success.
+ */
+bool MQTTOutbox::send(const Message &msg, MQTTOutboxPriority priority, unsigned long now, bool timed)
+{
+    const char *topic = msg.data;
+    size_t topic_len = strlen(topic);
+
+    if (!m_client->publish(topic, (const uint8_t *)topic + topic_len + 1,
+                           msg.length - topic_len - 1,
+                           msg.flags & OUTBOX_RETAINED,
+                           (msg.flags & OUTBOX_QOS1) ? 1 : 0))
+        return false;
+
+    sent(priority, now - msg.queued_at, timed);
+    return true;
+}
+
+
+/*
+ * Might a message which couldn't be sent succeed later?
+ *
+ * Only if we've lost the connection, or QoS 1 messages are awaiting
+ * their acknowledgement and so may be filling the in-flight window.
+ * Anything else would fail again, holding up the messages behind it.
+ */
+bool MQTTOutbox::retryable(const Message &msg)
+{
+    if (!m_client->connected())
+        return true;
+
+    return (msg.flags & OUTBOX_QOS1) && (m_client->getInflightCount() > 0);
+}
+
+
+/*
+ * Take a token for a message sent, and count it.
+ */
+void MQTTOutbox::sent(MQTTOutboxPriority priority, unsigned long latency, bool timed)
+{
+    Bucket &b = m_buckets[priority];
+
+    if ((b.rate != 0) && (b.tokens >= 1000))
+        b.tokens -= 1000;
+
+    MQTTOutboxStats &s = m_stats[priority];
+    s.sent += 1;
+
+    if (!timed)
+        return;
+
+    s.timed += 1;
+    s.latency_total += latency;
+
+    if (latency > s.latency_max)
+        s.latency_max = latency;
+}
+
+
+/*
+ * Add a message to RAM, spilling the older messages there to flash
+ * if it is full.
+ */
+bool MQTTOutbox::enqueue(const Message &msg)
+{
+    if (m_count == MQTT_OUTBOX_SLOTS)
+        spill();
+
+    //
+    // If flash is full, or unavailable, we must drop something.
+    //
+    if (m_count == MQTT_OUTBOX_SLOTS)
+    {
+        m_dropped += 1;
+
+        if (m_policy == MQTT_OUTBOX_DROP_NEWEST)
+            return false;
+
+        m_head = (m_head + 1) % MQTT_OUTBOX_SLOTS;
+        m_count -= 1;
+    }
+
+    m_ram[(m_head + m_count) % MQTT_OUTBOX_SLOTS] = msg;
+    m_count += 1;
+    return true;
+}
+
+
+/*
+ * Add a high-priority message, which never moves to flash.
+ */
+bool MQTTOutbox::enqueue_high(const Message &msg)
+{
+    if (m_high_count == MQTT_OUTBOX_HIGH_SLOTS)
+    {
+        m_dropped += 1;
+
+        if (m_policy == MQTT_OUTBOX_DROP_NEWEST)
+            return false;
+
+        m_high_head = (m_high_head + 1) % MQTT_OUTBOX_HIGH_SLOTS;
+        m_high_count -= 1;
+    }
+
+    m_high[(m_high_head + m_high_count) % MQTT_OUTBOX_HIGH_SLOTS] = msg;
+    m_high_count += 1;
+    return true;
+}
+
+
+/*
+ * Move the messages in RAM to the end of our file.
+ *
+ * If there isn't room for all of them, and we may not discard older
+ * messages, none are moved.
+ */
+void MQTTOutbox::spill()
+{
+    if (m_count == 0)
+        return;
+
+    uint32_t needed = 0;
+
+    for (uint8_t i = 0; i < m_count; i++)
+        needed += OUTBOX_HEADER + m_ram[(m_head + i) % MQTT_OUTBOX_SLOTS].length;
+
+    //
+    // Make room, by discarding the oldest messages if we may.
+    //
+    while (m_file_size - m_file_position + needed > MQTT_OUTBOX_FILE_SIZE)
+    {
+        if ((m_policy == MQTT_OUTBOX_DROP_NEWEST) || (m_file_count == 0))
+            return;
+
+        if (!read_next(m_scratch))
+        {
+            m_dropped += m_file_count;
+            discard();
+            break;
+        }
+
+        advance(OUTBOX_HEADER + m_scratch.length);
+        m_dropped += 1;
+    }
+
+    if (m_file_size + needed > MQTT_OUTBOX_FILE_SIZE)
+        compact();
+
+    File f = SPIFFS.open(MQTT_OUTBOX_FILE, "a");
+
+    if (!f)
+        return;
+
+    while (m_count > 0)
+    {
+        Message &msg = m_ram[m_head];
+        uint8_t header[OUTBOX_HEADER] = { (uint8_t)(msg.length & 0xFF),
+                                          (uint8_t)(msg.length >> 8),
+                                          msg.flags
+                                        };
+
+        if ((f.write(header, OUTBOX_HEADER) != OUTBOX_HEADER) ||
+                (f.write((const uint8_t *)msg.data, msg.length) != msg.length))
+        {
+            //
+            // Remove the partial message, so that later ones follow
+            // the last which was written in full.
+            //
+            f.close();
+            compact();
+            return;
+        }
+
+        m_file_size += OUTBOX_HEADER + msg.length;
+        m_file_count += 1;
+        m_head = (m_head + 1) % MQTT_OUTBOX_SLOTS;
+        m_count -= 1;
+    }
+
+    f.close();
+}
+
+
+/*
+ * Read the oldest message from our file.
+ */
+bool MQTTOutbox::read_next(Message &msg)
+{
+    File f = SPIFFS.open(MQTT_OUTBOX_FILE, "r");
+
+    if (!f)
+        return false;
+
+    uint8_t header[OUTBOX_HEADER];
+    bool ok = false;
+
+    f.seek(m_file_position, SeekSet);
+
+    if (f.read(header, OUTBOX_HEADER) == OUTBOX_HEADER)
+    {
+        msg.length = header[0] | (header[1] << 8);
+        msg.flags = header[2];
+
+        ok = (msg.length <= MQTT_OUTBOX_MESSAGE_SIZE) &&
+             (f.read((uint8_t *)msg.data, msg.length) == msg.length) &&
+             (memchr(msg.data, '\0', msg.length) != NULL);
+    }
+
+    f.close();
+    return ok;
+}
+
+
+/*
+ * Move past the oldest message in our file, removing the file once
+ * it has all been sent.
+ */
+void MQTTOutbox::advance(uint32_t bytes)
+{
+    m_file_position += bytes;
+    m_file_count -= 1;
+
+    if (m_file_count == 0)
+    {
+        discard();
+        return;
+    }
+
+    m_unsynced += 1;
+
+    if (m_unsynced >= MQTT_OUTBOX_SYNC)
+        save_position();
+}
+
+
+/*
+ * Rewrite our file with only the messages still to be sent.
+ */
+void MQTTOutbox::compact()
+{
+    File in = SPIFFS.open(MQTT_OUTBOX_FILE, "r");
+    File out = SPIFFS.open(MQTT_OUTBOX_FILE ".tmp", "w");
+
+    if (!in || !out)
+        return;
+
+    in.seek(m_file_position, SeekSet);
+
+    uint32_t remaining = m_file_size - m_file_position;
+
+    while (remaining > 0)
+    {
+        size_t len = in.read((uint8_t *)m_scratch.data,
+                             min(remaining, (uint32_t)sizeof(m_scratch.data)));
+
+        if ((len == 0) || (out.write((const uint8_t *)m_scratch.data, len) != len))
+        {
+            in.close();
+            out.close();
+            SPIFFS.remove(MQTT_OUTBOX_FILE ".tmp");
+            return;
+        }
+
+        remaining -= len;
+    }
+
+    in.close();
+    out.close();
+
+    SPIFFS.remove(MQTT_OUTBOX_FILE);
+    SPIFFS.rename(MQTT_OUTBOX_FILE ".tmp", MQTT_OUTBOX_FILE);
+
+    m_file_size -= m_file_position;
+    m_file_position = 0;
+    save_position();
+}
+
+
+/*
+ * Remove our file, and forget its contents.
+ */
+void MQTTOutbox::discard()
+{
+    SPIFFS.remove(MQTT_OUTBOX_FILE);
+    SPIFFS.remove(MQTT_OUTBOX_POSITION);
+
+    m_file_position = 0;
+    m_file_size = 0;
+    m_file_count = 0;
+    m_unsynced = 0;
+}
+
+
+/*
+ * Record our progress through the file.
+ */
+void MQTTOutbox::save_position()
+{
+    File f = SPIFFS.open(MQTT_OUTBOX_POSITION, "w");
+
+    if (f)
+    {
+        f.write((const uint8_t *)&m_file_position, sizeof(m_file_position));
+        f.close();
+    }
+
+    m_unsynced = 0;
+}
@@ -0,0 +1,381 @@
+#ifndef MQTT_OUTBOX_H
+#define MQTT_OUTBOX_H
+
+#include <Arduino.h>
+
+#include "PubSubClient.h"
+
+/*
+ * The number of messages we hold in RAM.
+ */
+#ifndef MQTT_OUTBOX_SLOTS
+#define MQTT_OUTBOX_SLOTS 8
+#endif
+
+/*
+ * The largest message we'll queue, its topic and payload together.
+ */
+#ifndef MQTT_OUTBOX_MESSAGE_SIZE
+#define MQTT_OUTBOX_MESSAGE_SIZE 128
+#endif
+
+/*
+ * The most bytes of messages we'll keep in flash.
+ */
+#ifndef MQTT_OUTBOX_FILE_SIZE
+#define MQTT_OUTBOX_FILE_SIZE 16384
+#endif
+
+/*
+ * How long a message may wait in RAM while we're disconnected, in
+ * milliseconds, before it is moved to flash.
+ */
+#ifndef MQTT_OUTBOX_SPILL_DELAY
+#define MQTT_OUTBOX_SPILL_DELAY 2000
+#endif
+
+/*
+ * The number of queued messages we'll send each second, by default.
+ */
+#ifndef MQTT_OUTBOX_RATE
+#define MQTT_OUTBOX_RATE 5
+#endif
+
+/*
+ * The number of high-priority messages we hold, in RAM only.
+ */
+#ifndef MQTT_OUTBOX_HIGH_SLOTS
+#define MQTT_OUTBOX_HIGH_SLOTS 4
+#endif
+
+/*
+ * The number of high-priority messages we'll send each second, and how
+ * many may be sent at once after a quiet spell.
+ */
+#ifndef MQTT_OUTBOX_HIGH_RATE
+#define MQTT_OUTBOX_HIGH_RATE 10
+#endif
+
+#ifndef MQTT_OUTBOX_HIGH_BURST
+#define MQTT_OUTBOX_HIGH_BURST 5
+#endif
+
+/*
+ * The number of topics which may be given a priority.
+ */
+#ifndef MQTT_OUTBOX_TOPICS
+#define MQTT_OUTBOX_TOPICS 4
+#endif
+
+/*
+ * Our progress through the messages in flash is recorded after sending
+ * this many of them, to limit the wear on the flash.  After a reboot
+ * up to this many may be sent twice.
+ */
+#define MQTT_OUTBOX_SYNC 16
+
+/*
+ * The files holding queued messages, and our progress through them.
+ */
+#define MQTT_OUTBOX_FILE     "/outbox"
+#define MQTT_OUTBOX_POSITION "/outbox.pos"
+
+
+/*
+ * What to discard when the outbox is full.
+ */
+enum MQTTOutboxPolicy
+{
+    MQTT_OUTBOX_DROP_OLDEST,
+    MQTT_OUTBOX_DROP_NEWEST
+};
+
+
+/*
+ * The priority of a topic's messages.
+ */
+enum MQTTOutboxPriority
+{
+    MQTT_OUTBOX_PRIORITY_HIGH,
+    MQTT_OUTBOX_PRIORITY_NORMAL
+};
+
+#define MQTT_OUTBOX_PRIORITIES 2
+
+
+/*
+ * The messages of one priority which we've sent, and how long those
+ * which waited in RAM were queued for, in milliseconds.  Messages moved
+ * to flash lose their time, so aren't included in the latency.
+ */
+struct MQTTOutboxStats
+{
+    unsigned long sent;
+    unsigned long timed;
+    unsigned long latency_total;
+    unsigned long latency_max;
+};
+
+
+/*
+ * A store-and-forward queue of messages to publish.
+ *
+ * Messages which can't be sent at once are held in RAM.  While we're
+ * connected they stay there, unless it fills.  While we're not they're
+ * moved to SPIFFS after MQTT_OUTBOX_SPILL_DELAY, where they survive a
+ * reboot.  Once connected they're sent in the order they were
+ * published, at a limited rate:
+ *
+ *   PubSubClient client(espClient);
+ *   MQTTOutbox outbox(client);
+ *
+ *   // In setup(), after SPIFFS.begin()
+ *   outbox.begin();
+ *
+ *   // In loop(), after client.loop()
+ *   outbox.loop();
+ *
+ *   // Instead of client.publish()
+ *   outbox.publish("temperature", payload);
+ *
+ * Messages still in RAM are lost on reboot, unless `flush()` is called
+ * first - such as when an OTA update begins.  Messages too large for
+ * the client's buffer are refused, rather than queued.
+ *
+ * Topics may be given a high priority.  Their messages are sent ahead
+ * of anything else queued, and kept in a separate, smaller, queue in
+ * RAM, so a backlog of readings never delays them:
+ *
+ *   outbox.set_priority("alarm", MQTT_OUTBOX_PRIORITY_HIGH);
+ *
+ * Each priority is rate-limited by a token bucket: it may send a burst
+ * of messages at once, and then the given number each second.
+ */
+class MQTTOutbox
+{
+public:
+
+    /*
+     * Constructor.
+     */
+    MQTTOutbox(PubSubClient &client);
+
+    /*
+     * Restore any messages left in flash by a previous run.
+     */
+    void begin();
+
+    /*
+     * Publish a message, or queue it if that isn't possible now.
+     *
+     * Returns false if the message was discarded.
+     */
+    bool publish(const char *topic, const char *payload, bool retained = false, uint8_t qos = 0);
+    bool publish(const char *topic, const uint8_t *payload, size_t length, bool retained = false, uint8_t qos = 0);
+
+    /*
+     * Send queued messages, if we're connected, or move them to flash
+     * if we're not.
+     */
+    void loop();
+
+    /*
+     * Move the messages held in RAM to flash, and record our progress,
+     * so that nothing is lost over a reboot.  High-priority messages
+     * stay in RAM.
+     */
+    void flush();
+
+    /*
+     * Choose what to discard when full; by default the oldest messages.
+     */
+    void set_policy(MQTTOutboxPolicy policy);
+
+    /*
+     * Set the number of queued messages to send each second, or zero
+     * to send one on each call to `loop()`.  Without a priority this
+     * applies to the normal messages.
+     */
+    void set_rate(unsigned int per_second);
+    void set_rate(MQTTOutboxPriority priority, unsigned int per_second, unsigned int burst = 1);
+
+    /*
+     * Give the messages published to the given topic a priority; by
+     * default they're normal.
+     *
+     * The topic isn't copied, so must remain valid.
+     */
+    bool set_priority(const char *topic, MQTTOutboxPriority priority);
+
+    /*
+     * The number of messages waiting to be sent, in all, or of the
+     * given priority.
+     */
+    unsigned long queued();
+    unsigned long queued(MQTTOutboxPriority priority);
+
+    /*
+     * The number of messages discarded, because we were full or they
+     * were too large for the client's buffer.
+     */
+    unsigned long dropped();
+
+    /*
+     * The number of queued messages discarded, because the client
+     * refused them while connected.
+     */
+    unsigned long failed();
+
+    /*
+     * The messages of the given priority which we've sent.
+     */
+    const MQTTOutboxStats &stats(MQTTOutboxPriority priority);
+
+private:
+
+    /*
+     * A queued message: its topic, null-terminated, then its payload.
+     */
+    struct Message
+    {
+        uint16_t length;
+        uint8_t flags;
+        unsigned long queued_at;
+        char data[MQTT_OUTBOX_MESSAGE_SIZE];
+    };
+
+    /*
+     * A token bucket, counting thousandths of a message.  A rate of
+     * zero is unlimited.
+     */
+    struct Bucket
+    {
+        unsigned int rate;
+        unsigned long capacity;
+        unsigned long tokens;
+        unsigned long refilled;
+    };
+
+    /*
+     * The priority of the given topic.
+     */
+    MQTTOutboxPriority priority(const char *topic);
+
+    /*
+     * Can a message of the given priority be sent now?
+     */
+    bool ready(MQTTOutboxPriority priority, unsigned long now);
+
+    /*
+     * Send a queued message, recording it on success.
+     */
+    bool send(const Message &msg, MQTTOutboxPriority priority, unsigned long now, bool timed);
+
+    /*
+     * Might a message which couldn't be sent succeed later?
+     */
+    bool retryable(const Message &msg);
+
+    /*
+     * Record a message sent, after waiting for the given time.
+     */
+    void sent(MQTTOutboxPriority priority, unsigned long latency, bool timed);
+
+    /*
+     * Add a message to the queue, making room if we must.
+     */
+    bool enqueue(const Message &msg);
+    bool enqueue_high(const Message &msg);
+
+    /*
+     * Move the messages in RAM to the end of our file.
+     */
+    void spill();
+
+    /*
+     * Read the oldest message from our file.
+     */
+    bool read_next(Message &msg);
+
+    /*
+     * Move past the oldest message in our file.
+     */
+    void advance(uint32_t bytes);
+
+    /*
+     * Rewrite our file without the messages already sent.
+     */
+    void compact();
+
+    /*
+     * Remove our file, and forget its contents.
+     */
+    void discard();
+
+    /*
+     * Record our progress through the file.
+     */
+    void save_position();
+
+    /*
+     * The client we publish through.
+     */
+    PubSubClient *m_client;
+
+    /*
+     * The messages held in RAM, which are always newer than those
+     * in flash.
+     */
+    Message m_ram[MQTT_OUTBOX_SLOTS];
+    uint8_t m_head = 0;
+    uint8_t m_count = 0;
+
+    /*
+     * The high-priority messages.
+     */
+    Message m_high[MQTT_OUTBOX_HIGH_SLOTS];
+    uint8_t m_high_head = 0;
+    uint8_t m_high_count = 0;
+
+    /*
+     * A message read from flash.
+     */
+    Message m_scratch;
+
+    /*
+     * The messages in flash: the offset of the oldest, the size of the
+     * file, and the number of messages from that offset onwards.
+     */
+    uint32_t m_file_position = 0;
+    uint32_t m_file_size = 0;
+    unsigned long m_file_count = 0;
+    uint8_t m_unsynced = 0;
+
+    /*
+     * When we last moved messages to flash while disconnected, so a
+     * failure isn't retried on every call.
+     */
+    unsigned long m_spilled_at = 0;
+
+    /*
+     * Our configuration.
+     */
+    MQTTOutboxPolicy m_policy = MQTT_OUTBOX_DROP_OLDEST;
+    Bucket m_buckets[MQTT_OUTBOX_PRIORITIES];
+
+    struct
+    {
+        const char *topic;
+        MQTTOutboxPriority priority;
+    } m_topics[MQTT_OUTBOX_TOPICS];
+    uint8_t m_topic_count = 0;
+
+    /*
+     * Our counters.
+     */
+    MQTTOutboxStats m_stats[MQTT_OUTBOX_PRIORITIES] = {};
+    unsigned long m_dropped = 0;
+    unsigned long m_failed = 0;
+};
+
+#endif /* MQTT_OUTBOX_H */
@@ -0,0 +1,649 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// We don't try to connect without WiFi.
+//
+#include <ESP8266WiFi.h>
+
+//
+// Our header.
+//
+#include "mqtt_sn_client.h"
+
+
+/*
+ * The packets we send, or understand.
+ */
+#define MQTT_SN_CONNECT    0x04
+#define MQTT_SN_CONNACK    0x05
+#define MQTT_SN_REGISTER   0x0A
+#define MQTT_SN_REGACK     0x0B
+#define MQTT_SN_PUBLISH    0x0C
+#define MQTT_SN_PUBACK     0x0D
+#define MQTT_SN_PINGREQ    0x16
+#define MQTT_SN_PINGRESP   0x17
+#define MQTT_SN_DISCONNECT 0x18
+
+/*
+ * Flags, and the types of topic ID.
+ */
+#define MQTT_SN_FLAG_DUP     0x80
+#define MQTT_SN_FLAG_QOS_1   0x20
+#define MQTT_SN_FLAG_QOS_N1  0x60
+#define MQTT_SN_FLAG_RETAIN  0x10
+#define MQTT_SN_FLAG_CLEAN   0x04
+
+#define MQTT_SN_TOPIC_NORMAL     0x00
+#define MQTT_SN_TOPIC_PREDEFINED 0x01
+#define MQTT_SN_TOPIC_SHORT      0x02
+
+/*
+ * Return codes, and the ID we give a topic the gateway wouldn't
+ * register.
+ */
+#define MQTT_SN_ACCEPTED         0x00
+#define MQTT_SN_INVALID_TOPIC_ID 0x02
+
+#define MQTT_SN_TOPIC_REFUSED 0xFFFF
+
+/*
+ * The protocol we speak.
+ */
+#define MQTT_SN_PROTOCOL_ID 0x01
+
+
+/*
+ * Constructor.
+ */
+MQTTSNClient::MQTTSNClient(UDP &udp) : m_udp(&udp)
+{
+}
+
+
+/*
+ * Set the gateway, and the ID we connect with.
+ */
+void MQTTSNClient::begin(const char *gateway, uint16_t port, const String &id)
+{
+    m_gateway = gateway;
+    m_port = port;
+    m_id = id;
+
+    m_udp->begin(0);
+}
+
+
+/*
+ * Add a topic we'll publish to, which must be registered.
+ */
+bool MQTTSNClient::add_topic(const char *name)
+{
+    if (strlen(name) == 2)
+        return add_topic(name, (name[0] << 8) | name[1]);
+
+    if ((m_topic_count == MQTT_SN_TOPICS) || find(name))
+        return false;
+
+    m_topics[m_topic_count].name = name;
+    m_topics[m_topic_count].id = 0;
+    m_topics[m_topic_count].type = MQTT_SN_TOPIC_NORMAL;
+    m_topic_count += 1;
+
+    return true;
+}
+
+
+/*
+ * Add a topic the gateway already knows, or whose name is short enough
+ * to be sent in place of an ID.
+ */
+bool MQTTSNClient::add_topic(const char *name, uint16_t predefined_id)
+{
+    if ((m_topic_count == MQTT_SN_TOPICS) || find(name))
+        return false;
+
+    m_topics[m_topic_count].name = name;
+    m_topics[m_topic_count].id = predefined_id;
+    m_topics[m_topic_count].type = (strlen(name) == 2) ? MQTT_SN_TOPIC_SHORT : MQTT_SN_TOPIC_PREDEFINED;
+    m_topic_count += 1;
+
+    return true;
+}
+
+
+bool MQTTSNClient::publish(const char *topic, const char *payload, int8_t qos, bool retained)
+{
+    return publish(topic, (const uint8_t *)payload, strlen(payload), qos, retained);
+}
+
+
+/*
+ * Publish a message.
+ */
+bool MQTTSNClient::publish(const char *topic, const uint8_t *payload, size_t length, int8_t qos, bool retained)
+{
+    Topic *t = find(topic);
+
+    bool ok = (t != NULL) && (length <= MQTT_SN_PACKET_SIZE - 7) &&
+              (qos >= MQTT_SN_QOS_NONE) && (qos <= MQTT_SN_QOS_1);
+
+    //
+    // QoS -1 needs no connection, but the gateway must know the
+    // topic without being told.
+    //
+    if (ok && (qos == MQTT_SN_QOS_NONE))
+        ok = (t->type != MQTT_SN_TOPIC_NORMAL);
+    else if (ok)
+        ok = (m_state == STATE_ACTIVE) && (t->id != 0) && (t->id != MQTT_SN_TOPIC_REFUSED) &&
+             ((qos == MQTT_SN_QOS_0) || (m_reply == 0));
+
+    if (!ok)
+    {
+        m_failures += 1;
+        return false;
+    }
+
+    uint8_t packet[MQTT_SN_PACKET_SIZE];
+    uint16_t msg_id = (qos == MQTT_SN_QOS_1) ? next_msg_id() : 0;
+    uint8_t flags = t->type;
+
+    if (qos == MQTT_SN_QOS_NONE)
+        flags |= MQTT_SN_FLAG_QOS_N1;
+    else if (qos == MQTT_SN_QOS_1)
+        flags |= MQTT_SN_FLAG_QOS_1;
+
+    if (retained)
+        flags |= MQTT_SN_FLAG_RETAIN;
+
+    packet[0] = 7 + length;
+    packet[1] = MQTT_SN_PUBLISH;
+    packet[2] = flags;
+    packet[3] = t->id >> 8;
+    packet[4] = t->id & 0xFF;
+    packet[5] = msg_id >> 8;
+    packet[6] = msg_id & 0xFF;
+    memcpy(packet + 7, payload, length);
+
+    //
+    // QoS 1 publishes are counted once they're acknowledged.
+    //
+    if (qos == MQTT_SN_QOS_1)
+        return request(packet, packet[0], MQTT_SN_PUBACK, msg_id);
+
+    if (!send(packet, packet[0]))
+    {
+        m_failures += 1;
+        return false;
+    }
+
+    m_publishes += 1;
+    return true;
+}
+
+
+/*
+ * Read anything the gateway has sent, and connect, register, resend or
+ * ping as required.
+ */
+bool MQTTSNClient::loop()
+{
+    int size;
+
+    while ((size = m_udp->parsePacket()) > 0)
+    {
+        uint8_t packet[MQTT_SN_PACKET_SIZE];
+        int length = m_udp->read(packet, sizeof(packet));
+
+        //
+        // Anything too large for us is dropped, unread.
+        //
+        if ((length > 1) && (size <= MQTT_SN_PACKET_SIZE))
+            receive(packet, length);
+    }
+
+    unsigned long now = millis();
+
+    //
+    // Ask again if the gateway hasn't answered, then give up on it.
+    //
+    if ((m_reply != 0) && (now - m_sent_at >= MQTT_SN_RETRY_TIMEOUT))
+    {
+        if (m_retries == MQTT_SN_RETRIES)
+        {
+            lost();
+        }
+        else
+        {
+            if (m_pending[1] == MQTT_SN_PUBLISH)
+                m_pending[2] |= MQTT_SN_FLAG_DUP;
+
+            m_retries += 1;
+            m_retransmits += 1;
+            m_sent_at = now;
+            send(m_pending, m_pending_length);
+        }
+    }
+
+    if (m_reply != 0)
+        return connected();
+
+    switch (m_state)
+    {
+    case STATE_DISCONNECTED:
+        if ((m_gateway != NULL) && (WiFi.status() == WL_CONNECTED) &&
+                (!m_attempted || (now - m_last_attempt >= MQTT_SN_RETRY_TIMEOUT)))
+            connect(true);
+
+        break;
+
+    case STATE_ACTIVE:
+        if (!register_next() && (now - m_last_out >= m_keepalive * 1000UL))
+            ping(false);
+
+        break;
+
+    case STATE_ASLEEP:
+        //
+        // Check in before the gateway gives up on us, collecting
+        // anything it holds.
+        //
+        if (now - m_slept_at >= m_sleep * 750UL)
+            ping(true);
+
+        break;
+
+    case STATE_STOPPED:
+        break;
+    }
+
+    return connected();
+}
+
+
+/*
+ * Are we connected, and awake?
+ */
+bool MQTTSNClient::connected()
+{
+    return m_state == STATE_ACTIVE;
+}
+
+
+/*
+ * Ask the gateway to hold our messages while we sleep.
+ */
+void MQTTSNClient::sleep(uint16_t seconds)
+{
+    if ((m_state != STATE_ACTIVE) || (m_reply != 0) || (seconds == 0))
+        return;
+
+    uint8_t packet[4] = {4, MQTT_SN_DISCONNECT, (uint8_t)(seconds >> 8), (uint8_t)(seconds & 0xFF)};
+
+    m_sleep = seconds;
+    request(packet, sizeof(packet), MQTT_SN_DISCONNECT, 0);
+}
+
+
+/*
+ * Connect again, following a sleep or disconnection.
+ */
+void MQTTSNClient::wake()
+{
+    if ((m_state == STATE_ASLEEP) && (m_reply == 0))
+    {
+        //
+        // Our topics remain registered.
+        //
+        connect(false);
+    }
+    else if (m_state == STATE_STOPPED)
+    {
+        m_state = STATE_DISCONNECTED;
+        m_attempted = false;
+    }
+}
+
+
+/*
+ * Disconnect, until `wake()` is called.
+ */
+void MQTTSNClient::disconnect()
+{
+    uint8_t packet[2] = {2, MQTT_SN_DISCONNECT};
+
+    if ((m_state == STATE_ACTIVE) || (m_state == STATE_ASLEEP))
+        send(packet, sizeof(packet));
+
+    if (m_reply == MQTT_SN_PUBACK)
+        m_failures += 1;
+
+    m_reply = 0;
+    m_state = STATE_STOPPED;
+}
+
+
+/*
+ * Change the keepalive we'll connect with.
+ */
+void MQTTSNClient::set_keepalive(uint16_t seconds)
+{
+    m_keepalive = seconds;
+}
+
+
+unsigned long MQTTSNClient::publishes()
+{
+    return m_publishes;
+}
+
+
+unsigned long MQTTSNClient::failures()
+{
+    return m_failures;
+}
+
+
+unsigned long MQTTSNClient::retransmits()
+{
+    return m_retransmits;
+}
+
+
+unsigned long MQTTSNClient::connects()
+{
+    return m_connects;
+}
+
+
+/*
+ * Find a topic by name.
+ */
+MQTTSNClient::Topic *MQTTSNClient::find(const char *name)
+{
+    for (uint8_t i = 0; i < m_topic_count; i++)
+    {
+        if (strcmp(m_topics[i].name, name) == 0)
+            return &m_topics[i];
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Handle a packet from the gateway.
+ *
+ * We only publish, so need only the answers to our own requests; the
+ * reply we're waiting for must match, by type and message-ID.
+ */
+void MQTTSNClient::receive(const uint8_t *packet, size_t length)
+{
+    //
+    // A length of 0x01 means the next two bytes hold it.
+    //
+    size_t offset = (packet[0] == 0x01) ? 3 : 1;
+
+    if (length < offset + 1)
+        return;
+
+    uint8_t type = packet[offset];
+    const uint8_t *body = packet + offset + 1;
+    size_t size = length - offset - 1;
+
+    if (type == MQTT_SN_DISCONNECT)
+    {
+        if ((m_reply == MQTT_SN_DISCONNECT) && (m_state == STATE_ACTIVE))
+        {
+            // We're asleep.
+            m_reply = 0;
+            m_state = STATE_ASLEEP;
+            m_slept_at = millis();
+        }
+        else if (m_state != STATE_STOPPED)
+        {
+            // The gateway has dropped us.
+            lost();
+        }
+
+        return;
+    }
+
+    if (type != m_reply)
+        return;
+
+    uint16_t msg_id = (size >= 4) ? ((body[2] << 8) | body[3]) : 0;
+
+    switch (type)
+    {
+    case MQTT_SN_CONNACK:
+        if (size < 1)
+            return;
+
+        m_reply = 0;
+
+        if (body[0] == MQTT_SN_ACCEPTED)
+        {
+            m_state = STATE_ACTIVE;
+            m_connects += 1;
+        }
+        else
+        {
+            m_state = STATE_DISCONNECTED;
+        }
+
+        break;
+
+    case MQTT_SN_REGACK:
+        if ((size < 5) || (msg_id != m_reply_id))
+            return;
+
+        m_reply = 0;
+
+        //
+        // This answers for the topic we asked to register: the first
+        // without an ID.
+        //
+        for (uint8_t i = 0; i < m_topic_count; i++)
+        {
+            if ((m_topics[i].type == MQTT_SN_TOPIC_NORMAL) && (m_topics[i].id == 0))
+            {
+                m_topics[i].id = (body[4] == MQTT_SN_ACCEPTED) ? ((body[0] << 8) | body[1]) : MQTT_SN_TOPIC_REFUSED;
+                break;
+            }
+        }
+
+        break;
+
+    case MQTT_SN_PUBACK:
+        if ((size < 5) || (msg_id != m_reply_id))
+            return;
+
+        m_reply = 0;
+
+        if (body[4] == MQTT_SN_ACCEPTED)
+        {
+            m_publishes += 1;
+            break;
+        }
+
+        m_failures += 1;
+
+        //
+        // The gateway has forgotten our topic; register it again.
+        //
+        if (body[4] == MQTT_SN_INVALID_TOPIC_ID)
+        {
+            uint16_t id = (body[0] << 8) | body[1];
+
+            for (uint8_t i = 0; i < m_topic_count; i++)
+            {
+                if ((m_topics[i].type == MQTT_SN_TOPIC_NORMAL) && (m_topics[i].id == id))
+                    m_topics[i].id = 0;
+            }
+        }
+
+        break;
+
+    case MQTT_SN_PINGRESP:
+        m_reply = 0;
+
+        //
+        // Having checked in, we sleep again.
+        //
+        if (m_state == STATE_ASLEEP)
+            m_slept_at = millis();
+
+        break;
+    }
+}
+
+
+/*
+ * Send a packet to the gateway.
+ */
+bool MQTTSNClient::send(const uint8_t *packet, uint8_t length)
+{
+    if ((m_gateway == NULL) || !m_udp->beginPacket(m_gateway, m_port))
+        return false;
+
+    m_udp->write(packet, length);
+    m_last_out = millis();
+
+    return m_udp->endPacket() == 1;
+}
+
+
+/*
+ * Send a packet which awaits the given reply, keeping a copy to send
+ * again if that doesn't arrive.
+ */
+bool MQTTSNClient::request(const uint8_t *packet, uint8_t length, uint8_t reply, uint16_t msg_id)
+{
+    memcpy(m_pending, packet, length);
+    m_pending_length = length;
+    m_reply = reply;
+    m_reply_id = msg_id;
+    m_retries = 0;
+    m_sent_at = millis();
+
+    //
+    // A failed send is retried, like a lost one.
+    //
+    send(packet, length);
+    return true;
+}
+
+
+/*
+ * Connect; a clean session forgets our registrations.
+ */
+void MQTTSNClient::connect(bool clean)
+{
+    uint8_t packet[MQTT_SN_PACKET_SIZE];
+    uint8_t id_length = min((unsigned int)m_id.length(), (unsigned int)(MQTT_SN_PACKET_SIZE - 6));
+
+    packet[0] = 6 + id_length;
+    packet[1] = MQTT_SN_CONNECT;
+    packet[2] = clean ? MQTT_SN_FLAG_CLEAN : 0;
+    packet[3] = MQTT_SN_PROTOCOL_ID;
+    packet[4] = m_keepalive >> 8;
+    packet[5] = m_keepalive & 0xFF;
+    memcpy(packet + 6, m_id.c_str(), id_length);
+
+    if (clean)
+    {
+        for (uint8_t i = 0; i < m_topic_count; i++)
+        {
+            if (m_topics[i].type == MQTT_SN_TOPIC_NORMAL)
+                m_topics[i].id = 0;
+        }
+    }
+
+    m_attempted = true;
+    m_last_attempt = millis();
+
+    request(packet, packet[0], MQTT_SN_CONNACK, 0);
+}
+
+
+/*
+ * Register the first topic which has no ID, in the order they were
+ * added.  Returns false if there are none.
+ */
+bool MQTTSNClient::register_next()
+{
+    for (uint8_t i = 0; i < m_topic_count; i++)
+    {
+        if ((m_topics[i].type != MQTT_SN_TOPIC_NORMAL) || (m_topics[i].id != 0))
+            continue;
+
+        size_t name_length = strlen(m_topics[i].name);
+
+        if (name_length > MQTT_SN_PACKET_SIZE - 6)
+        {
+            m_topics[i].id = MQTT_SN_TOPIC_REFUSED;
+            continue;
+        }
+
+        uint8_t packet[MQTT_SN_PACKET_SIZE];
+        uint16_t msg_id = next_msg_id();
+
+        packet[0] = 6 + name_length;
+        packet[1] = MQTT_SN_REGISTER;
+        packet[2] = 0;
+        packet[3] = 0;
+        packet[4] = msg_id >> 8;
+        packet[5] = msg_id & 0xFF;
+        memcpy(packet + 6, m_topics[i].name, name_length);
+
+        return request(packet, packet[0], MQTT_SN_REGACK, msg_id);
+    }
+
+    return false;
+}
+
+
+/*
+ * Ping the gateway; when we're asleep our ID tells it we're awake.
+ */
+void MQTTSNClient::ping(bool with_id)
+{
+    uint8_t packet[MQTT_SN_PACKET_SIZE];
+    uint8_t id_length = with_id ? min((unsigned int)m_id.length(), (unsigned int)(MQTT_SN_PACKET_SIZE - 2)) : 0;
+
+    packet[0] = 2 + id_length;
+    packet[1] = MQTT_SN_PINGREQ;
+    memcpy(packet + 2, m_id.c_str(), id_length);
+
+    request(packet, packet[0], MQTT_SN_PINGRESP, 0);
+}
+
+
+/*
+ * The gateway didn't answer, or dropped us; we'll connect afresh once
+ * our retry-delay has passed.
+ */
+void MQTTSNClient::lost()
+{
+    if (m_reply == MQTT_SN_PUBACK)
+        m_failures += 1;
+
+    m_reply = 0;
+    m_state = STATE_DISCONNECTED;
+    m_attempted = true;
+    m_last_attempt = millis();
+}
+
+
+uint16_t MQTTSNClient::next_msg_id()
+{
+    m_msg_id += 1;
+
+    if (m_msg_id == 0)
+        m_msg_id = 1;
+
+    return m_msg_id;
+}
@@ -0,0 +1,257 @@
+#ifndef MQTT_SN_CLIENT_H
+#define MQTT_SN_CLIENT_H
+
+#include <Arduino.h>
+
+#include <Udp.h>
+
+/*
+ * The port MQTT-SN gateways usually listen on.
+ */
+#define MQTT_SN_DEFAULT_PORT 1884
+
+/*
+ * The most topics we publish to, and the largest packet we'll send or
+ * receive.  Payloads may be up to seven bytes shorter.
+ */
+#ifndef MQTT_SN_TOPICS
+#define MQTT_SN_TOPICS 4
+#endif
+
+#ifndef MQTT_SN_PACKET_SIZE
+#define MQTT_SN_PACKET_SIZE 128
+#endif
+
+/*
+ * How long we wait for the gateway to answer, in milliseconds, and how
+ * many times we'll ask again before deciding it has gone.
+ */
+#ifndef MQTT_SN_RETRY_TIMEOUT
+#define MQTT_SN_RETRY_TIMEOUT 5000
+#endif
+
+#ifndef MQTT_SN_RETRIES
+#define MQTT_SN_RETRIES 3
+#endif
+
+/*
+ * The keepalive we connect with, in seconds.
+ */
+#ifndef MQTT_SN_KEEPALIVE
+#define MQTT_SN_KEEPALIVE 60
+#endif
+
+
+/*
+ * The quality of service to publish with.  QoS -1 needs no connection,
+ * so may only be used with predefined or two-character topics.
+ */
+#define MQTT_SN_QOS_NONE -1
+#define MQTT_SN_QOS_0     0
+#define MQTT_SN_QOS_1     1
+
+
+/*
+ * A client for MQTT-SN, MQTT for sensor networks, over UDP.
+ *
+ * Rather than keeping a TCP connection to the broker we send datagrams
+ * to a gateway, which relays them.  Topics are named once, when they
+ * are registered, and thereafter identified by two bytes, so a reading
+ * takes a single small packet:
+ *
+ *   WiFiUDP udp;
+ *   MQTTSNClient sn(udp);
+ *
+ *   // In setup()
+ *   sn.begin(mqtt_server, MQTT_SN_DEFAULT_PORT, id);
+ *   sn.add_topic("temperature");
+ *
+ *   // In loop()
+ *   sn.loop();
+ *
+ *   // Later
+ *   sn.publish("temperature", payload, MQTT_SN_QOS_1);
+ *
+ * Like `MQTTConnection` nothing blocks: `loop()` connects, registers
+ * our topics, resends anything unanswered, and pings the gateway.  At
+ * most one request - a connection, registration, QoS 1 publish or ping
+ * - awaits its answer at once; QoS 0 and -1 publishes need none.
+ *
+ * A device which only reports now and then may `sleep()` between
+ * readings.  The gateway then expects no keepalives, and holds any
+ * messages for us; we check in with it before the sleep expires, and
+ * `wake()` reconnects without registering our topics again.
+ */
+class MQTTSNClient
+{
+public:
+
+    /*
+     * Constructor.
+     */
+    MQTTSNClient(UDP &udp);
+
+    /*
+     * Set the gateway, and the ID we connect with.
+     *
+     * The gateway's name isn't copied, so must remain valid.
+     */
+    void begin(const char *gateway, uint16_t port, const String &id);
+
+    /*
+     * Add a topic we'll publish to.
+     *
+     * Topics are registered with the gateway on each connection, unless
+     * they are predefined - given an ID the gateway already knows - or
+     * are two characters long.  The name isn't copied.
+     */
+    bool add_topic(const char *name);
+    bool add_topic(const char *name, uint16_t predefined_id);
+
+    /*
+     * Publish a message.
+     *
+     * Returns false if we're not connected, the topic isn't registered
+     * yet, or a QoS 1 publish is already awaiting its acknowledgement.
+     */
+    bool publish(const char *topic, const char *payload, int8_t qos = MQTT_SN_QOS_0, bool retained = false);
+    bool publish(const char *topic, const uint8_t *payload, size_t length, int8_t qos = MQTT_SN_QOS_0, bool retained = false);
+
+    /*
+     * Read anything the gateway has sent, and connect, register, resend
+     * or ping as required.
+     *
+     * Returns true if we're connected.
+     */
+    bool loop();
+
+    /*
+     * Are we connected, and awake?
+     */
+    bool connected();
+
+    /*
+     * Sleep for the given number of seconds, or connect again.
+     */
+    void sleep(uint16_t seconds);
+    void wake();
+
+    /*
+     * Disconnect, until `wake()` is called.
+     */
+    void disconnect();
+
+    /*
+     * Change the keepalive we'll connect with, in seconds.
+     */
+    void set_keepalive(uint16_t seconds);
+
+    /*
+     * Counters.
+     */
+    unsigned long publishes();
+    unsigned long failures();
+    unsigned long retransmits();
+    unsigned long connects();
+
+private:
+
+    /*
+     * What we're doing.
+     */
+    enum State
+    {
+        STATE_DISCONNECTED,
+        STATE_ACTIVE,
+        STATE_ASLEEP,
+        STATE_STOPPED
+    };
+
+    /*
+     * The topics we publish to.  Registered topics have an ID of zero
+     * until the gateway gives them one.
+     */
+    struct Topic
+    {
+        const char *name;
+        uint16_t id;
+        uint8_t type;
+    };
+
+    /*
+     * Find a topic by name.
+     */
+    Topic *find(const char *name);
+
+    /*
+     * Handle a packet from the gateway.
+     */
+    void receive(const uint8_t *packet, size_t length);
+
+    /*
+     * Send a packet, and send one which awaits the given reply - keeping
+     * a copy, to send again if that doesn't arrive.
+     */
+    bool send(const uint8_t *packet, uint8_t length);
+    bool request(const uint8_t *packet, uint8_t length, uint8_t reply, uint16_t msg_id);
+
+    /*
+     * Send a CONNECT, a REGISTER for the next unregistered topic, or a
+     * PINGREQ.
+     */
+    void connect(bool clean);
+    bool register_next();
+    void ping(bool with_id);
+
+    /*
+     * The gateway didn't answer; forget the connection.
+     */
+    void lost();
+
+    uint16_t next_msg_id();
+
+    /*
+     * Our socket, and where we send.
+     */
+    UDP *m_udp;
+    const char *m_gateway = NULL;
+    uint16_t m_port = MQTT_SN_DEFAULT_PORT;
+    String m_id;
+
+    Topic m_topics[MQTT_SN_TOPICS];
+    uint8_t m_topic_count = 0;
+
+    State m_state = STATE_DISCONNECTED;
+    uint16_t m_keepalive = MQTT_SN_KEEPALIVE;
+    uint16_t m_msg_id = 0;
+
+    /*
+     * The request awaiting its reply, if any.
+     */
+    uint8_t m_pending[MQTT_SN_PACKET_SIZE];
+    uint8_t m_pending_length = 0;
+    uint8_t m_reply = 0;
+    uint16_t m_reply_id = 0;
+    uint8_t m_retries = 0;
+    unsigned long m_sent_at = 0;
+
+    /*
+     * When we last sent anything, last tried to connect, and began to
+     * sleep - for how long.
+     */
+    unsigned long m_last_out = 0;
+    unsigned long m_last_attempt = 0;
+    bool m_attempted = false;
+    unsigned long m_slept_at = 0;
+    uint16_t m_sleep = 0;
+
+    /*
+     * Counters.
+     */
+    unsigned long m_publishes = 0;
+    unsigned long m_failures = 0;
+    unsigned long m_retransmits = 0;
+    unsigned long m_connects = 0;
+};
+
+#endif /* MQTT_SN_CLIENT_H */
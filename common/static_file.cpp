@@ -0,0 +1,158 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// We serve files from SPIFFS.
+//
+#include <FS.h>
+
+//
+// Our header.
+//
+#include "static_file.h"
+
+
+/*
+ * The content-hash of a file we've previously served.
+ */
+struct FileHash
+{
+    /*
+     * The path of the file.
+     */
+    char path[32];
+
+    /*
+     * The hash, formatted as an ETag - including quotes.
+     */
+    char etag[11];
+};
+
+
+/*
+ * The hashes we've calculated.
+ */
+static FileHash file_hashes[STATIC_FILE_MAX];
+
+
+/*
+ * Calculate the FNV-1a hash of the contents of the given file.
+ */
+static uint32_t hash_file(File &f, uint8_t *buf)
+{
+    uint32_t hash = 2166136261UL;
+
+    while (f.available())
+    {
+        size_t len = f.read(buf, STATIC_FILE_BLOCK);
+
+        for (size_t i = 0; i < len; i++)
+        {
+            hash ^= buf[i];
+            hash *= 16777619UL;
+        }
+    }
+
+    f.seek(0, SeekSet);
+    return hash;
+}
+
+
+/*
+ * Find the ETag for the given file, calculating it if we've
+ * not seen the file before.
+ */
+static const char *file_etag(const char *path, File &f, uint8_t *buf)
+{
+    for (int i = 0; i < STATIC_FILE_MAX; i++)
+    {
+        if (strcmp(file_hashes[i].path, path) == 0)
+            return file_hashes[i].etag;
+    }
+
+    for (int i = 0; i < STATIC_FILE_MAX; i++)
+    {
+        if (file_hashes[i].path[0] == '\0')
+        {
+            strncpy(file_hashes[i].path, path, sizeof(file_hashes[i].path) - 1);
+            snprintf(file_hashes[i].etag, sizeof(file_hashes[i].etag), "\"%08x\"",
+                     hash_file(f, buf));
+            return file_hashes[i].etag;
+        }
+    }
+
+    //
+    // The table is full, so this file can't be cached.
+    //
+    return NULL;
+}
+
+
+/*
+ * Serve the named file from SPIFFS.
+ */
+bool serve_file(HTTPRequest &request, const char *path, const char *type)
+{
+    //
+    // Our block-buffer.  This is static to keep it off the stack.
+    //
+    static uint8_t buf[STATIC_FILE_BLOCK];
+
+    File f = SPIFFS.open(path, "r");
+
+    if (!f)
+    {
+        request.send(404, "text/plain", "Not Found\n");
+        return false;
+    }
+
+    const char *etag = file_etag(path, f, buf);
+
+    char extra[64] = { '\0' };
+
+    if (etag != NULL)
+        snprintf(extra, sizeof(extra), "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+
+    //
+    // If the client has the current version just say so.
+    //
+    if ((etag != NULL) && (strcmp(etag, request.if_none_match()) == 0))
+    {
+        f.close();
+
+        request.send_headers(304, NULL, -1, extra);
+        return true;
+    }
+
+    request.send_headers(200, type, f.size(), extra);
+
+    if (strcmp(request.method(), "HEAD") == 0)
+    {
+        f.close();
+        return true;
+    }
+
+    //
+    // Now stream the body, one segment at a time.
+    //
+    WiFiClient &client = request.client();
+
+    while (f.available())
+    {
+        size_t len = f.read(buf, sizeof(buf));
+
+        if (len == 0)
+            break;
+
+        if (client.write(buf, len) != len)
+        {
+            request.close();
+            break;
+        }
+    }
+
+    f.close();
+    return true;
+}
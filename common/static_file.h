@@ -0,0 +1,38 @@
+#ifndef STATIC_FILE_H
+#define STATIC_FILE_H
+
+#include "http_server.h"
+
+/*
+ * The number of files whose content-hash we remember.
+ */
+#define STATIC_FILE_MAX 8
+
+/*
+ * Files are streamed to the client in blocks of this size, which
+ * matches the TCP maximum segment size.
+ */
+#ifdef TCP_MSS
+#define STATIC_FILE_BLOCK TCP_MSS
+#else
+#define STATIC_FILE_BLOCK 1460
+#endif
+
+
+/*
+ * Serve the named file from SPIFFS, in response to the given request.
+ *
+ * The response carries a `Content-Length` and an `ETag`, the latter
+ * being a hash of the file-contents.  The hash is calculated the first
+ * time a file is served and remembered thereafter.
+ *
+ * If the request's `If-None-Match` is the current ETag of the file then
+ * we reply with "304 Not Modified" and send no body.
+ *
+ * If the file could not be opened "404 Not Found" is sent, and false
+ * returned.  If the body could not be sent in full the connection is
+ * closed, as the client can no longer find the end of the response.
+ */
+bool serve_file(HTTPRequest &request, const char *path, const char *type);
+
+#endif /* STATIC_FILE_H */
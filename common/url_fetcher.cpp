@@ -16,6 +16,12 @@
 #include "url_fetcher.h"
 
 
+/*
+ * Statistics about all fetches.
+ */
+static UrlFetcherStats fetch_stats = { 0, 0, 0, 0 };
+
+
 /*
  * Constructor.  Called with the URL to fetch.
  */
@@ -378,6 +384,9 @@ void UrlFetcher::fetch()
     bool currentLineIsBlank = true;
     long now;
 
+    unsigned long started = millis();
+    fetch_stats.fetches += 1;
+
     if (m_client->connect(m_host, port()))
     {
         m_client->print("GET ");
@@ -401,6 +410,7 @@ void UrlFetcher::fetch()
             {
                 Serial.println(">>> Client Timeout !");
                 m_client->stop();
+                fetch_stats.failures += 1;
                 return;
             }
         }
@@ -435,7 +445,28 @@ void UrlFetcher::fetch()
         }
 
         m_client->stop();
+
+        /*
+         * Record how long that took.
+         */
+        fetch_stats.last_latency = millis() - started;
+
+        if (fetch_stats.last_latency > fetch_stats.max_latency)
+            fetch_stats.max_latency = fetch_stats.last_latency;
     }
+    else
+    {
+        fetch_stats.failures += 1;
+    }
+}
+
+
+/*
+ * Return statistics about all the fetches we've made.
+ */
+UrlFetcherStats UrlFetcher::stats()
+{
+    return fetch_stats;
 }
 
 
@@ -16,6 +16,27 @@
  *    foo.setAgent( "moi.kissa/3.14" );
  *
  */
+
+/*
+ * Statistics about the fetches made by all UrlFetcher objects.
+ */
+struct UrlFetcherStats
+{
+    /*
+     * The number of fetches attempted, and the number which failed.
+     */
+    unsigned long fetches;
+    unsigned long failures;
+
+    /*
+     * The time taken by the most recent, and the slowest, successful
+     * fetches, in ms.
+     */
+    unsigned long last_latency;
+    unsigned long max_latency;
+};
+
+
 class UrlFetcher
 {
 public:
@@ -70,6 +91,12 @@ public:
     void setAgent(const char *userAgent);
 
 
+    /*
+     * Return statistics about all the fetches we've made.
+     */
+    static UrlFetcherStats stats();
+
+
 private:
 
     /*
@@ -0,0 +1,253 @@
+//
+// Basic types
+//
+#include <Arduino.h>
+
+//
+// SHA1 is used for the opening-handshake.
+//
+#include <Hash.h>
+
+//
+// Our header.
+//
+#include "websocket.h"
+
+
+/*
+ * The magic value appended to the client-key, from RFC 6455.
+ */
+static const char *WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+
+/*
+ * Base64-encode `len` bytes of `in` into `out`, which must have room
+ * for the result and a trailing NULL.
+ */
+static void ws_base64(const uint8_t *in, size_t len, char *out)
+{
+    const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t n = in[i] << 16;
+
+        if (i + 1 < len)
+            n |= in[i + 1] << 8;
+
+        if (i + 2 < len)
+            n |= in[i + 2];
+
+        *out++ = table[(n >> 18) & 63];
+        *out++ = table[(n >> 12) & 63];
+        *out++ = (i + 1 < len) ? table[(n >> 6) & 63] : '=';
+        *out++ = (i + 2 < len) ? table[n & 63] : '=';
+    }
+
+    *out = '\0';
+}
+
+
+/*
+ * Constructor.
+ */
+WebSocket::WebSocket()
+{
+}
+
+
+/*
+ * Complete the opening handshake.
+ */
+bool WebSocket::accept(WiFiClient &client, const char *key)
+{
+    //
+    // Drop any existing connection.
+    //
+    close();
+
+    //
+    // The client-key is 24 bytes long; refuse anything silly.
+    //
+    if ((key == NULL) || (strlen(key) > 64))
+        return false;
+
+    //
+    // accept = base64(sha1(key + GUID))
+    //
+    char tmp[64 + 37] = { '\0' };
+    snprintf(tmp, sizeof(tmp) - 1, "%s%s", key, WS_GUID);
+
+    uint8_t hash[20];
+    sha1((const uint8_t *)tmp, strlen(tmp), hash);
+
+    char accept[32];
+    ws_base64(hash, sizeof(hash), accept);
+
+    m_client = client;
+    m_client.setNoDelay(true);
+
+    m_client.print("HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: ");
+    m_client.print(accept);
+    m_client.print("\r\n\r\n");
+
+    m_open = true;
+    m_used = 0;
+    return true;
+}
+
+
+/*
+ * Is there a live connection?
+ */
+bool WebSocket::connected()
+{
+    if (m_open && !m_client.connected())
+    {
+        m_open = false;
+        m_client.stop();
+    }
+
+    return m_open;
+}
+
+
+/*
+ * Return the next complete text/binary message, if there is one.
+ *
+ * We read only the bytes which are available, so a frame split
+ * across several TCP segments is assembled over several calls.
+ */
+int WebSocket::read(uint8_t *buf, size_t len, bool *binary)
+{
+    while (connected() && m_client.available())
+    {
+        //
+        // How many bytes does the current frame need?
+        //
+        size_t need = 2;
+
+        if (m_used >= 2)
+            need = 2 + 4 + (m_frame[1] & 0x7F);
+
+        if (m_used < need)
+        {
+            int got = m_client.read(m_frame + m_used, need - m_used);
+
+            if (got <= 0)
+                break;
+
+            m_used += got;
+
+            //
+            // Once the header is complete we can sanity-check it.
+            //
+            // Clients must mask their frames, and we don't handle
+            // extended lengths or fragmented messages.
+            //
+            if (m_used == 2)
+            {
+                if (((m_frame[1] & 0x80) == 0) ||
+                        ((m_frame[1] & 0x7F) > WS_MAX_PAYLOAD) ||
+                        ((m_frame[0] & 0x80) == 0))
+                {
+                    close();
+                    return -1;
+                }
+            }
+
+            //
+            // Handle the frame as soon as its last byte arrives, rather
+            // than waiting for more data to be available.
+            //
+            if ((m_used < 2) || (m_used < 2 + 4 + (size_t)(m_frame[1] & 0x7F)))
+                continue;
+        }
+
+        //
+        // We have a complete frame - unmask the payload.
+        //
+        uint8_t opcode = m_frame[0] & 0x0F;
+        size_t plen = m_frame[1] & 0x7F;
+        uint8_t *mask = m_frame + 2;
+        uint8_t *payload = m_frame + 6;
+
+        for (size_t i = 0; i < plen; i++)
+            payload[i] ^= mask[i & 3];
+
+        //
+        // Get ready for the next one.
+        //
+        m_used = 0;
+
+        switch (opcode)
+        {
+        case WS_OPCODE_TEXT:
+        case WS_OPCODE_BINARY:
+            if (plen > len)
+                plen = len;
+
+            memcpy(buf, payload, plen);
+            *binary = (opcode == WS_OPCODE_BINARY);
+            return plen;
+
+        case WS_OPCODE_PING:
+            write_frame(WS_OPCODE_PONG, payload, plen);
+            break;
+
+        case WS_OPCODE_CLOSE:
+            write_frame(WS_OPCODE_CLOSE, payload, plen > 2 ? 2 : plen);
+            close();
+            return -1;
+
+        default:
+            // Pongs, and anything else, are ignored.
+            break;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Send a message to the peer.
+ */
+bool WebSocket::send(const uint8_t *buf, size_t len, bool binary)
+{
+    if (!connected() || len > WS_MAX_PAYLOAD)
+        return false;
+
+    return write_frame(binary ? WS_OPCODE_BINARY : WS_OPCODE_TEXT, buf, len);
+}
+
+
+/*
+ * Close the connection, if it is open.
+ */
+void WebSocket::close()
+{
+    if (m_open)
+        m_client.stop();
+
+    m_open = false;
+    m_used = 0;
+}
+
+
+/*
+ * Write a single frame, in one call so it goes out as one segment.
+ */
+bool WebSocket::write_frame(uint8_t opcode, const uint8_t *buf, size_t len)
+{
+    uint8_t frame[2 + WS_MAX_PAYLOAD];
+
+    frame[0] = 0x80 | opcode;
+    frame[1] = len;
+    memcpy(frame + 2, buf, len);
+
+    return (m_client.write(frame, 2 + len) == 2 + len);
+}
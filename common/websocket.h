@@ -0,0 +1,117 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <ESP8266WiFi.h>
+
+/*
+ * The largest payload we'll accept in a single frame.
+ *
+ * This is the largest size which can be expressed without an extended
+ * length-field, which keeps the parser trivial.
+ */
+#define WS_MAX_PAYLOAD 125
+
+/*
+ * Frame opcodes we care about.
+ */
+#define WS_OPCODE_TEXT   0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE  0x8
+#define WS_OPCODE_PING   0x9
+#define WS_OPCODE_PONG   0xA
+
+
+/*
+ * This is a minimal server-side WebSocket, which holds a single
+ * persistent connection open.
+ *
+ * Usage is as simple as:
+ *
+ *   WebSocket ws;
+ *
+ *   // When a HTTP-request arrives with "Upgrade: websocket"
+ *   ws.accept(client, sec_websocket_key);
+ *
+ *   // Then from loop()
+ *   uint8_t buf[WS_MAX_PAYLOAD];
+ *   bool binary;
+ *   int len;
+ *
+ *   while ((len = ws.read(buf, sizeof(buf), &binary)) >= 0)
+ *      ...
+ *
+ * Reading never blocks; partial frames are kept until the rest of
+ * their bytes arrive.  Pings are answered, and close-frames are
+ * honoured, internally.
+ *
+ */
+class WebSocket
+{
+public:
+
+    /*
+     * Constructor.
+     */
+    WebSocket();
+
+    /*
+     * Complete the opening handshake with the given client, using the
+     * value of the `Sec-WebSocket-Key` header it sent.
+     *
+     * Any previously-accepted connection is closed.
+     */
+    bool accept(WiFiClient &client, const char *key);
+
+    /*
+     * Is there a live connection?
+     */
+    bool connected();
+
+    /*
+     * If a complete text/binary message has arrived copy its payload
+     * into `buf` and return the length, otherwise return -1.
+     *
+     * `binary` is set to show which kind of message it was.
+     */
+    int read(uint8_t *buf, size_t len, bool *binary);
+
+    /*
+     * Send a message to the connected peer.
+     */
+    bool send(const uint8_t *buf, size_t len, bool binary = true);
+
+    /*
+     * Close the connection.
+     */
+    void close();
+
+private:
+
+    /*
+     * Write a single (unmasked) frame to the peer.
+     */
+    bool write_frame(uint8_t opcode, const uint8_t *buf, size_t len);
+
+    /*
+     * The client we're connected to.
+     */
+    WiFiClient m_client;
+
+    /*
+     * Is `m_client` a live WebSocket?
+     */
+    bool m_open = false;
+
+    /*
+     * Bytes of the current frame: two bytes of header,
+     * four bytes of mask, then the payload.
+     */
+    uint8_t m_frame[2 + 4 + WS_MAX_PAYLOAD];
+
+    /*
+     * How many bytes of `m_frame` have been read so far.
+     */
+    size_t m_used = 0;
+};
+
+#endif /* WEBSOCKET_H */
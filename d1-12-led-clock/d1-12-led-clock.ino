@@ -40,6 +40,24 @@
 #include "debug.h"
 
 
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
+//
+// For serving our API.
+//
+#include "json_writer.h"
+
+
 //
 // The name of this project.
 //
@@ -60,7 +78,13 @@ CRGB leds[NUM_LEDS];
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 //
@@ -154,6 +178,7 @@ void setup()
     //
     // Launch the HTTP-server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s/\n",
               WiFi.localIP().toString().c_str());
@@ -232,6 +257,10 @@ void on_after_ntp()
 
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
 
     //
     // Handle any pending over the air updates.
@@ -250,10 +279,7 @@ void loop()
     //
     // (This allows changing some settings.)
     //
-    WiFiClient client = server.available();
-
-    if (client)
-        processHTTPRequest(client);
+    server.handle();
 
 
     //
@@ -490,48 +516,84 @@ String read_file(const char *path)
 }
 
 
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+
+    Metrics::counter(out, "ntp_syncs_total", timeClient.getSyncCount());
+    Metrics::counter(out, "ntp_sync_failures_total", timeClient.getSyncFailures());
+    Metrics::gauge(out, "ntp_offset_seconds", timeClient.getLastOffset());
+    Metrics::gauge(out, "ntp_offset_milliseconds", timeClient.getLastOffsetMillis());
+    Metrics::gauge(out, "ntp_delay_milliseconds", timeClient.getLastDelay());
+    Metrics::gauge(out, "ntp_drift_ppb", timeClient.getDrift());
+}
+
+
 //
 // Process an incoming HTTP-request
 //
-void processHTTPRequest(WiFiClient client)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (client.connected() && !client.available())
-        delay(1);
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
 
-    // Read the first line of the request
-    String request = client.readStringUntil('\r');
-    client.flush();
+    // The path, and any parameters, of the request
+    const char *path = request.path();
+
+    // Our API.
+    if (strcmp(path, "/api/state") == 0)
+    {
+        request.send(200, "application/json", serveState);
+        return;
+    }
+
+    if (strcmp(path, "/api/config") == 0)
+    {
+        request.send(200, "application/json", serveConfig);
+        return;
+    }
 
     // Change the state to blink?
-    if (request.indexOf("/state/blink") != -1)
+    if (strstr(path, "/state/blink") != NULL)
     {
         g_state = BLINK;
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
     // Change the state to clock?
-    if (request.indexOf("/state/clock") != -1)
+    if (strstr(path, "/state/clock") != NULL)
     {
         g_state = CLOCK;
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
     // Change the state to sweep?
-    if (request.indexOf("/state/sweep") != -1)
+    if (strstr(path, "/state/sweep") != NULL)
     {
         g_state = SWEEP;
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
     // Change the time-zone?
-    if (request.indexOf("/?tz=") != -1)
+    if (strstr(path, "/?tz=") != NULL)
     {
         const char *pattern = "/?tz=";
-        char *s = strstr(request.c_str(), pattern);
+        const char *s = strstr(path, pattern);
 
         if (s != NULL)
         {
@@ -562,28 +624,61 @@ void processHTTPRequest(WiFiClient client)
         }
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
 
     // Return a simple response
-    serveHTML(client);
+    request.send(200, "text/html", serveHTML);
 
 }
 
 
+//
+// Serve our current state, as JSON.
+//
+void serveState(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+
+    if (g_state == BLINK)
+        json.add("state", "blink");
+
+    if (g_state == SWEEP)
+        json.add("state", "sweep");
+
+    if (g_state == CLOCK)
+        json.add("state", "clock");
+
+    // Always "HH:MM:SS", so the length can't change between renders.
+    json.add("time", timeClient.getFormattedTime().c_str());
+    json.end_object();
+}
+
+
+//
+// Serve our configuration, as JSON.
+//
+void serveConfig(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("tz", time_zone_offset);
+    json.end_object();
+}
+
+
 //
 // This is a bit horrid.
 //
 // Serve a HTML-page to any clients who connect via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
     client.println("<head>");
@@ -684,10 +779,11 @@ void serveHTML(WiFiClient client)
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
 }
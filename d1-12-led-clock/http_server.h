@@ -0,0 +1 @@
+../common/http_server.h
\ No newline at end of file
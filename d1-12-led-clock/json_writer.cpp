@@ -0,0 +1 @@
+../common/json_writer.cpp
\ No newline at end of file
@@ -66,6 +66,36 @@
 #include "debug.h"
 
 
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
+//
+// For serving our API.
+//
+#include "json_writer.h"
+
+
+//
+// Our connection to the queue is kept up without blocking.
+//
+#include "mqtt_connection.h"
+
+
+//
+// Clicks are queued while we're disconnected, ahead of anything else.
+//
+#include "mqtt_outbox.h"
+
+
 //
 // For handling URL-parameters
 //
@@ -83,7 +113,13 @@
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 //
@@ -104,6 +140,18 @@ char mqtt_server[64] = { '\0' };
 WiFiClient espClient;
 PubSubClient client(espClient);
 
+
+//
+// Reconnects the client, whenever it is dropped.
+//
+MQTTConnection connection(client);
+
+
+//
+// Clicks waiting to be published.
+//
+MQTTOutbox outbox(client);
+
 //
 // Utility class for dumping board-information.
 //
@@ -163,6 +211,13 @@ void setup()
     ArduinoOTA.onStart([]()
     {
         DEBUG_LOG("OTA Start\n");
+
+        //
+        // We'll restart once the update is complete, so keep any queued
+        // messages in flash - unless it is the flash being replaced.
+        //
+        if (ArduinoOTA.getCommand() == U_FLASH)
+            outbox.flush();
     });
     ArduinoOTA.onEnd([]()
     {
@@ -198,6 +253,7 @@ void setup()
     //
     // Start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s/\n",
               WiFi.localIP().toString().c_str());
@@ -232,7 +288,27 @@ void setup()
     // Setup our pub-sub connection.
     //
     client.setServer(mqtt_server, 1883);
-    client.setCallback(callback);
+    client.addHandler("meta", callback);
+
+    //
+    // Keep connected in the background, subscribing and announcing
+    // ourselves each time we connect.
+    //
+    connection.begin(String(PROJECT_NAME) + board_info.mac());
+    connection.announce("meta", meta);
+    client.subscribe("meta");
+
+    //
+    // Clicks are published with QoS 1, so they survive a dropped
+    // connection; allow a few to await acknowledgement at once.
+    //
+    client.setInflightWindow(4);
+
+    //
+    // Clicks are sent before any other queued message.
+    //
+    outbox.set_priority("alarm", MQTT_OUTBOX_PRIORITY_HIGH);
+    outbox.begin();
 }
 
 
@@ -274,6 +350,11 @@ void access_point_callback(WiFiManager* myWiFiManager)
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
+
     //
     // Handle any pending over the air updates.
     //
@@ -287,8 +368,7 @@ void loop()
     //
     // Ensure we're connected to our queue.
     //
-    if (!client.connected())
-        reconnect();
+    connection.loop();
 
     //
     // Handle queue messages.
@@ -296,6 +376,11 @@ void loop()
     if (client.connected())
         client.loop();
 
+    //
+    // Send any clicks we queued while disconnected.
+    //
+    outbox.loop();
+
     //
     // Handle any pending clicks here.
     //
@@ -308,10 +393,7 @@ void loop()
     //
     // (This allows changing MQ address.)
     //
-    WiFiClient wclient = server.available();
-
-    if (wclient)
-        processHTTPRequest(wclient);
+    server.handle();
 
 
 }
@@ -336,8 +418,14 @@ void handlePendingButtons()
         DEBUG_LOG("Short Click\n");
 
         // Send it away
-        String payload = "{\"click\":\"short\",\"mac\":\"" + board_info.mac() + "\"}";
-        client.publish("alarm", payload.c_str());
+        char payload[64];
+        JSONWriter json(payload, sizeof(payload));
+        json.begin_object();
+        json.add("click", "short");
+        json.add("mac", board_info.mac().c_str());
+        json.end_object();
+
+        outbox.publish("alarm", payload, false, 1);
 
     }
 
@@ -350,22 +438,28 @@ void handlePendingButtons()
         DEBUG_LOG("Long Click\n");
 
         // Send it away
-        String payload = "{\"click\":\"long\",\"mac\":\"" + board_info.mac() + "\"}";
-        client.publish("alarm", payload.c_str());
+        char payload[64];
+        JSONWriter json(payload, sizeof(payload));
+        json.begin_object();
+        json.add("click", "long");
+        json.add("mac", board_info.mac().c_str());
+        json.end_object();
+
+        outbox.publish("alarm", payload, false, 1);
     }
 }
 
 
 
 //
-// This is called when messages are received.
+// This is called when messages are received on the `meta`-topic.
 //
 // We only subscribe to the `meta`-topic, and we don't do
 // anything with the messages.  It's just a nice example
 // showing how we could if we wanted to.
 //
 //
-void callback(char* topic, byte* payload, unsigned int length)
+void callback(const char* topic, const uint8_t* payload, unsigned int length, void* context)
 {
     Serial.print("Message arrived [Topic:");
     Serial.print(topic);
@@ -383,91 +477,92 @@ void callback(char* topic, byte* payload, unsigned int length)
 
 
 //
-// Reconnect to the pub-sub-server, if we're dropped.
+// Our meta-details, published to the `meta`-topic each time we
+// connect.
 //
-void reconnect()
+String meta()
 {
-    //
-    // Keep track of connection-attempts.
-    //
-    // If there are too many failures we'll just
-    // abort.
-    //
-    static int count = 0;
-
-    if (count > 5)
-        return;
-
-    //
-    // Bump our attempt-count.
-    //
-    count += 1;
-
-    // Attempt to reconnect
-    DEBUG_LOG("Attempting MQTT connection...");
-
-    String id = PROJECT_NAME;
-    id += board_info.mac();
-
-    // Attempt to connect
-    if (client.connect(id.c_str()))
-    {
-        //
-        // We've connected
-        //
-        DEBUG_LOG("connected\n");
+    return board_info.to_JSON();
+}
 
-        //
-        // Dump all our local details to the meta-topic
-        //
-        client.publish("meta", board_info.to_JSON().c_str());
 
-        //
-        // Subscribe to the `meta`-topic.
-        //
-        client.subscribe("meta");
 
-        //
-        // We can stop counting failures now.
-        //
-        count = 0;
-    }
-    else
-    {
-        DEBUG_LOG("failed, rc=%d, delaying for 5 seconds\n", client.state());
-        delay(5000);
-    }
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+
+    const MQTTStats &mq = client.getStats();
+    Metrics::counter(out, "mqtt_publishes_total", mq.publishes);
+    Metrics::counter(out, "mqtt_publish_failures_total", mq.publishFailures);
+    Metrics::counter(out, "mqtt_connects_total", mq.connects);
+    Metrics::counter(out, "mqtt_connect_failures_total", mq.connectFailures);
+    Metrics::counter(out, "mqtt_disconnects_total", connection.disconnects());
+    Metrics::gauge(out, "mqtt_reconnect_failures", connection.failures());
+    Metrics::counter(out, "mqtt_oversized_packets_total", mq.oversizedPackets);
+    Metrics::counter(out, "mqtt_batches_total", mq.batches);
+    Metrics::counter(out, "mqtt_batched_packets_total", mq.batchedPackets);
+    Metrics::counter(out, "mqtt_connect_refused_total", mq.connectRefused);
+    Metrics::counter(out, "mqtt_connect_timeouts_total", mq.connectTimeouts);
+    Metrics::counter(out, "mqtt_keepalive_timeouts_total", mq.keepaliveTimeouts);
+    Metrics::counter(out, "mqtt_connections_lost_total", mq.connectionsLost);
+    Metrics::counter(out, "mqtt_publish_bytes_sent_total", mq.bytesOut[MQTTPUBLISH >> 4]);
+    Metrics::counter(out, "mqtt_publish_bytes_received_total", mq.bytesIn[MQTTPUBLISH >> 4]);
+    Metrics::gauge(out, "mqtt_ping_us", mq.pingTime);
+    Metrics::gauge(out, "mqtt_ping_us_max", mq.pingTimeMax);
+    Metrics::counter(out, "mqtt_loop_ms_total", mq.loopTime / 1000);
+    Metrics::counter(out, "mqtt_publish_ms_total", mq.publishTime / 1000);
+    Metrics::counter(out, "mqtt_acknowledged_total", mq.acknowledged);
+    Metrics::counter(out, "mqtt_retransmits_total", mq.retransmits);
+    Metrics::gauge(out, "mqtt_inflight", client.getInflightCount());
+
+    const MQTTOutboxStats &high = outbox.stats(MQTT_OUTBOX_PRIORITY_HIGH);
+    Metrics::gauge(out, "mqtt_outbox_high_queued", outbox.queued(MQTT_OUTBOX_PRIORITY_HIGH));
+    Metrics::counter(out, "mqtt_outbox_high_sent_total", high.sent);
+    Metrics::counter(out, "mqtt_outbox_high_latency_ms_total", high.latency_total);
+    Metrics::gauge(out, "mqtt_outbox_high_latency_ms_max", high.latency_max);
+    Metrics::counter(out, "mqtt_outbox_dropped_total", outbox.dropped());
+    Metrics::counter(out, "mqtt_outbox_failed_total", outbox.failed());
 }
 
 
-
 //
 // Process an incoming HTTP-request.
 //
-void processHTTPRequest(WiFiClient httpclient)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (httpclient.connected() && !httpclient.available())
-        delay(1);
-
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
 
-    // Read the first line of the request
-    String request = httpclient.readStringUntil('\r');
-    httpclient.flush();
+    // Our API.
+    if (strcmp(request.path(), "/api/state") == 0)
+    {
+        request.send(200, "application/json", serveState);
+        return;
+    }
 
-    //
-    // Find the URL we were requested
-    //
-    // We'll have something like "GET XXXXX HTTP/XX"
-    // so we split at the space and send the "XXX HTTP/XX" value
-    //
-    request = request.substring(request.indexOf(" ")  + 1);
+    if (strcmp(request.path(), "/api/config") == 0)
+    {
+        request.send(200, "application/json", serveConfig);
+        return;
+    }
 
     //
     // Now we'll want to peel off any HTTP-parameters that might
     // be present, via our utility-helper.
     //
-    URL url(request.c_str());
+    URL url(request.path());
 
     //
     // Change the MQ server?
@@ -484,16 +579,16 @@ void processHTTPRequest(WiFiClient httpclient)
         strncpy(mqtt_server, mq, sizeof(mqtt_server) - 1);
 
         // Force a reconnection
-        client.disconnect();
+        connection.reconnect();
 
         // Redirect to the server-root
-        redirectIndex(httpclient);
+        redirectIndex(request);
         return;
     }
 
 
     // Return a simple response
-    serveHTML(httpclient);
+    request.send(200, "text/html", serveHTML);
 
 }
 
@@ -501,12 +596,40 @@ void processHTTPRequest(WiFiClient httpclient)
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
+}
+
+
+//
+// Serve our state, as JSON.
+//
+void serveState(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("mac", board_info.mac().c_str());
+    json.add("ip", board_info.ip().c_str());
+    json.end_object();
+}
+
+
+//
+// Serve our configuration, as JSON.
+//
+void serveConfig(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("mq", mqtt_server);
+    json.end_object();
 }
 
 
@@ -515,12 +638,8 @@ void redirectIndex(WiFiClient client)
 //
 // Serve a HTML-page to any clients who connect, via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
     client.println("<head>");
@@ -0,0 +1 @@
+../common/mqtt_connection.h
\ No newline at end of file
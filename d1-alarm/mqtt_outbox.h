@@ -0,0 +1 @@
+../common/mqtt_outbox.h
\ No newline at end of file
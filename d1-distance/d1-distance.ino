@@ -42,6 +42,39 @@
 #include "debug.h"
 
 
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
+//
+// For serving our API.
+//
+#include "json_writer.h"
+
+
+//
+// Our connection to the queue is kept up without blocking.
+//
+#include "mqtt_connection.h"
+
+
+//
+// Readings may instead be sent over MQTT-SN, via a gateway at the
+// address of our MQ server, if this is defined.  That needs neither a
+// TCP connection nor its keepalives, but the `meta`-topic isn't used.
+//
+#include "mqtt_sn_client.h"
+// #define MQTT_SN
+
+
 //
 // Pins on the sensor
 //
@@ -74,6 +107,27 @@ WiFiClient espClient;
 PubSubClient client(espClient);
 
 
+//
+// Reconnects the client, whenever it is dropped.
+//
+MQTTConnection connection(client);
+
+
+//
+// The topic we publish to, once a second.
+//
+MQTTTopic distance_topic("distance");
+
+
+#ifdef MQTT_SN
+//
+// Our MQTT-SN client, and its socket.
+//
+WiFiUDP snUDP;
+MQTTSNClient sn(snUDP);
+#endif
+
+
 //
 // Helper to dump our details.
 //
@@ -84,7 +138,13 @@ info board_info;
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 //
@@ -97,6 +157,19 @@ WiFiServer server(80);
 #define PROJECT_NAME "D1-DISTANCE"
 
 
+//
+// Write our most recent reading as JSON.
+//
+void distanceJSON(JSONWriter &json, long duration)
+{
+    json.begin_object();
+    json.add("distance", last_distance);
+    json.add("microseconds", duration);
+    json.add("mac", board_info.mac().c_str());
+    json.end_object();
+}
+
+
 //
 // Measure the distance via manipulation of the ultrasonic
 // sensor.
@@ -134,13 +207,25 @@ void measureDistance()
     DEBUG_LOG("Timing: %02d microseconds- Distance %02d CM\n",
               duration, last_distance);
 
-    // Format it.
-    String payload = "{\"distance\":" + String(last_distance) +
-                     ",\"microseconds\":" + String(duration) +
-                     ",\"mac\":\"" + board_info.mac() + "\"}";
-
-    // Publish it
-    client.publish("distance", payload.c_str());
+#ifdef MQTT_SN
+    // Each reading is a single datagram.
+    char payload[MQTT_SN_PACKET_SIZE - 7];
+    JSONWriter json(payload, sizeof(payload));
+    distanceJSON(json, duration);
+    sn.publish(distance_topic.name, payload);
+#else
+    // Find the length of the JSON we'll publish.
+    JSONWriter length(NULL, 0);
+    distanceJSON(length, duration);
+
+    // Publish it, writing the JSON straight to the client.
+    if (client.beginPublish(distance_topic, length.length(), false))
+    {
+        JSONWriter json(client);
+        distanceJSON(json, duration);
+        client.endPublish();
+    }
+#endif
 
 
 }
@@ -251,6 +336,7 @@ void setup()
     //
     // Start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s/\n",
               WiFi.localIP().toString().c_str());
@@ -269,11 +355,28 @@ void setup()
         strncpy(mqtt_server, DEFAULT_MQ_SERVER, sizeof(mqtt_server) - 1);
 
 
+#ifdef MQTT_SN
+    //
+    // MQTT-SN client-IDs are limited to 23 characters, so we're
+    // identified by our chip-ID.
+    //
+    sn.begin(mqtt_server, MQTT_SN_DEFAULT_PORT, String(PROJECT_NAME) + "-" + String(ESP.getChipId(), HEX));
+    sn.add_topic(distance_topic.name);
+#else
     //
     // Setup our pub-sub connection.
     //
     client.setServer(mqtt_server, 1883);
-    client.setCallback(callback);
+    client.addHandler("meta", callback);
+
+    //
+    // Keep connected in the background, subscribing and announcing
+    // ourselves each time we connect.
+    //
+    connection.begin(String(PROJECT_NAME) + board_info.mac());
+    connection.announce("meta", meta);
+    client.subscribe("meta");
+#endif
 }
 
 
@@ -284,6 +387,11 @@ void setup()
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
+
     //
     // Handle any pending over the air updates.
     //
@@ -294,16 +402,22 @@ void loop()
     //
     static long last_read = 0;
 
+#ifdef MQTT_SN
+    //
+    // Keep registered with our gateway.
+    //
+    sn.loop();
+#else
     //
     // Ensure we're connected to our queue.
     //
-    if (!client.connected())
-        reconnect();
+    connection.loop();
 
     //
     // Handle queue messages.
     //
     client.loop();
+#endif
 
     // Get the current time.
     long now = millis();
@@ -323,23 +437,20 @@ void loop()
     //
     // (This allows changing the stop, timezone, backlight, etc.)
     //
-    WiFiClient client = server.available();
-
-    if (client)
-        processHTTPRequest(client);
+    server.handle();
 
 }
 
 
 //
-// This is called when messages are received.
+// This is called when messages are received on the `meta`-topic.
 //
 // We only subscribe to the `meta`-topic, and we don't do
 // anything with the messages.  It's just a nice example
 // showing how we could if we wanted to.
 //
 //
-void callback(char* topic, byte* payload, unsigned int length)
+void callback(const char* topic, const uint8_t* payload, unsigned int length, void* context)
 {
     Serial.print("Message arrived [Topic:");
     Serial.print(topic);
@@ -355,67 +466,87 @@ void callback(char* topic, byte* payload, unsigned int length)
 
 
 //
-// Reconnect to the pub-sub-server, if we're dropped.
+// Our meta-details, published to the `meta`-topic each time we
+// connect.
 //
-void reconnect()
+String meta()
 {
-    // Loop until we're reconnected
-    while (!client.connected())
-    {
-        DEBUG_LOG("Attempting to connect to MQ ..");
+    return board_info.to_JSON();
+}
 
-        String id = PROJECT_NAME;
-        id += board_info.mac();
 
-        // Attempt to connect
-        if (client.connect(id.c_str()))
-        {
-            // We've connected
-            DEBUG_LOG("\tconnected\n");
-
-            //
-            // Dump all our local details to the meta-topic
-            //
-            client.publish("meta", board_info.to_JSON().c_str());
-
-            //
-            // Subscribe to the `meta`-topic.
-            //
-            client.subscribe("meta");
-        }
-        else
-        {
-            DEBUG_LOG("\tfailed, rc=%02d, will retry in 5 seconds.\n",
-                      client.state());
-            delay(5000);
-        }
-    }
-
-}
 
 
 
 
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+
+    const MQTTStats &mq = client.getStats();
+    Metrics::counter(out, "mqtt_publishes_total", mq.publishes);
+    Metrics::counter(out, "mqtt_publish_failures_total", mq.publishFailures);
+    Metrics::counter(out, "mqtt_connects_total", mq.connects);
+    Metrics::counter(out, "mqtt_connect_failures_total", mq.connectFailures);
+    Metrics::counter(out, "mqtt_disconnects_total", connection.disconnects());
+    Metrics::gauge(out, "mqtt_reconnect_failures", connection.failures());
+    Metrics::counter(out, "mqtt_oversized_packets_total", mq.oversizedPackets);
+    Metrics::counter(out, "mqtt_batches_total", mq.batches);
+    Metrics::counter(out, "mqtt_batched_packets_total", mq.batchedPackets);
+    Metrics::counter(out, "mqtt_connect_refused_total", mq.connectRefused);
+    Metrics::counter(out, "mqtt_connect_timeouts_total", mq.connectTimeouts);
+    Metrics::counter(out, "mqtt_keepalive_timeouts_total", mq.keepaliveTimeouts);
+    Metrics::counter(out, "mqtt_connections_lost_total", mq.connectionsLost);
+    Metrics::counter(out, "mqtt_publish_bytes_sent_total", mq.bytesOut[MQTTPUBLISH >> 4]);
+    Metrics::counter(out, "mqtt_publish_bytes_received_total", mq.bytesIn[MQTTPUBLISH >> 4]);
+    Metrics::gauge(out, "mqtt_ping_us", mq.pingTime);
+    Metrics::gauge(out, "mqtt_ping_us_max", mq.pingTimeMax);
+    Metrics::counter(out, "mqtt_loop_ms_total", mq.loopTime / 1000);
+    Metrics::counter(out, "mqtt_publish_ms_total", mq.publishTime / 1000);
+}
 
 
 //
 // Process an incoming HTTP-request.
 //
-void processHTTPRequest(WiFiClient client)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (client.connected() && !client.available())
-        delay(1);
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
 
-    // Read the first line of the request
-    String request = client.readStringUntil('\r');
-    client.flush();
+    // The path, and any parameters, of the request
+    const char *path = request.path();
+
+    // Our API.
+    if (strcmp(path, "/api/state") == 0)
+    {
+        request.send(200, "application/json", serveState);
+        return;
+    }
+
+    if (strcmp(path, "/api/config") == 0)
+    {
+        request.send(200, "application/json", serveConfig);
+        return;
+    }
 
     // Change the MQ server?
-    if (request.indexOf("/?mq=") != -1)
+    if (strstr(path, "/?mq=") != NULL)
     {
         char *pattern = "/?mq=";
-        char *s = strstr(request.c_str(), pattern);
+        const char *s = strstr(path, pattern);
 
         if (s != NULL)
         {
@@ -441,17 +572,18 @@ void processHTTPRequest(WiFiClient client)
             memset(mqtt_server, '\0', sizeof(mqtt_server));
             strncpy(mqtt_server, tmp, sizeof(mqtt_server) - 1);
 
-            // TODO - force reconnect
+            // Force a reconnection
+            connection.reconnect();
         }
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
 
     // Return a simple response
-    serveHTML(client);
+    request.send(200, "text/html", serveHTML);
 
 }
 
@@ -459,12 +591,40 @@ void processHTTPRequest(WiFiClient client)
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
+}
+
+
+//
+// Serve our most recent reading, as JSON.
+//
+void serveState(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("distance", last_distance);
+    json.add("mac", board_info.mac().c_str());
+    json.end_object();
+}
+
+
+//
+// Serve our configuration, as JSON.
+//
+void serveConfig(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("mq", mqtt_server);
+    json.end_object();
 }
 
 
@@ -473,12 +633,8 @@ void redirectIndex(WiFiClient client)
 //
 // Serve a HTML-page to any clients who connect, via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
     client.println("<head>");
@@ -0,0 +1 @@
+../common/http_server.cpp
\ No newline at end of file
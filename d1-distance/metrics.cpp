@@ -0,0 +1 @@
+../common/metrics.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/mqtt_connection.cpp
\ No newline at end of file
@@ -137,6 +137,24 @@
 #include "debug.h"
 
 
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
+//
+// For serving our API.
+//
+#include "json_writer.h"
+
+
 //
 // The button handler
 //
@@ -163,7 +181,7 @@ void handlePendingButtons();
 void on_short_click();
 void on_long_click();
 void on_double_click();
-void processHTTPRequest(WiFiClient client);
+void processHTTPRequest(HTTPRequest &request);
 void set_display_mode(const char *mode);
 
 //
@@ -182,7 +200,13 @@ int time_zone_offset = 0;
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 //
@@ -426,6 +450,7 @@ void setup()
     //
     // Now we can start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s/\n",
               WiFi.localIP().toString().c_str());
@@ -553,6 +578,11 @@ void access_point_callback(WiFiManager* myWiFiManager)
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
+
     //
     // Keep the previous time, to avoid needless re-draws
     //
@@ -811,10 +841,7 @@ void loop()
     //
     // (This allows changing the stop, timezone, backlight, etc.)
     //
-    WiFiClient client = server.available();
-
-    if (client)
-        processHTTPRequest(client);
+    server.handle();
 
     //
     // Now sleep a little.
@@ -1170,12 +1197,13 @@ void fetch_tram_times()
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
 }
 
 
@@ -1184,7 +1212,7 @@ void redirectIndex(WiFiClient client)
 //
 // One of these might be selected.
 //
-void output_select(WiFiClient client, char *name, bool enabled, int selected)
+void output_select(Print &client, char *name, bool enabled, int selected)
 {
     client.printf("<select id=\"%s\" name=\"%s\" %s>", name, name,
                   enabled ? "" : "disabled");
@@ -1198,17 +1226,21 @@ void output_select(WiFiClient client, char *name, bool enabled, int selected)
     client.println("</select>");
 }
 
+//
+// The time at which the current page was requested.
+//
+// The page is rendered twice, once to find its length, so it must
+// show the same uptime each time.
+//
+unsigned long render_millis = 0;
+
 //
 // This is a bit horrid.
 //
 // Serve a HTML-page to any clients who connect via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
 
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
@@ -1417,7 +1449,7 @@ void serveHTML(WiFiClient client)
     client.println("<p>Uptime:</p><blockquote>");
 
 
-    long currentmillis = millis();
+    long currentmillis = render_millis;
     long days = 0;
     long hours = 0;
     long mins = 0;
@@ -1445,6 +1477,81 @@ void serveHTML(WiFiClient client)
 }
 
 
+//
+// Return the name of our display-mode, as used by `set_display_mode`.
+//
+const char *display_mode_name()
+{
+    switch (g_state)
+    {
+    case DATE:
+        return "date";
+
+    case TEMPERATURE:
+        return "temp";
+
+    case DATE_OR_TEMP:
+        return "dt";
+
+    case MESSAGE:
+        return "msg";
+    }
+
+    return "date";
+}
+
+
+//
+// Serve our current state, as JSON.
+//
+void serveState(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("mode", display_mode_name());
+    json.add("temperature", g_temp);
+    json.add("backlight", backlight);
+    json.add("uptime", render_millis / 1000);
+
+    //
+    // The lines upon the display.
+    //
+    json.key("screen");
+    json.begin_array();
+
+    for (int i = 0; i < NUM_ROWS; i++)
+    {
+        char line[NUM_COLS + 1] = { '\0' };
+        memcpy(line, screen[i], NUM_COLS);
+        json.value(line);
+    }
+
+    json.end_array();
+    json.end_object();
+}
+
+
+//
+// Serve our configuration, as JSON.
+//
+void serveConfig(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("stop", tram_stop);
+    json.add("api", api_end_point);
+    json.add("temp_api", temp_end_point);
+    json.add("tz", time_zone_offset);
+    json.add("mode", display_mode_name());
+    json.add("msg", g_msg);
+    json.add("backlight_on", backlight_on);
+    json.add("backlight_off", backlight_off);
+    json.end_object();
+}
+
+
 //
 // Open the given file for writing, and write out the specified data.
 //
@@ -1521,6 +1628,32 @@ void draw_line(int row, const char *txt)
 
 }
 
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+
+    Metrics::counter(out, "ntp_syncs_total", timeClient.getSyncCount());
+    Metrics::counter(out, "ntp_sync_failures_total", timeClient.getSyncFailures());
+    Metrics::gauge(out, "ntp_offset_seconds", timeClient.getLastOffset());
+    Metrics::gauge(out, "ntp_offset_milliseconds", timeClient.getLastOffsetMillis());
+    Metrics::gauge(out, "ntp_delay_milliseconds", timeClient.getLastDelay());
+    Metrics::gauge(out, "ntp_drift_ppb", timeClient.getDrift());
+
+    UrlFetcherStats fetches = UrlFetcher::stats();
+    Metrics::counter(out, "url_fetches_total", fetches.fetches);
+    Metrics::counter(out, "url_fetch_failures_total", fetches.failures);
+    Metrics::gauge(out, "url_fetch_latency_milliseconds", fetches.last_latency);
+    Metrics::gauge(out, "url_fetch_max_latency_milliseconds", fetches.max_latency);
+}
+
+
 //
 // Process an incoming HTTP-request.
 //
@@ -1531,36 +1664,42 @@ void draw_line(int row, const char *txt)
 // root - otherwise we return the same HTML every time.  There's no AJAX
 // or other dynamic action happening.
 //
-void processHTTPRequest(WiFiClient client)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (client.connected() && !client.available())
-        delay(1);
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
 
-    // Read the first line of the request
-    String request = client.readStringUntil('\r');
-    client.flush();
+    // Our API.
+    if (strcmp(request.path(), "/api/state") == 0)
+    {
+        render_millis = millis();
+        request.send(200, "application/json", serveState);
+        return;
+    }
 
-    //
-    // Find the URL we were requested
-    //
-    // We'll have something like "GET XXXXX HTTP/XX"
-    // so we split at the space and send the "XXX HTTP/XX" value
-    //
-    request = request.substring(request.indexOf(" ")  + 1);
+    if (strcmp(request.path(), "/api/config") == 0)
+    {
+        request.send(200, "application/json", serveConfig);
+        return;
+    }
 
     //
     // Now we'll want to peel off any HTTP-parameters that might
     // be present, via our utility-helper.
     //
-    URL url(request.c_str());
+    URL url(request.path());
 
     //
     // Does the user want to reboot?
     //
     char *b = url.param("reboot");
     if (b != NULL && ( strcmp(b, "reboot" ) == 0 ) ) {
-        redirectIndex(client);
+        redirectIndex(request);
         ESP.reset();
         return;
     }
@@ -1588,7 +1727,7 @@ void processHTTPRequest(WiFiClient client)
         }
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -1616,7 +1755,7 @@ void processHTTPRequest(WiFiClient client)
 
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -1653,7 +1792,7 @@ void processHTTPRequest(WiFiClient client)
 
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
 
     }
@@ -1707,7 +1846,7 @@ void processHTTPRequest(WiFiClient client)
             backlight_off = -1;
         }
 
-        redirectIndex(client);
+        redirectIndex(request);
         return;
 
     }
@@ -1729,7 +1868,7 @@ void processHTTPRequest(WiFiClient client)
         fetch_tram_times();
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -1750,7 +1889,7 @@ void processHTTPRequest(WiFiClient client)
         fetch_temperature();
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -1772,7 +1911,7 @@ void processHTTPRequest(WiFiClient client)
         timeClient.forceUpdate();
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -1783,6 +1922,7 @@ void processHTTPRequest(WiFiClient client)
     //
     // Either way return a simple response.
     //
-    serveHTML(client);
+    render_millis = millis();
+    request.send(200, "text/html", serveHTML);
 
 }
@@ -15,6 +15,26 @@
 #include "Adafruit_GFX.h"
 #include "Adafruit_LEDBackpack.h"
 
+//
+// Frames may be streamed to us via a WebSocket.
+//
+#include "websocket.h"
+
+//
+// Our application is served from SPIFFS.
+//
+#include "static_file.h"
+
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
 //
 // Debug messages over the serial console.
 //
@@ -51,13 +71,49 @@
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 //
 // The matrix-display itself
 //
 Adafruit_8x8matrix matrix = Adafruit_8x8matrix();
 
+//
+// The browser can stream frames to us over a persistent WebSocket,
+// which is available at `/ws`.
+//
+WebSocket ws;
+
+
+//
+// The pattern currently shown on the matrix, one byte per row.
+//
+uint8_t current_pattern[8] = { 0 };
+
+
+//
+// Draw the given eight-row pattern upon the LED Matrix.
+//
+// Updating the display is an I2C transfer, so we skip it if
+// nothing has changed.
+//
+void draw_pattern(const uint8_t *pattern)
+{
+    if (memcmp(pattern, current_pattern, sizeof(current_pattern)) == 0)
+        return;
+
+    memcpy(current_pattern, pattern, sizeof(current_pattern));
+
+    matrix.clear();
+    matrix.drawBitmap(0, 0, current_pattern, 8, 8, LED_ON);
+    matrix.writeDisplay();
+}
+
 
 //
 // Given a request-string such as : 1,2,3,4,5
@@ -65,45 +121,162 @@ Adafruit_8x8matrix matrix = Adafruit_8x8matrix();
 // Populate an eight-line array with the data, and
 // use that data to draw on the LED Matrix.
 //
-void light_leds(char *txt)
+void light_leds(const char *txt)
 {
     DEBUG_LOG("INPUT:");
     DEBUG_LOG(txt);
     DEBUG_LOG("\n");
 
-    uint8_t  pattern[8];
-
-    // Ensure the pattern is OK
-    for (int i = 0; i < 8; i++)
-        pattern[i] = 0;
+    uint8_t pattern[8] = { 0 };
 
     // Current line.
     int line = 0;
 
-    // Copy of the data - strtok modifies it.
-    char *data = strdup(txt);
-
-    // Look for the ","
-    char *pch = strtok(data, ",");
+    // Parse each comma-separated number in place.
+    const char *pch = txt;
 
-    while ((pch != NULL) && (line < 8))
+    while ((*pch != '\0') && (line < 8))
     {
-        DEBUG_LOG("  Line %d is '%s'\n", line, pch);
+        char *end;
+        pattern[line] = strtoul(pch, &end, 10);
+        pch = end;
 
-        pattern[line] = atoi(pch);
+        DEBUG_LOG("  Line %d is '%d'\n", line, pattern[line]);
 
         line += 1;
-        pch = strtok(NULL, ",");
-    }
 
-    // Free the copy of the data
-    free(data);
+        if (*pch != ',')
+            break;
+
+        pch += 1;
+    }
 
     // Show the data on the display
-    matrix.clear();
-    matrix.drawBitmap(0, 0, pattern, 8, 8, LED_ON);
-    matrix.writeDisplay();
+    draw_pattern(pattern);
+}
+
+
+//
+// Apply a binary frame, received via our WebSocket, to the given pattern.
+//
+// There are two kinds of frame:
+//
+//  * Eight bytes - the complete pattern, one byte per row.
+//
+//  * Two, four, or six bytes - pairs of "row, value", updating
+//    only the rows that changed.
+//
+// (A delta of four or more rows is never smaller than the complete
+// pattern, so the browser sends the full frame instead.)
+//
+void apply_frame(uint8_t *pattern, const uint8_t *buf, int len)
+{
+    if (len == 8)
+    {
+        memcpy(pattern, buf, 8);
+        return;
+    }
 
+    if ((len > 0) && (len < 8) && ((len % 2) == 0))
+    {
+        for (int i = 0; i < len; i += 2)
+        {
+            if (buf[i] < 8)
+                pattern[buf[i]] = buf[i + 1];
+        }
+
+        return;
+    }
+
+    DEBUG_LOG("Ignoring WebSocket frame of %d bytes\n", len);
+}
+
+
+//
+// Process any frames which have arrived via our WebSocket.
+//
+// All the frames which are pending are applied, then the display
+// is updated once.
+//
+void processWebSocket()
+{
+    uint8_t pattern[8];
+    memcpy(pattern, current_pattern, sizeof(pattern));
+
+    uint8_t buf[WS_MAX_PAYLOAD];
+    bool binary;
+    int len;
+
+    while ((len = ws.read(buf, sizeof(buf), &binary)) >= 0)
+    {
+        if (binary)
+            apply_frame(pattern, buf, len);
+    }
+
+    draw_pattern(pattern);
+}
+
+
+
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+}
+
+
+//
+// Handle a single request made to our HTTP-server.
+//
+void processHTTPRequest(HTTPRequest &request)
+{
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
+
+    const char *path = request.path();
+
+    // Open a WebSocket?
+    if ((strcmp(path, "/ws") == 0) && (strlen(request.websocket_key()) > 0))
+    {
+        DEBUG_LOG("WebSocket opened\n");
+        ws.accept(request.client(), request.websocket_key());
+        request.detach();
+        return;
+    }
+
+    // Change the LED pattern?
+    const char *s = strstr(path, "/?data=");
+
+    if (s != NULL)
+    {
+        light_leds(s + strlen("/?data="));
+
+        // Return a simple response
+        request.send(200, "text/plain", "OK\n");
+    }
+    else if (strcmp(path, "/app.js") == 0)
+    {
+        //
+        // Serve our Application.
+        //
+        serve_file(request, "/app.js", "application/javascript");
+    }
+    else
+    {
+        //  Serve /index.html
+        serve_file(request, "/index.html", "text/html");
+    }
 }
 
 
@@ -133,6 +306,7 @@ void setup()
     //
     // Now we can start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("Server started\n");
 
@@ -205,6 +379,10 @@ void setup()
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
 
     //
     // Handle any pending over the air updates.
@@ -212,84 +390,13 @@ void loop()
     ArduinoOTA.handle();
 
     //
-    // Check if a client has connected to our HTTP-server.
+    // Apply any frames streamed over our WebSocket.
     //
-    WiFiClient client = server.available();
-
-    // If so.
-    if (client)
-    {
-        // Wait until the client sends some data
-        while (client.connected() && !client.available())
-            delay(1);
-
-        // Read the first line of the request
-        String request = client.readStringUntil('\r');
-        client.flush();
-
-        // Change the LED pattern?
-        if (request.indexOf("/?data=") != -1)
-        {
-            char *pattern = "/?data=";
-            char *s = strstr(request.c_str(), pattern);
-
-            if (s != NULL)
-                light_leds(s + strlen("/?data="));
-
-            // Return a simple response
-            client.println("HTTP/1.1 200 OK");
-            client.println("Content-Type: text/plain");
-            client.println("");
-            client.println("OK");
-        }
-        else if (request.indexOf("/app.js") != -1)
-        {
-            //
-            // Serve our Application.
-            //
-            client.println("HTTP/1.1 200 OK");
-            client.println("Content-Type: application/javascript");
-            client.println("");
-
-            File dataFile = SPIFFS.open("/app.js", "r");
-
-            if (dataFile)
-            {
-
-                while (dataFile.available())
-                {
-                    //Lets read line by line from the file
-                    String line = dataFile.readStringUntil('\n');
-                    client.println(line);
-                }
-
-                dataFile.close();
-            }
-        }
-        else
-        {
-            //  Serve /index.html
-            client.println("HTTP/1.1 200 OK");
-            client.println("Content-Type: text/html");
-            client.println("");
-
-            File dataFile = SPIFFS.open("/index.html", "r");
-
-            if (dataFile)
-            {
-
-                while (dataFile.available())
-                {
-                    //Lets read line by line from the file
-                    String line = dataFile.readStringUntil('\n');
-                    client.println(line);
-                }
-
-                dataFile.close();
-            }
-        }
-
-        delay(10);
-    }
+    if (ws.connected())
+        processWebSocket();
 
+    //
+    // Handle any HTTP-requests, without waiting for slow clients.
+    //
+    server.handle();
 }
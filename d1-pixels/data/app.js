@@ -245,6 +245,7 @@ var ImageCanvas = function( options )
         dump: function ( step, canvas, context )
         {
             var orig = $('#data').text();
+            var rows = [];
 
             $('#data').html("");
 
@@ -267,6 +268,7 @@ var ImageCanvas = function( options )
                 }
                 // Convert to decimal
                 row = parseInt(row, 2);
+                rows.push( row );
 
                 // Show what we'll send
                 $("#data").append( row);
@@ -274,6 +276,13 @@ var ImageCanvas = function( options )
                     $("#data").append( "," );
             }
 
+            //
+            // If we have a WebSocket open then stream the
+            // change as a binary frame.
+            //
+            if ( Matrix.send( rows ) )
+                return;
+
             if ( orig != $('#data').text() )
             {
                 //
@@ -281,13 +290,74 @@ var ImageCanvas = function( options )
                 // have changed since their last dump.
                 //
                 $.get( "/?data=" + $('#data').text(), function( data ) {
-                    console_log( "Requested data" );
+                    console.log( "Requested data" );
                 });
             }
         }
     };
 };
 
+
+//
+// The matrix we're drawing upon, which is reached via a WebSocket.
+//
+// Frames are sent as binary messages, either:
+//
+//   * Eight bytes - one per row.
+//   * Pairs of "row, value" bytes, for only the rows which changed.
+//
+// If the socket isn't open callers fall back to plain HTTP requests.
+//
+var Matrix = {
+    socket: null,
+    sent: null,
+
+    connect: function()
+    {
+        var socket = new WebSocket( "ws://" + window.location.host + "/ws" );
+        socket.binaryType = "arraybuffer";
+
+        socket.onopen = function() {
+            // Force the complete pattern to be sent.
+            Matrix.sent = null;
+            Matrix.socket = socket;
+        };
+
+        socket.onclose = function() {
+            Matrix.socket = null;
+            setTimeout( Matrix.connect, 2000 );
+        };
+    },
+
+    send: function( rows )
+    {
+        if ( Matrix.socket === null || Matrix.socket.readyState !== WebSocket.OPEN )
+            return false;
+
+        var changed = [];
+
+        for (var i = 0; i < rows.length; i += 1)
+        {
+            if ( Matrix.sent === null || Matrix.sent[i] !== rows[i] )
+                changed.push( i, rows[i] );
+        }
+
+        if ( changed.length == 0 )
+            return true;
+
+        if ( changed.length < rows.length )
+            Matrix.socket.send( new Uint8Array( changed ) );
+        else
+            Matrix.socket.send( new Uint8Array( rows ) );
+
+        Matrix.sent = rows;
+        return true;
+    }
+};
+
+if ( "WebSocket" in window )
+    Matrix.connect();
+
 var Mouse = {
     x: 0,
     y: 0,
@@ -0,0 +1 @@
+../common/metrics.h
\ No newline at end of file
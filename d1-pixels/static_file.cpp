@@ -0,0 +1 @@
+../common/static_file.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/static_file.h
\ No newline at end of file
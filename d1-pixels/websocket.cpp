@@ -0,0 +1 @@
+../common/websocket.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/websocket.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/cbor_writer.cpp
\ No newline at end of file
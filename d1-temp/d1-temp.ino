@@ -48,6 +48,51 @@
 #include "debug.h"
 
 
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
+//
+// For serving our API.
+//
+#include "json_writer.h"
+
+
+//
+// Readings may instead be published in the more compact CBOR.
+//
+#include "cbor_writer.h"
+
+
+//
+// Our connection to the queue is kept up without blocking.
+//
+#include "mqtt_connection.h"
+
+
+//
+// Readings are queued while we're disconnected.
+//
+#include "mqtt_outbox.h"
+
+
+//
+// Readings may instead be sent over MQTT-SN, via a gateway at the
+// address of our MQ server, if this is defined.  That needs neither a
+// TCP connection nor its keepalives, but the `meta`-topic isn't used.
+//
+#include "mqtt_sn_client.h"
+// #define MQTT_SN
+
+
 //
 // The pin we're connecting the sensor to
 //
@@ -73,6 +118,27 @@ WiFiClient espClient;
 PubSubClient client(espClient);
 
 
+//
+// Reconnects the client, whenever it is dropped.
+//
+MQTTConnection connection(client);
+
+
+//
+// Readings waiting to be published.
+//
+MQTTOutbox outbox(client);
+
+
+#ifdef MQTT_SN
+//
+// Our MQTT-SN client, and its socket.
+//
+WiFiUDP snUDP;
+MQTTSNClient sn(snUDP);
+#endif
+
+
 //
 // Helper to dump our details.
 //
@@ -90,7 +156,13 @@ static double last_temperature = -1;
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 //
@@ -103,6 +175,27 @@ WiFiServer server(80);
 #define PROJECT_NAME "D1-TEMP"
 
 
+//
+// Readings are published to the `temperature`-topic as JSON, unless
+// this is defined.  Then they're encoded as CBOR, and we're identified
+// by our chip-ID rather than our MAC address; 41 bytes rather than 64.
+//
+// #define TEMPERATURE_CBOR
+
+
+//
+// Publish a reading, via whichever transport we're using.
+//
+void publishReading(const uint8_t *payload, size_t length)
+{
+#ifdef MQTT_SN
+    sn.publish("temperature", payload, length, MQTT_SN_QOS_1);
+#else
+    outbox.publish("temperature", payload, length, false, 1);
+#endif
+}
+
+
 
 //
 // Measure the temperature + humidity, then post that to the "temperature"
@@ -126,17 +219,35 @@ void measureDHT()
         DEBUG_LOG("Humidity: %02d - Temperature %02d\n",
                   DHT.humidity, DHT.temperature);
 
+#ifdef TEMPERATURE_CBOR
+        // Encode it.
+        uint8_t payload[48];
+        CBORWriter cbor(payload, sizeof(payload));
+        cbor.begin_object();
+        cbor.add("temperature", DHT.temperature);
+        cbor.add("humidity", DHT.humidity);
+        cbor.add("id", ESP.getChipId());
+        cbor.end_object();
+
+        // Publish it
+        publishReading(payload, cbor.length());
+#else
         // Format it.
-        String payload = "{\"temperature\":" + String(DHT.temperature) +
-                         ",\"humidity\":" + String(DHT.humidity) +
-                         ",\"mac\":\"" + board_info.mac() + "\"}";
+        char payload[128];
+        JSONWriter json(payload, sizeof(payload));
+        json.begin_object();
+        json.add("temperature", DHT.temperature);
+        json.add("humidity", DHT.humidity);
+        json.add("mac", board_info.mac().c_str());
+        json.end_object();
 
         // Publish it
-        client.publish("temperature", payload.c_str());
+        publishReading((const uint8_t *)payload, strlen(payload));
+#endif
 
         // Record so that the HTTP-server can serve it.
         last_temperature = DHT.temperature;
-        last_humidity = DHT.temperature;
+        last_humidity = DHT.humidity;
 
         return;
 
@@ -246,6 +357,13 @@ void setup()
     ArduinoOTA.onStart([]()
     {
         DEBUG_LOG("OTA Start\n");
+
+        //
+        // We'll restart once the update is complete, so keep any queued
+        // messages in flash - unless it is the flash being replaced.
+        //
+        if (ArduinoOTA.getCommand() == U_FLASH)
+            outbox.flush();
     });
     ArduinoOTA.onEnd([]()
     {
@@ -281,6 +399,7 @@ void setup()
     //
     // Start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s/\n",
               WiFi.localIP().toString().c_str());
@@ -299,11 +418,45 @@ void setup()
         strncpy(mqtt_server, DEFAULT_MQ_SERVER, sizeof(mqtt_server) - 1);
 
 
+#ifdef MQTT_SN
+    //
+    // MQTT-SN client-IDs are limited to 23 characters, so we're
+    // identified by our chip-ID.
+    //
+    sn.begin(mqtt_server, MQTT_SN_DEFAULT_PORT, String(PROJECT_NAME) + "-" + String(ESP.getChipId(), HEX));
+    sn.add_topic("temperature");
+#else
     //
     // Setup our pub-sub connection.
     //
     client.setServer(mqtt_server, 1883);
-    client.setCallback(callback);
+    client.addHandler("meta", callback);
+
+    //
+    // Keep connected in the background, subscribing and announcing
+    // ourselves each time we connect.
+    //
+    connection.begin(String(PROJECT_NAME) + board_info.mac());
+    connection.announce("meta", meta);
+    client.subscribe("meta");
+
+    //
+    // Our payloads are up to 128 bytes, which leaves no room for the
+    // topic and header in the default buffer.
+    //
+    client.setBufferSize(160);
+
+    //
+    // Readings are published with QoS 1, so they survive a dropped
+    // connection; allow a few to await acknowledgement at once.
+    //
+    client.setInflightWindow(4);
+
+    //
+    // Restore any readings queued before we last restarted.
+    //
+    outbox.begin();
+#endif
 }
 
 
@@ -314,6 +467,11 @@ void setup()
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
+
     //
     // Handle any pending over the air updates.
     //
@@ -324,17 +482,28 @@ void loop()
     //
     static long last_read = 0;
 
+#ifdef MQTT_SN
+    //
+    // Keep registered with our gateway.
+    //
+    sn.loop();
+#else
     //
     // Ensure we're connected to our queue.
     //
-    if (!client.connected())
-        reconnect();
+    connection.loop();
 
     //
     // Handle queue messages.
     //
     client.loop();
 
+    //
+    // Send any readings we queued while disconnected.
+    //
+    outbox.loop();
+#endif
+
     // Get the current time.
     long now = millis();
 
@@ -353,23 +522,20 @@ void loop()
     //
     // (This allows changing the stop, timezone, backlight, etc.)
     //
-    WiFiClient client = server.available();
-
-    if (client)
-        processHTTPRequest(client);
+    server.handle();
 
 }
 
 
 //
-// This is called when messages are received.
+// This is called when messages are received on the `meta`-topic.
 //
 // We only subscribe to the `meta`-topic, and we don't do
 // anything with the messages.  It's just a nice example
 // showing how we could if we wanted to.
 //
 //
-void callback(char* topic, byte* payload, unsigned int length)
+void callback(const char* topic, const uint8_t* payload, unsigned int length, void* context)
 {
     Serial.print("Message arrived [Topic:");
     Serial.print(topic);
@@ -385,67 +551,99 @@ void callback(char* topic, byte* payload, unsigned int length)
 
 
 //
-// Reconnect to the pub-sub-server, if we're dropped.
+// Our meta-details, published to the `meta`-topic each time we
+// connect.
 //
-void reconnect()
+String meta()
 {
-    // Loop until we're reconnected
-    while (!client.connected())
-    {
-        DEBUG_LOG("Attempting to connect to MQ ..");
-
-        String id = PROJECT_NAME;
-        id += board_info.mac();
+    return board_info.to_JSON();
+}
 
-        // Attempt to connect
-        if (client.connect(id.c_str()))
-        {
-            // We've connected
-            DEBUG_LOG("\tconnected\n");
-
-            //
-            // Dump all our local details to the meta-topic
-            //
-            client.publish("meta", board_info.to_JSON().c_str());
-
-            //
-            // Subscribe to the `meta`-topic.
-            //
-            client.subscribe("meta");
-        }
-        else
-        {
-            DEBUG_LOG("\tfailed, rc=%02d, will retry in 5 seconds.\n",
-                      client.state());
-            delay(5000);
-        }
-    }
 
-}
 
 
 
 
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+
+    const MQTTStats &mq = client.getStats();
+    Metrics::counter(out, "mqtt_publishes_total", mq.publishes);
+    Metrics::counter(out, "mqtt_publish_failures_total", mq.publishFailures);
+    Metrics::counter(out, "mqtt_connects_total", mq.connects);
+    Metrics::counter(out, "mqtt_connect_failures_total", mq.connectFailures);
+    Metrics::counter(out, "mqtt_disconnects_total", connection.disconnects());
+    Metrics::gauge(out, "mqtt_reconnect_failures", connection.failures());
+    Metrics::counter(out, "mqtt_oversized_packets_total", mq.oversizedPackets);
+    Metrics::counter(out, "mqtt_batches_total", mq.batches);
+    Metrics::counter(out, "mqtt_batched_packets_total", mq.batchedPackets);
+    Metrics::counter(out, "mqtt_connect_refused_total", mq.connectRefused);
+    Metrics::counter(out, "mqtt_connect_timeouts_total", mq.connectTimeouts);
+    Metrics::counter(out, "mqtt_keepalive_timeouts_total", mq.keepaliveTimeouts);
+    Metrics::counter(out, "mqtt_connections_lost_total", mq.connectionsLost);
+    Metrics::counter(out, "mqtt_publish_bytes_sent_total", mq.bytesOut[MQTTPUBLISH >> 4]);
+    Metrics::counter(out, "mqtt_publish_bytes_received_total", mq.bytesIn[MQTTPUBLISH >> 4]);
+    Metrics::gauge(out, "mqtt_ping_us", mq.pingTime);
+    Metrics::gauge(out, "mqtt_ping_us_max", mq.pingTimeMax);
+    Metrics::counter(out, "mqtt_loop_ms_total", mq.loopTime / 1000);
+    Metrics::counter(out, "mqtt_publish_ms_total", mq.publishTime / 1000);
+    Metrics::counter(out, "mqtt_acknowledged_total", mq.acknowledged);
+    Metrics::counter(out, "mqtt_retransmits_total", mq.retransmits);
+    Metrics::gauge(out, "mqtt_inflight", client.getInflightCount());
+    Metrics::gauge(out, "mqtt_outbox_queued", outbox.queued());
+    Metrics::counter(out, "mqtt_outbox_dropped_total", outbox.dropped());
+    Metrics::counter(out, "mqtt_outbox_failed_total", outbox.failed());
+
+    const MQTTOutboxStats &normal = outbox.stats(MQTT_OUTBOX_PRIORITY_NORMAL);
+    Metrics::counter(out, "mqtt_outbox_sent_total", normal.sent);
+    Metrics::counter(out, "mqtt_outbox_timed_total", normal.timed);
+    Metrics::counter(out, "mqtt_outbox_latency_ms_total", normal.latency_total);
+    Metrics::gauge(out, "mqtt_outbox_latency_ms_max", normal.latency_max);
+}
 
 
 //
 // Process an incoming HTTP-request.
 //
-void processHTTPRequest(WiFiClient client)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (client.connected() && !client.available())
-        delay(1);
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
+
+    // The path, and any parameters, of the request
+    const char *path = request.path();
 
-    // Read the first line of the request
-    String request = client.readStringUntil('\r');
-    client.flush();
+    // Our API.
+    if (strcmp(path, "/api/state") == 0)
+    {
+        request.send(200, "application/json", serveState);
+        return;
+    }
+
+    if (strcmp(path, "/api/config") == 0)
+    {
+        request.send(200, "application/json", serveConfig);
+        return;
+    }
 
     // Change the MQ server?
-    if (request.indexOf("/?mq=") != -1)
+    if (strstr(path, "/?mq=") != NULL)
     {
         char *pattern = "/?mq=";
-        char *s = strstr(request.c_str(), pattern);
+        const char *s = strstr(path, pattern);
 
         if (s != NULL)
         {
@@ -471,17 +669,18 @@ void processHTTPRequest(WiFiClient client)
             memset(mqtt_server, '\0', sizeof(mqtt_server));
             strncpy(mqtt_server, tmp, sizeof(mqtt_server) - 1);
 
-            // TODO - force reconnect
+            // Force a reconnection
+            connection.reconnect();
         }
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
 
     // Return a simple response
-    serveHTML(client);
+    request.send(200, "text/html", serveHTML);
 
 }
 
@@ -489,12 +688,41 @@ void processHTTPRequest(WiFiClient client)
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
+}
+
+
+//
+// Serve our most recent readings, as JSON.
+//
+void serveState(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("temperature", last_temperature);
+    json.add("humidity", last_humidity);
+    json.add("mac", board_info.mac().c_str());
+    json.end_object();
+}
+
+
+//
+// Serve our configuration, as JSON.
+//
+void serveConfig(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("mq", mqtt_server);
+    json.end_object();
 }
 
 
@@ -503,12 +731,8 @@ void redirectIndex(WiFiClient client)
 //
 // Serve a HTML-page to any clients who connect, via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
     client.println("<head>");
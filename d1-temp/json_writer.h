@@ -0,0 +1 @@
+../common/json_writer.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/mqtt_outbox.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../common/mqtt_sn_client.cpp
\ No newline at end of file
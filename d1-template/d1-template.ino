@@ -41,6 +41,18 @@
 #include "debug.h"
 
 
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
 //
 // The name of this project.
 //
@@ -64,7 +76,13 @@ int time_zone_offset = 0;
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 
@@ -114,6 +132,7 @@ void setup()
     //
     // Now we can start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s\n",
               WiFi.localIP().toString().c_str());
@@ -199,6 +218,11 @@ void access_point_callback(WiFiManager* myWiFiManager)
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
+
     //
     // Keep the previous time, to avoid needless re-draws
     //
@@ -264,10 +288,7 @@ void loop()
     //
     // If so handle it.
     //
-    WiFiClient client = server.available();
-
-    if (client)
-        processHTTPRequest(client);
+    server.handle();
 
     //
     // Now sleep a little.
@@ -279,12 +300,13 @@ void loop()
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
 }
 
 
@@ -293,12 +315,8 @@ void redirectIndex(WiFiClient client)
 //
 // Serve a HTML-page to any clients who connect, via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
     client.println("<head>");
@@ -344,25 +362,48 @@ void serveHTML(WiFiClient client)
 }
 
 
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+
+    Metrics::counter(out, "ntp_syncs_total", timeClient.getSyncCount());
+    Metrics::counter(out, "ntp_sync_failures_total", timeClient.getSyncFailures());
+    Metrics::gauge(out, "ntp_offset_seconds", timeClient.getLastOffset());
+    Metrics::gauge(out, "ntp_offset_milliseconds", timeClient.getLastOffsetMillis());
+    Metrics::gauge(out, "ntp_delay_milliseconds", timeClient.getLastDelay());
+    Metrics::gauge(out, "ntp_drift_ppb", timeClient.getDrift());
+}
+
+
 //
 // Process an incoming HTTP-request.
 //
-void processHTTPRequest(WiFiClient client)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (client.connected() && !client.available())
-        delay(1);
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
 
-    // Read the first line of the request
-    String request = client.readStringUntil('\r');
-    client.flush();
+    // The path, and any parameters, of the request
+    const char *path = request.path();
 
 #if 0
 
     //
     // Sample of how to handle a particular request
     //
-    if (request.indexOf("/ON") != -1)
+    if (strstr(path, "/ON") != NULL)
     {
         //
         // Do stuff here.
@@ -371,13 +412,13 @@ void processHTTPRequest(WiFiClient client)
         //
         // Redirect to the server-root
         //
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
 #endif
 
     // Return a simple response
-    serveHTML(client);
+    request.send(200, "text/html", serveHTML);
 
 }
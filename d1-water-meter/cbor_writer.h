@@ -0,0 +1 @@
+../common/cbor_writer.h
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <ESP8266WiFi.h>
 #include <ArduinoOTA.h>
 #include <ESP8266HTTPClient.h>
+#include <FS.h>
 
 //
 // The access-point functionality
@@ -18,12 +19,31 @@
 //
 #include "PubSubClient.h"
 #include "info.h"
+#include "mqtt_outbox.h"
+#include "mqtt_connection.h"
+#include "cbor_writer.h"
 const char* mqtt_server = "192.168.10.64";
 WiFiClient espClient;
 PubSubClient client(espClient);
+MQTTOutbox outbox(client);
+MQTTConnection connection(client);
 info board_info;
 
 
+//
+// Readings may instead be sent over MQTT-SN, via a gateway at the
+// address of our MQ server, if this is defined.  That needs neither a
+// TCP connection nor its keepalives, but the `meta`-topic isn't used.
+//
+#include "mqtt_sn_client.h"
+// #define MQTT_SN
+
+#ifdef MQTT_SN
+WiFiUDP snUDP;
+MQTTSNClient sn(snUDP);
+#endif
+
+
 
 //
 // The name of this project.
@@ -35,6 +55,14 @@ info board_info;
 #define PROJECT_NAME "D1-WATER-METER"
 
 
+//
+// Readings are published to the `water`-topic as JSON, unless this is
+// defined.  Then they're encoded as CBOR, and we're identified by our
+// chip-ID rather than our MAC address.
+//
+// #define WATER_CBOR
+
+
 
 
 
@@ -61,6 +89,11 @@ void setup() //
 {
     Serial.begin(115200);
 
+    //
+    // Enable access to the filesystem, where readings are queued
+    // if we can't send them.
+    //
+    SPIFFS.begin();
 
     //
     // Handle WiFi setup
@@ -107,6 +140,13 @@ void setup() //
     ArduinoOTA.onStart([]()
     {
         DEBUG_LOG("OTA Start\n");
+
+        //
+        // We'll restart once the update is complete, so keep any queued
+        // messages in flash - unless it is the flash being replaced.
+        //
+        if (ArduinoOTA.getCommand() == U_FLASH)
+            outbox.flush();
     });
     ArduinoOTA.onEnd([]()
     {
@@ -139,11 +179,39 @@ void setup() //
     //
     ArduinoOTA.begin();
 
+#ifdef MQTT_SN
+    //
+    // MQTT-SN client-IDs are limited to 23 characters, so we're
+    // identified by our chip-ID.
+    //
+    sn.begin(mqtt_server, MQTT_SN_DEFAULT_PORT, String(PROJECT_NAME) + "-" + String(ESP.getChipId(), HEX));
+    sn.add_topic("water");
+#else
     //
     // Setup our pub-sub connection.
     //
     client.setServer(mqtt_server, 1883);
-    client.setCallback(callback);
+    client.addHandler("meta", callback);
+
+    //
+    // Keep connected in the background, subscribing and announcing
+    // ourselves each time we connect.
+    //
+    connection.begin(String(PROJECT_NAME) + board_info.mac());
+    connection.announce("meta", meta);
+    client.subscribe("meta");
+
+    //
+    // Readings are published with QoS 1, so they survive a dropped
+    // connection; allow a few to await acknowledgement at once.
+    //
+    client.setInflightWindow(4);
+
+    //
+    // Restore any readings queued before we last restarted.
+    //
+    outbox.begin();
+#endif
 
 }
 
@@ -160,17 +228,28 @@ void loop()
     //
     ArduinoOTA.handle();
 
+#ifdef MQTT_SN
+    //
+    // Keep registered with our gateway.
+    //
+    sn.loop();
+#else
     //
     // Ensure we're connected to our queue.
     //
-    if (!client.connected())
-        reconnect();
+    connection.loop();
 
     //
     // Handle queue messages.
     //
     client.loop();
 
+    //
+    // Send any readings we queued while disconnected.
+    //
+    outbox.loop();
+#endif
+
     //
     // Get the current time.
     //
@@ -210,6 +289,31 @@ void measure_water()
     //
     int Calc = (NbTopsFan * 60 / 7.5);
 
+#ifdef WATER_CBOR
+    //
+    // The CBOR we publish.
+    //
+    uint8_t payload[32];
+    CBORWriter cbor(payload, sizeof(payload));
+    cbor.begin_object();
+    cbor.add("flow", Calc);
+    cbor.add("id", ESP.getChipId());
+    cbor.end_object();
+
+    //
+    // Log it
+    //
+    DEBUG_LOG("Sending data to MQ: flow %d\n", Calc);
+
+    //
+    // Publish it to the bus
+    //
+#ifdef MQTT_SN
+    sn.publish("water", payload, cbor.length(), MQTT_SN_QOS_1);
+#else
+    outbox.publish("water", payload, cbor.length(), false, 1);
+#endif
+#else
     //
     // The JSON we publish.
     //
@@ -223,20 +327,25 @@ void measure_water()
     //
     // Publish it to the bus
     //
-    client.publish("water", payload.c_str());
+#ifdef MQTT_SN
+    sn.publish("water", payload.c_str(), MQTT_SN_QOS_1);
+#else
+    outbox.publish("water", payload.c_str(), false, 1);
+#endif
+#endif
 }
 
 
 
 //
-// This is called when messages are received.
+// This is called when messages are received on the `meta`-topic.
 //
 // We only subscribe to the `meta`-topic, and we don't do
 // anything with the messages.  It's just a nice example
 // showing how we could if we wanted to.
 //
 //
-void callback(char* topic, byte* payload, unsigned int length)
+void callback(const char* topic, const uint8_t* payload, unsigned int length, void* context)
 {
     Serial.print("Message arrived [Topic:");
     Serial.print(topic);
@@ -252,41 +361,10 @@ void callback(char* topic, byte* payload, unsigned int length)
 
 
 //
-// Reconnect to the pub-sub-server, if we're dropped.
+// Our meta-details, published to the `meta`-topic each time we
+// connect.
 //
-void reconnect()
+String meta()
 {
-    // Loop until we're reconnected
-    while (!client.connected())
-    {
-        DEBUG_LOG("Attempting MQTT connection...");
-
-        String id = PROJECT_NAME;
-        id += board_info.mac();
-
-        // Attempt to connect
-        if (client.connect(id.c_str()))
-        {
-            // We've connected
-            DEBUG_LOG(" connected\n");
-
-            //
-            // Dump all our local details to the meta-topic
-            //
-            client.publish("meta", board_info.to_JSON().c_str());
-
-            //
-            // Subscribe to the `meta`-topic.
-            //
-            client.subscribe("meta");
-        }
-        else
-        {
-            DEBUG_LOG(" failed, rc=%d - will retry in five seconds\n", (client.state()));
-
-            // Wait 5 seconds before retrying
-            delay(5000);
-        }
-    }
-
+    return board_info.to_JSON();
 }
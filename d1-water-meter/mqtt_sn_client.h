@@ -0,0 +1 @@
+../common/mqtt_sn_client.h
\ No newline at end of file
@@ -35,6 +35,24 @@
 //
 #include "debug.h"
 
+
+//
+// Our HTTP-server.
+//
+#include "http_server.h"
+
+
+//
+// Runtime counters, served via "/metrics".
+//
+#include "metrics.h"
+
+
+//
+// For serving our API.
+//
+#include "json_writer.h"
+
 //
 // Decode URL parameters.
 //
@@ -57,7 +75,13 @@
 //
 // The HTTP-server we present runs on port 80.
 //
-WiFiServer server(80);
+HTTPServer server(80);
+
+
+//
+// Our runtime counters.
+//
+Metrics metrics;
 
 
 //
@@ -85,6 +109,15 @@ int search_direction;
 //
 unsigned char buf[5];
 
+//
+// Whether the status shown on our HTML-page, or served via our API,
+// was read successfully.
+//
+// Pages are rendered twice, once to find their length, so the status
+// is read once before rendering.
+//
+int html_status = 0;
+
 
 
 //
@@ -121,6 +154,7 @@ void setup()
     //
     // Now we can start our HTTP server
     //
+    server.on_request(processHTTPRequest);
     server.begin();
     DEBUG_LOG("HTTP-Server started on http://%s\n",
               WiFi.localIP().toString().c_str());
@@ -200,6 +234,11 @@ void access_point_callback(WiFiManager* myWiFiManager)
 //
 void loop()
 {
+    //
+    // Record this iteration, for our metrics.
+    //
+    metrics.loop();
+
     //
     // Handle any pending over the air updates.
     //
@@ -229,10 +268,7 @@ void loop()
     //
     // If so handle it.
     //
-    WiFiClient client = server.available();
-
-    if (client)
-        processHTTPRequest(client);
+    server.handle();
 
     //
     // Is there serial-input available?
@@ -302,12 +338,13 @@ void loop()
 //
 // Serve a redirect to the server-root
 //
-void redirectIndex(WiFiClient client)
+void redirectIndex(HTTPRequest &request)
 {
-    client.println("HTTP/1.1 302 Found");
-    client.print("Location: http://");
-    client.print(WiFi.localIP().toString().c_str());
-    client.println("/");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s/",
+             WiFi.localIP().toString().c_str());
+
+    request.redirect(location);
 }
 
 
@@ -316,12 +353,8 @@ void redirectIndex(WiFiClient client)
 //
 // Serve a HTML-page to any clients who connect, via a browser.
 //
-void serveHTML(WiFiClient client)
+void serveHTML(Print &client)
 {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("");
-
     client.println("<!DOCTYPE html>");
     client.println("<html lang=\"en\">");
     client.println("<head>");
@@ -354,7 +387,7 @@ void serveHTML(WiFiClient client)
     client.println("<div class=\"col-md-4\"></div>");
     client.println("<div class=\"col-md-4\">");
 
-    if (Radio.read_status(buf) == 1)
+    if (html_status == 1)
     {
         double current_freq = floor(Radio.frequency_available(buf) / 100000 + .5) / 10;
         int  stereo = Radio.stereo(buf);
@@ -437,32 +470,92 @@ void serveHTML(WiFiClient client)
 }
 
 
+//
+// Serve the state of the radio, as JSON.
+//
+void serveState(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+    json.add("searching", search_mode != 0);
+
+    if (html_status == 1)
+    {
+        json.add("stereo", Radio.stereo(buf) != 0);
+        json.add("signal", Radio.signal_level(buf));
+    }
+
+    json.end_object();
+}
+
+
+//
+// Serve the settings of the radio, as JSON.
+//
+void serveConfig(Print &out)
+{
+    JSONWriter json(out);
+
+    json.begin_object();
+
+    if (html_status == 1)
+    {
+        double current_freq = floor(Radio.frequency_available(buf) / 100000 + .5) / 10;
+        json.add("frequency", current_freq);
+    }
+
+    json.add("muted", g_muted != 0);
+    json.end_object();
+}
+
+
+//
+// Serve our runtime counters, in the Prometheus text-format.
+//
+void serveMetrics(Print &out)
+{
+    metrics.render(out);
+
+    Metrics::counter(out, "http_requests_total", server.served());
+    Metrics::counter(out, "http_rejected_total", server.rejected());
+    Metrics::counter(out, "http_timeouts_total", server.timed_out());
+}
+
+
 //
 // Process an incoming HTTP-request.
 //
-void processHTTPRequest(WiFiClient client)
+void processHTTPRequest(HTTPRequest &request)
 {
-    // Wait until the client sends some data
-    while (client.connected() && !client.available())
-        delay(1);
+    // Our metrics.
+    if (strcmp(request.path(), "/metrics") == 0)
+    {
+        metrics.snapshot();
+        request.send(200, METRICS_CONTENT_TYPE, serveMetrics);
+        return;
+    }
 
-    // Read the first line of the request
-    String request = client.readStringUntil('\r');
-    client.flush();
+    // Our API.
+    if (strcmp(request.path(), "/api/state") == 0)
+    {
+        html_status = Radio.read_status(buf);
+        request.send(200, "application/json", serveState);
+        return;
+    }
 
-    //
-    // Find the URL we were requested
-    //
-    // We'll have something like "GET XXXXX HTTP/XX"
-    // so we split at the space and send the "XXX HTTP/XX" value
-    //
-    request = request.substring(request.indexOf(" ")  + 1);
+    if (strcmp(request.path(), "/api/config") == 0)
+    {
+        html_status = Radio.read_status(buf);
+        request.send(200, "application/json", serveConfig);
+        return;
+    }
 
     //
     // Now we'll want to peel off any HTTP-parameters that might
     // be present, via our utility-helper.
     //
-    URL url(request.c_str());
+    URL url(request.path());
 
     //
     // Does the user want to tune directly?
@@ -475,7 +568,7 @@ void processHTTPRequest(WiFiClient client)
         tuneTo(var);
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -493,7 +586,7 @@ void processHTTPRequest(WiFiClient client)
             searchDown();
 
         // Redirect to the server-root
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -502,7 +595,7 @@ void processHTTPRequest(WiFiClient client)
     if (mute != NULL)
     {
         setMute(true);
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
@@ -511,13 +604,14 @@ void processHTTPRequest(WiFiClient client)
     if (unmute != NULL)
     {
         setMute(false);
-        redirectIndex(client);
+        redirectIndex(request);
         return;
     }
 
 
     // Return a simple response
-    serveHTML(client);
+    html_status = Radio.read_status(buf);
+    request.send(200, "text/html", serveHTML);
 
 }
 
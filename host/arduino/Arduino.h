@@ -0,0 +1,59 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+/*
+ * Just enough of the Arduino core to build the code in `common/` on a
+ * Linux host, for the tests and benchmarks in this directory.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define F(s) (s)
+#define pgm_read_byte(p)      (*(const uint8_t *)(p))
+#define pgm_read_byte_near(p) (*(const uint8_t *)(p))
+
+inline uint16_t word(uint8_t high, uint8_t low)
+{
+    return (high << 8) | low;
+}
+
+/*
+ * Time.  The clock starts at zero, and `delay()` moves it on at once
+ * rather than sleeping, so that timeouts may be tested quickly.
+ */
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+char *dtostrf(double val, signed char width, unsigned char prec, char *out);
+
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+
+#endif /* ARDUINO_H */
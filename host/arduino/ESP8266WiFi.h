@@ -0,0 +1,95 @@
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include <memory>
+
+#include "Arduino.h"
+#include "Client.h"
+
+#define WL_CONNECTED 3
+
+/*
+ * The station interface, which is always connected.
+ */
+class WiFiClass
+{
+public:
+    int status();
+    IPAddress localIP();
+};
+
+extern WiFiClass WiFi;
+
+
+/*
+ * A TCP connection, over a POSIX socket.
+ *
+ * As on the device copies share the same connection, and reads never
+ * block.  Writes do, until the kernel has taken everything.
+ */
+class WiFiClient : public Client
+{
+public:
+    WiFiClient();
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+
+    /*
+     * Nagle's algorithm is disabled by default, as it would hold back
+     * the small request/response exchanges our benchmarks time.
+     */
+    void setNoDelay(bool nodelay);
+
+    using Print::write;
+
+    /*
+     * Wrap an accepted socket.
+     */
+    explicit WiFiClient(int fd);
+
+private:
+    struct Socket;
+
+    std::shared_ptr<Socket> m_socket;
+};
+
+
+/*
+ * A listening TCP socket, on the loopback interface.
+ */
+class WiFiServer
+{
+public:
+    WiFiServer(uint16_t port);
+    ~WiFiServer();
+
+    void begin();
+    void stop();
+
+    /*
+     * Did `begin()` succeed?  Not found on the device.
+     */
+    bool listening();
+
+    bool hasClient();
+    WiFiClient available();
+    void setNoDelay(bool nodelay);
+
+private:
+    uint16_t m_port;
+    int m_fd = -1;
+    bool m_nodelay = true;
+};
+
+#endif /* ESP8266WIFI_H */
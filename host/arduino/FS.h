@@ -0,0 +1,71 @@
+#ifndef FS_H
+#define FS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+enum SeekMode
+{
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+
+/*
+ * An open file, held in memory; copies share the same position.
+ */
+class File
+{
+public:
+    File();
+    File(std::shared_ptr<std::string> data, bool append);
+
+    size_t read(uint8_t *buf, size_t size);
+    size_t write(const uint8_t *buf, size_t size);
+    bool seek(uint32_t pos, SeekMode mode);
+    size_t position();
+    size_t size();
+    void close();
+    operator bool();
+
+private:
+    struct State
+    {
+        std::shared_ptr<std::string> data;
+        size_t position;
+        bool append;
+    };
+
+    std::shared_ptr<State> m_state;
+};
+
+
+/*
+ * A filesystem held in memory, which lasts as long as the process, so
+ * a test may "reboot" by starting afresh with the same files.
+ */
+class FS
+{
+public:
+    bool begin();
+    File open(const char *path, const char *mode);
+    bool exists(const char *path);
+    bool remove(const char *path);
+    bool rename(const char *from, const char *to);
+
+    /*
+     * Refuse to open files, as if the filesystem were missing or full.
+     */
+    void set_failing(bool failing);
+
+private:
+    bool m_failing = false;
+};
+
+extern FS SPIFFS;
+
+#endif /* FS_H */
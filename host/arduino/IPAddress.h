@@ -0,0 +1,34 @@
+#ifndef IPADDRESS_H
+#define IPADDRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "WString.h"
+
+/*
+ * An IPv4 address.
+ */
+class IPAddress
+{
+public:
+    IPAddress() : m_bytes{0, 0, 0, 0} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : m_bytes{a, b, c, d} {}
+
+    uint8_t operator[](int i) const
+    {
+        return m_bytes[i];
+    }
+
+    String toString() const
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%u.%u.%u.%u", m_bytes[0], m_bytes[1], m_bytes[2], m_bytes[3]);
+        return String(buf);
+    }
+
+private:
+    uint8_t m_bytes[4];
+};
+
+#endif /* IPADDRESS_H */
@@ -0,0 +1,77 @@
+#ifndef PRINT_H
+#define PRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "WString.h"
+
+/*
+ * Something we may write bytes, and text, to.
+ */
+class Print
+{
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+        size_t n = 0;
+
+        while (size--)
+            n += write(*buf++);
+
+        return n;
+    }
+
+    size_t write(const char *str)
+    {
+        return (str == NULL) ? 0 : write((const uint8_t *)str, strlen(str));
+    }
+
+    size_t write(const char *buf, size_t size)
+    {
+        return write((const uint8_t *)buf, size);
+    }
+
+    size_t print(const char *str)
+    {
+        return write(str);
+    }
+
+    size_t print(const String &str)
+    {
+        return write(str.c_str());
+    }
+
+    size_t print(char c)
+    {
+        return write((uint8_t)c);
+    }
+
+    size_t print(int num, int base = 10);
+    size_t print(unsigned int num, int base = 10);
+    size_t print(long num, int base = 10);
+    size_t print(unsigned long num, int base = 10);
+    size_t print(double num, int digits = 2);
+
+    template <typename T> size_t println(T value)
+    {
+        size_t n = print(value);
+        return n + println();
+    }
+
+    size_t println()
+    {
+        return write("\r\n");
+    }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    virtual void flush() {}
+};
+
+#endif /* PRINT_H */
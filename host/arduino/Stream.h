@@ -0,0 +1,17 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "Print.h"
+
+/*
+ * Something we may also read from.
+ */
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif /* STREAM_H */
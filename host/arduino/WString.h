@@ -0,0 +1,55 @@
+#ifndef WSTRING_H
+#define WSTRING_H
+
+#include <string>
+
+/*
+ * The parts of Arduino's String which our code uses.
+ */
+class String
+{
+public:
+    String(const char *str = "") : m_str(str ? str : "") {}
+    String(const std::string &str) : m_str(str) {}
+    String(char c) : m_str(1, c) {}
+    String(int num) : m_str(std::to_string(num)) {}
+    String(long num) : m_str(std::to_string(num)) {}
+    String(unsigned int num) : m_str(std::to_string(num)) {}
+    String(unsigned long num) : m_str(std::to_string(num)) {}
+
+    const char *c_str() const
+    {
+        return m_str.c_str();
+    }
+
+    unsigned int length() const
+    {
+        return m_str.length();
+    }
+
+    String &operator+=(const String &other)
+    {
+        m_str += other.m_str;
+        return *this;
+    }
+
+    friend String operator+(const String &a, const String &b)
+    {
+        return String(a.m_str + b.m_str);
+    }
+
+    bool operator==(const String &other) const
+    {
+        return m_str == other.m_str;
+    }
+
+    bool operator==(const char *other) const
+    {
+        return m_str == other;
+    }
+
+private:
+    std::string m_str;
+};
+
+#endif /* WSTRING_H */
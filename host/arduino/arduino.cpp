@@ -0,0 +1,144 @@
+//
+// The Arduino core functions, for host builds.
+//
+#include <sched.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "Arduino.h"
+#include "host.h"
+
+
+/*
+ * The time at which we started, and how far `delay()` has moved the
+ * clock on since, in microseconds.
+ */
+static const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+static std::atomic<unsigned long> skipped(0);
+
+
+unsigned long micros()
+{
+    auto elapsed = std::chrono::steady_clock::now() - started;
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + skipped;
+}
+
+
+unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+
+void delay(unsigned long ms)
+{
+    host_advance(ms);
+}
+
+
+void yield()
+{
+    sched_yield();
+}
+
+
+void host_advance(unsigned long ms)
+{
+    skipped += ms * 1000;
+}
+
+
+uint64_t host_nanos()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+
+long random(long max)
+{
+    return (max <= 0) ? 0 : rand() % max;
+}
+
+
+long random(long min, long max)
+{
+    return (max <= min) ? min : min + random(max - min);
+}
+
+
+void randomSeed(unsigned long seed)
+{
+    srand(seed);
+}
+
+
+char *dtostrf(double val, signed char width, unsigned char prec, char *out)
+{
+    sprintf(out, "%*.*f", width, prec, val);
+    return out;
+}
+
+
+/*
+ * Numbers are printed via printf.
+ */
+size_t Print::print(int num, int base)
+{
+    return print((long)num, base);
+}
+
+size_t Print::print(unsigned int num, int base)
+{
+    return print((unsigned long)num, base);
+}
+
+size_t Print::print(long num, int base)
+{
+    if ((base == 10) || (num >= 0))
+        return (base == 16) ? printf("%lx", num) : printf("%ld", num);
+
+    return print((unsigned long)num, base);
+}
+
+size_t Print::print(unsigned long num, int base)
+{
+    return (base == 16) ? printf("%lx", num) : printf("%lu", num);
+}
+
+size_t Print::print(double num, int digits)
+{
+    return printf("%.*f", digits, num);
+}
+
+
+size_t Print::printf(const char *format, ...)
+{
+    char buf[256];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (len < 0)
+        return 0;
+
+    if ((size_t)len < sizeof(buf))
+        return write((const uint8_t *)buf, len);
+
+    //
+    // Too long for our buffer; format it again, into one which fits.
+    //
+    std::string big(len + 1, '\0');
+
+    va_start(args, format);
+    vsnprintf(&big[0], big.size(), format, args);
+    va_end(args);
+
+    return write((const uint8_t *)big.data(), len);
+}
@@ -0,0 +1,170 @@
+//
+// An in-memory SPIFFS, for host builds.
+//
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#include "FS.h"
+
+
+FS SPIFFS;
+
+
+/*
+ * The contents of each file, by path.
+ */
+static std::map<std::string, std::shared_ptr<std::string>> files;
+
+
+File::File()
+{
+}
+
+
+File::File(std::shared_ptr<std::string> data, bool append)
+    : m_state(new State { data, append ? data->size() : 0, append })
+{
+}
+
+
+size_t File::read(uint8_t *buf, size_t size)
+{
+    if (!m_state)
+        return 0;
+
+    std::string &data = *m_state->data;
+    size_t n = 0;
+
+    if (m_state->position < data.size())
+        n = std::min(size, data.size() - m_state->position);
+
+    memcpy(buf, data.data() + m_state->position, n);
+    m_state->position += n;
+    return n;
+}
+
+
+/*
+ * Write at our position, or always at the end when appending.
+ */
+size_t File::write(const uint8_t *buf, size_t size)
+{
+    if (!m_state)
+        return 0;
+
+    std::string &data = *m_state->data;
+
+    if (m_state->append)
+        m_state->position = data.size();
+
+    if (m_state->position > data.size())
+        data.resize(m_state->position);
+
+    data.replace(m_state->position, std::min(size, data.size() - m_state->position), (const char *)buf, size);
+    m_state->position += size;
+    return size;
+}
+
+
+bool File::seek(uint32_t pos, SeekMode mode)
+{
+    if (!m_state)
+        return false;
+
+    size_t base = 0;
+
+    if (mode == SeekCur)
+        base = m_state->position;
+    else if (mode == SeekEnd)
+        base = m_state->data->size();
+
+    m_state->position = base + pos;
+    return true;
+}
+
+
+size_t File::position()
+{
+    return m_state ? m_state->position : 0;
+}
+
+
+size_t File::size()
+{
+    return m_state ? m_state->data->size() : 0;
+}
+
+
+void File::close()
+{
+    m_state.reset();
+}
+
+
+File::operator bool()
+{
+    return (bool)m_state;
+}
+
+
+bool FS::begin()
+{
+    return true;
+}
+
+
+/*
+ * Open a file to read ("r"), to write afresh ("w"), or to append
+ * ("a"), creating it if need be.
+ */
+File FS::open(const char *path, const char *mode)
+{
+    if (m_failing)
+        return File();
+
+    auto it = files.find(path);
+
+    if (mode[0] == 'r')
+        return (it == files.end()) ? File() : File(it->second, false);
+
+    if ((it == files.end()) || (mode[0] == 'w'))
+    {
+        files[path] = std::make_shared<std::string>();
+        it = files.find(path);
+    }
+
+    return File(it->second, mode[0] == 'a');
+}
+
+
+bool FS::exists(const char *path)
+{
+    return files.count(path) > 0;
+}
+
+
+bool FS::remove(const char *path)
+{
+    return files.erase(path) > 0;
+}
+
+
+bool FS::rename(const char *from, const char *to)
+{
+    auto it = files.find(from);
+
+    if (m_failing || (it == files.end()))
+        return false;
+
+    files[to] = it->second;
+    files.erase(it);
+    return true;
+}
+
+
+void FS::set_failing(bool failing)
+{
+    m_failing = failing;
+}
@@ -0,0 +1,21 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+
+/*
+ * Functions only found in host builds.
+ */
+
+/*
+ * Move the clock seen by `millis()` and `micros()` on, at once.
+ */
+void host_advance(unsigned long ms);
+
+/*
+ * A monotonic clock in nanoseconds, which `host_advance()` doesn't
+ * affect, for timing.
+ */
+uint64_t host_nanos();
+
+#endif /* HOST_H */
@@ -0,0 +1,309 @@
+//
+// WiFiClient & WiFiServer over POSIX sockets, for host builds.
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "ESP8266WiFi.h"
+
+
+WiFiClass WiFi;
+
+int WiFiClass::status()
+{
+    return WL_CONNECTED;
+}
+
+IPAddress WiFiClass::localIP()
+{
+    return IPAddress(127, 0, 0, 1);
+}
+
+
+/*
+ * A socket, closed when the last client sharing it goes away.
+ */
+struct WiFiClient::Socket
+{
+    int fd;
+
+    Socket(int fd) : fd(fd)
+    {
+    }
+
+    ~Socket()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if (fd >= 0)
+            ::close(fd);
+
+        fd = -1;
+    }
+};
+
+
+static void set_nodelay(int fd, bool nodelay)
+{
+    int flag = nodelay ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+
+WiFiClient::WiFiClient()
+{
+}
+
+
+WiFiClient::WiFiClient(int fd) : m_socket(std::make_shared<Socket>(fd))
+{
+    set_nodelay(fd, true);
+}
+
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+    stop();
+
+    struct addrinfo hints = {};
+    struct addrinfo *found = NULL;
+    char service[8];
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+
+    if (getaddrinfo(host, service, &hints, &found) != 0)
+        return 0;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if ((fd >= 0) && (::connect(fd, found->ai_addr, found->ai_addrlen) != 0))
+    {
+        ::close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(found);
+
+    if (fd < 0)
+        return 0;
+
+    *this = WiFiClient(fd);
+    return 1;
+}
+
+
+size_t WiFiClient::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+
+size_t WiFiClient::write(const uint8_t *buf, size_t size)
+{
+    size_t written = 0;
+
+    while (m_socket && (m_socket->fd >= 0) && (written < size))
+    {
+        ssize_t n = send(m_socket->fd, buf + written, size - written, MSG_NOSIGNAL);
+
+        if (n <= 0)
+        {
+            if ((n < 0) && (errno == EINTR))
+                continue;
+
+            break;
+        }
+
+        written += n;
+    }
+
+    return written;
+}
+
+
+int WiFiClient::available()
+{
+    int pending = 0;
+
+    if (!m_socket || (m_socket->fd < 0) || (ioctl(m_socket->fd, FIONREAD, &pending) != 0))
+        return 0;
+
+    return pending;
+}
+
+
+int WiFiClient::read()
+{
+    uint8_t c;
+
+    return (read(&c, 1) == 1) ? c : -1;
+}
+
+
+int WiFiClient::read(uint8_t *buf, size_t size)
+{
+    if (!m_socket || (m_socket->fd < 0))
+        return -1;
+
+    ssize_t n = recv(m_socket->fd, buf, size, MSG_DONTWAIT);
+
+    return (n > 0) ? n : -1;
+}
+
+
+int WiFiClient::peek()
+{
+    uint8_t c;
+
+    if (!m_socket || (m_socket->fd < 0) ||
+            (recv(m_socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) != 1))
+        return -1;
+
+    return c;
+}
+
+
+void WiFiClient::flush()
+{
+}
+
+
+void WiFiClient::stop()
+{
+    if (m_socket)
+        m_socket->close();
+
+    m_socket.reset();
+}
+
+
+/*
+ * We remain connected while there is data to read, even once the
+ * peer has closed its end.
+ */
+uint8_t WiFiClient::connected()
+{
+    if (!m_socket || (m_socket->fd < 0))
+        return 0;
+
+    uint8_t c;
+    ssize_t n = recv(m_socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+
+    if (n > 0)
+        return 1;
+
+    return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+
+WiFiClient::operator bool()
+{
+    return m_socket && (m_socket->fd >= 0);
+}
+
+
+void WiFiClient::setNoDelay(bool nodelay)
+{
+    if (m_socket && (m_socket->fd >= 0))
+        set_nodelay(m_socket->fd, nodelay);
+}
+
+
+WiFiServer::WiFiServer(uint16_t port) : m_port(port)
+{
+}
+
+
+WiFiServer::~WiFiServer()
+{
+    stop();
+}
+
+
+void WiFiServer::begin()
+{
+    struct sockaddr_in addr = {};
+    int reuse = 1;
+
+    m_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (m_fd < 0)
+        return;
+
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(m_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+            (listen(m_fd, 64) != 0))
+    {
+        perror("WiFiServer");
+        stop();
+        return;
+    }
+
+    fcntl(m_fd, F_SETFL, O_NONBLOCK);
+}
+
+
+void WiFiServer::stop()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+
+    m_fd = -1;
+}
+
+
+bool WiFiServer::listening()
+{
+    return m_fd >= 0;
+}
+
+
+bool WiFiServer::hasClient()
+{
+    struct pollfd pending = { m_fd, POLLIN, 0 };
+
+    return (m_fd >= 0) && (poll(&pending, 1, 0) > 0);
+}
+
+
+WiFiClient WiFiServer::available()
+{
+    int fd = (m_fd < 0) ? -1 : accept(m_fd, NULL, NULL);
+
+    if (fd < 0)
+        return WiFiClient();
+
+    WiFiClient client(fd);
+    client.setNoDelay(m_nodelay);
+    return client;
+}
+
+
+void WiFiServer::setNoDelay(bool nodelay)
+{
+    m_nodelay = nodelay;
+}
@@ -0,0 +1,42 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+#include <host.h>
+
+
+/*
+ * Helpers shared by the benchmarks.
+ */
+
+
+/*
+ * Time a stretch of code, in seconds.
+ */
+class Stopwatch
+{
+public:
+    Stopwatch() : m_started(host_nanos())
+    {
+    }
+
+    double seconds()
+    {
+        return (host_nanos() - m_started) / 1e9;
+    }
+
+private:
+    uint64_t m_started;
+};
+
+
+/*
+ * Print a single measurement, lined up with the others.
+ */
+inline void report(const char *name, double value, const char *unit)
+{
+    printf("  %-36s %14.2f %s\n", name, value, unit);
+}
+
+#endif /* BENCH_H */
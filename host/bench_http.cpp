@@ -0,0 +1,239 @@
+//
+// Benchmark HTTPServer over loopback, opening a connection for each
+// request, keeping one alive, and pipelining requests upon it.
+//
+//   ./bench_http [--quick]
+//
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include <http_server.h>
+
+#include "bench.h"
+
+
+//
+// The port the server listens upon.
+//
+#define HTTP_PORT 18080
+
+//
+// The requests we make, asking for the connection to be closed or kept.
+//
+#define REQUEST_CLOSE "GET / HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n"
+#define REQUEST_KEEP  "GET / HTTP/1.1\r\nHost: bench\r\n\r\n"
+
+
+static void handler(HTTPRequest &request)
+{
+    request.send(200, "text/plain", "Hello from the host build of HTTPServer.\n");
+}
+
+
+/*
+ * Open a blocking connection to the server.
+ */
+static int open_connection()
+{
+    struct sockaddr_in addr = {};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(HTTP_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static bool send_all(int fd, const std::string &data)
+{
+    return send(fd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size();
+}
+
+
+/*
+ * Read a single response, framed by its Content-Length.  Anything
+ * read beyond it is left in `pending`, for the next.
+ */
+static bool read_response(int fd, std::string &pending)
+{
+    size_t end;
+    char buf[4096];
+
+    while ((end = pending.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+        if (n <= 0)
+            return false;
+
+        pending.append(buf, n);
+    }
+
+    size_t length_at = pending.find("Content-Length: ");
+
+    if ((pending.compare(0, 12, "HTTP/1.1 200") != 0) || (length_at == std::string::npos) || (length_at > end))
+        return false;
+
+    size_t total = end + 4 + atol(pending.c_str() + length_at + 16);
+
+    while (pending.size() < total)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+        if (n <= 0)
+            return false;
+
+        pending.append(buf, n);
+    }
+
+    pending.erase(0, total);
+    return true;
+}
+
+
+/*
+ * A fresh connection for each request, closed by the server.
+ */
+static bool per_request(unsigned long count)
+{
+    Stopwatch timer;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        std::string pending;
+        char c;
+        int fd = open_connection();
+
+        bool ok = (fd >= 0) && send_all(fd, REQUEST_CLOSE) &&
+                  read_response(fd, pending) && (recv(fd, &c, 1, 0) == 0);
+
+        if (fd >= 0)
+            close(fd);
+
+        if (!ok)
+        {
+            fprintf(stderr, "Request %lu failed, closing each connection\n", i);
+            return false;
+        }
+    }
+
+    report("connection per request", count / timer.seconds(), "req/s");
+    return true;
+}
+
+
+/*
+ * One connection, kept alive, with `depth` requests sent at a time.
+ */
+static bool kept_alive(unsigned long count, unsigned long depth)
+{
+    std::string pending;
+    std::string batch;
+    char name[64];
+    int fd = open_connection();
+
+    if (fd < 0)
+        return false;
+
+    for (unsigned long i = 0; i < depth; i++)
+        batch += REQUEST_KEEP;
+
+    Stopwatch timer;
+
+    for (unsigned long i = 0; i < count; i += depth)
+    {
+        if (!send_all(fd, batch))
+            break;
+
+        for (unsigned long j = 0; j < depth; j++)
+        {
+            if (!read_response(fd, pending))
+            {
+                fprintf(stderr, "Request %lu failed, %lu at a time\n", i + j, depth);
+                close(fd);
+                return false;
+            }
+        }
+    }
+
+    double seconds = timer.seconds();
+    close(fd);
+
+    if (depth == 1)
+        snprintf(name, sizeof(name), "kept alive");
+    else
+        snprintf(name, sizeof(name), "kept alive, %lu pipelined", depth);
+
+    report(name, count / seconds, "req/s");
+    return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long scale = 10;
+
+    if ((argc > 1) && (strcmp(argv[1], "--quick") == 0))
+        scale = 1;
+
+    HTTPServer server(HTTP_PORT);
+    std::atomic<bool> running(true);
+
+    server.on_request(handler);
+    server.begin();
+
+    //
+    // The server runs as it would in a sketch's loop().
+    //
+    std::thread loop([&]
+    {
+        while (running)
+        {
+            server.handle();
+            yield();
+        }
+    });
+
+    printf("HTTPServer, over loopback:\n");
+
+    //
+    // A multiple of the deepest pipeline, so each batch is whole.
+    //
+    unsigned long count = 512 * scale;
+    bool ok = per_request(count) && kept_alive(count, 1) &&
+              kept_alive(count, 4) && kept_alive(count, 16);
+
+    running = false;
+    loop.join();
+
+    //
+    // Each request should have been served, without turning any away.
+    //
+    if (ok && ((server.served() != count * 4) || (server.rejected() != 0)))
+    {
+        fprintf(stderr, "Served %lu of %lu requests, rejected %lu\n",
+                server.served(), count * 4, server.rejected());
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,349 @@
+//
+// Benchmark PubSubClient against the fake broker, in-process or over a
+// loopback socket, or against a real broker.
+//
+//   ./bench_mqtt [--quick] [--socket | --broker host:port]
+//
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+
+#include "bench.h"
+#include "fake_broker.h"
+#include "fake_client.h"
+
+
+//
+// The port the fake broker listens upon, with --socket.
+//
+#define SOCKET_PORT 18830
+
+//
+// Give up waiting for the broker after this many seconds.
+//
+#define TIMEOUT 10
+
+//
+// The messages echoed back to us, and those which weren't what we sent.
+//
+static unsigned long received = 0;
+static unsigned long corrupt = 0;
+
+
+/*
+ * The payload of the echoed message with the given sequence number;
+ * sizes vary, so that packets split at varying points.
+ */
+static std::string payload_for(unsigned long seq)
+{
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "%08lu", seq);
+
+    std::string payload(prefix);
+    size_t length = 8 + (seq * 37) % 300;
+
+    for (size_t i = payload.size(); i < length; i++)
+        payload.push_back((char)(seq + i * 7));
+
+    return payload;
+}
+
+
+/*
+ * Check each echoed message arrives intact, and in order.
+ */
+static void on_message(char *topic, uint8_t *payload, unsigned int length)
+{
+    std::string expected = payload_for(received);
+
+    if ((length != expected.size()) || (memcmp(payload, expected.data(), length) != 0))
+        corrupt += 1;
+
+    received += 1;
+}
+
+
+/*
+ * Call loop() until the given number of messages have been echoed
+ * back, and the in-flight window is empty.  Returns false on timeout.
+ *
+ * We yield between calls, as a sketch would, so that a broker on a
+ * thread of its own may run even on a single core.
+ */
+static bool wait_for(PubSubClient &client, unsigned long count)
+{
+    Stopwatch waited;
+
+    while ((received < count) || (client.getInflightCount() > 0))
+    {
+        if (!client.loop() || (waited.seconds() > TIMEOUT))
+            return false;
+
+        yield();
+    }
+
+    return true;
+}
+
+
+/*
+ * Where we connect, and how.
+ */
+struct Target
+{
+    Client *net;
+    FakeClient *fake;
+    std::string host;
+    uint16_t port;
+};
+
+
+static bool connect(PubSubClient &client, Target &target)
+{
+    client.setServer(target.host.c_str(), target.port);
+    client.setCallback(on_message);
+    client.setBufferSize(512);
+    client.setInflightWindow(MQTT_MAX_INFLIGHT);
+
+    if (!client.connect("bench_mqtt"))
+    {
+        fprintf(stderr, "Failed to connect to %s:%u, state %d\n",
+                target.host.c_str(), target.port, client.state());
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * Publish `count` messages as fast as we can.
+ */
+static bool throughput(PubSubClient &client, unsigned long count, uint8_t qos)
+{
+    const uint8_t payload[32] = {};
+    char name[64];
+    Stopwatch timer;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        Stopwatch waited;
+
+        //
+        // With QoS 1 a full window must wait for a PUBACK.
+        //
+        while (!client.publish("bench/throughput", payload, sizeof(payload), false, qos))
+        {
+            if (!client.loop() || (waited.seconds() > TIMEOUT))
+                return false;
+
+            yield();
+        }
+    }
+
+    if (!wait_for(client, received))
+        return false;
+
+    double seconds = timer.seconds();
+
+    snprintf(name, sizeof(name), "QoS %u publishes", qos);
+    report(name, count / seconds, "msg/s");
+    return true;
+}
+
+
+/*
+ * Time messages echoed back to us, one at a time.
+ */
+static bool round_trip(PubSubClient &client, unsigned long count)
+{
+    std::vector<double> samples;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        std::string payload = payload_for(received);
+        Stopwatch timer;
+
+        client.publish("bench/echo", (const uint8_t *)payload.data(), payload.size());
+
+        if (!wait_for(client, received + 1))
+            return false;
+
+        samples.push_back(timer.seconds() * 1e6);
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    double total = 0;
+
+    for (double s : samples)
+        total += s;
+
+    report("round trip, mean", total / count, "us");
+    report("round trip, median", samples[count / 2], "us");
+    report("round trip, 99th percentile", samples[count * 99 / 100], "us");
+    report("round trip, max", samples.back(), "us");
+    return true;
+}
+
+
+/*
+ * The cost of loop() when there's nothing to do.
+ */
+static bool idle_loop(PubSubClient &client, unsigned long count)
+{
+    Stopwatch timer;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (!client.loop())
+            return false;
+    }
+
+    report("idle loop()", timer.seconds() * 1e9 / count, "ns/call");
+    return true;
+}
+
+
+/*
+ * Have messages echoed back in pieces of the given size, and check
+ * they arrive intact.
+ */
+static bool fragmented(PubSubClient &client, FakeClient &fake, size_t fragment, unsigned long count)
+{
+    char name[64];
+    unsigned long first = received;
+    unsigned long bad = corrupt;
+    Stopwatch timer;
+
+    fake.set_fragment(fragment);
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        std::string payload = payload_for(first + i);
+
+        if (!client.publish("bench/echo", (const uint8_t *)payload.data(), payload.size()))
+            return false;
+    }
+
+    bool ok = wait_for(client, first + count);
+    fake.set_fragment(0);
+
+    if (!ok)
+        return false;
+
+    if (corrupt != bad)
+    {
+        fprintf(stderr, "%lu of %lu messages corrupted, fragment size %zu\n",
+                corrupt - bad, count, fragment);
+        return false;
+    }
+
+    if (fragment > 0)
+        snprintf(name, sizeof(name), "echo, %zu byte fragments", fragment);
+    else
+        snprintf(name, sizeof(name), "echo, unfragmented");
+
+    report(name, timer.seconds() * 1e6 / count, "us/msg");
+    return true;
+}
+
+
+static void usage()
+{
+    fprintf(stderr, "Usage: bench_mqtt [--quick] [--socket | --broker host:port]\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long scale = 10;
+    bool socket = false;
+    std::string broker_host;
+    uint16_t broker_port = 1883;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--quick")
+            scale = 1;
+        else if (arg == "--socket")
+            socket = true;
+        else if ((arg == "--broker") && (i + 1 < argc))
+        {
+            broker_host = argv[++i];
+            size_t colon = broker_host.find(':');
+
+            if (colon != std::string::npos)
+            {
+                broker_port = atoi(broker_host.c_str() + colon + 1);
+                broker_host.erase(colon);
+            }
+        }
+        else
+            usage();
+    }
+
+    FakeBroker broker;
+    FakeClient fake(broker);
+    WiFiClient wifi;
+    Target target = { &fake, &fake, "fake", 1883 };
+    std::atomic<bool> running(true);
+    std::thread server;
+
+    if (socket)
+    {
+        if (!broker.listen(SOCKET_PORT))
+            return 1;
+
+        server = std::thread([&] { broker.serve(running); });
+        target = { &wifi, NULL, "127.0.0.1", SOCKET_PORT };
+    }
+    else if (!broker_host.empty())
+        target = { &wifi, NULL, broker_host, broker_port };
+
+    printf("PubSubClient, against %s:\n",
+           socket ? "the fake broker, over loopback" :
+           target.fake ? "the fake broker, in-process" : broker_host.c_str());
+
+    PubSubClient client(*target.net);
+    bool ok = connect(client, target) && client.subscribe("bench/echo");
+
+    ok = ok && throughput(client, 10000 * scale, 0);
+    ok = ok && throughput(client, 2000 * scale, 1);
+    ok = ok && round_trip(client, 200 * scale);
+    ok = ok && idle_loop(client, 100000 * scale);
+
+    //
+    // We can only split what's read when we're reading from the fake.
+    //
+    if (target.fake != NULL)
+    {
+        const size_t fragments[] = { 1, 3, 16, 0 };
+
+        for (size_t fragment : fragments)
+            ok = ok && fragmented(client, fake, fragment, 50 * scale);
+    }
+
+    client.disconnect();
+
+    if (server.joinable())
+    {
+        running = false;
+        server.join();
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Failed, state %d\n", client.state());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+//
+// Measure the CPU cost of a single QoS 0 publish, to a Client which
+// discards what it is given, naming the topic with a string, with an
+// MQTTTopic handle, and streaming the payload after a handle.
+//
+//   ./bench_publish [--quick]
+//
+#include <PubSubClient.h>
+
+#include "bench.h"
+#include "fake_client.h"
+
+
+/*
+ * A connection which throws away everything we write.
+ */
+class NullClient : public FakeClient
+{
+public:
+    size_t write(const uint8_t *buf, size_t size)
+    {
+        return size;
+    }
+
+    using FakeClient::write;
+};
+
+
+//
+// The topics our sketches publish to, and a longer one.
+//
+static const char *topics[] = { "alarm", "temperature", "water", "sensors/kitchen/temperature/celsius" };
+
+
+//
+// Each way is timed this many times, interleaved, keeping the fastest,
+// so that noise from the rest of the system is mostly ignored.
+//
+#define ROUNDS 5
+
+
+static void run(PubSubClient &client, const char *name, unsigned long count)
+{
+    MQTTTopic topic(name);
+    uint8_t payload[64];
+    double plain_ns = 1e9;
+    double handle_ns = 1e9;
+    double streamed_ns = 1e9;
+
+    memset(payload, 'x', sizeof(payload));
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        Stopwatch plain;
+
+        for (unsigned long i = 0; i < count; i++)
+            client.publish(name, payload, sizeof(payload), false);
+
+        plain_ns = min(plain_ns, plain.seconds() * 1e9 / count);
+        Stopwatch handle;
+
+        for (unsigned long i = 0; i < count; i++)
+            client.publish(topic, payload, sizeof(payload));
+
+        handle_ns = min(handle_ns, handle.seconds() * 1e9 / count);
+        Stopwatch streamed;
+
+        for (unsigned long i = 0; i < count; i++)
+        {
+            client.beginPublish(topic, sizeof(payload), false);
+            client.write(payload, sizeof(payload));
+            client.endPublish();
+        }
+
+        streamed_ns = min(streamed_ns, streamed.seconds() * 1e9 / count);
+    }
+
+    printf(" \"%s\":\n", name);
+    report("const char* topic", plain_ns, "ns/publish");
+    report("MQTTTopic", handle_ns, "ns/publish");
+    report("MQTTTopic, streamed", streamed_ns, "ns/publish");
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = 200000;
+
+    if ((argc > 1) && (strcmp(argv[1], "--quick") == 0))
+        count /= 10;
+
+    NullClient net;
+    PubSubClient client(net);
+    const uint8_t connack[] = { MQTTCONNACK, 2, 0, 0 };
+
+    client.setServer("null", 1883);
+    net.feed(connack, sizeof(connack));
+
+    if (!client.connect("bench_publish"))
+    {
+        fprintf(stderr, "Failed to connect, state %d\n", client.state());
+        return 1;
+    }
+
+    printf("PubSubClient, QoS 0 publish of 64 bytes:\n");
+
+    for (const char *topic : topics)
+        run(client, topic, count);
+
+    //
+    // Three ways, for each round and topic, and none should have failed.
+    //
+    const MQTTStats &stats = client.getStats();
+
+    if ((stats.publishes != count * 3 * ROUNDS * 4) || (stats.publishFailures != 0))
+    {
+        fprintf(stderr, "%lu publishes, %lu failures\n", stats.publishes, stats.publishFailures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,177 @@
+//
+// Count the bytes each of d1-temp's readings takes on the wire: its JSON
+// payload, published to "temperature" at QoS 1, over and over.
+//
+// This is built for MQTT 3.1.1 as bench_wire, and for MQTT 5 as
+// bench_wire5, which runs once with a broker granting topic aliases and
+// once with one which doesn't.
+//
+//   ./bench_wire [--quick]
+//   ./bench_wire5 [--quick]
+//
+#include <string>
+
+#include <PubSubClient.h>
+#include <json_writer.h>
+
+#include "bench.h"
+#include "fake_client.h"
+
+
+//
+// The topic d1-temp publishes its readings to.
+//
+#define TOPIC "temperature"
+
+
+/*
+ * Format a reading as d1-temp does.
+ */
+static size_t reading(char *buf, size_t size)
+{
+    JSONWriter json(buf, size);
+    json.begin_object();
+    json.add("temperature", 21.5);
+    json.add("humidity", 48.25);
+    json.add("mac", "5C:CF:7F:A1:B2:C3");
+    json.end_object();
+
+    return json.length();
+}
+
+
+/*
+ * The message-ID of a QoS 1 PUBLISH, after its topic and - for MQTT 5 -
+ * ahead of its properties.
+ */
+static uint16_t packet_id(const std::string &packet)
+{
+    size_t pos = 1;
+
+    while ((pos < packet.size()) && (packet[pos] & 0x80))
+        pos++;
+
+    pos++;
+
+    if (pos + 2 > packet.size())
+        return 0;
+
+    pos += 2 + (((uint8_t)packet[pos] << 8) | (uint8_t)packet[pos + 1]);
+
+    if (pos + 2 > packet.size())
+        return 0;
+
+    return ((uint8_t)packet[pos] << 8) | (uint8_t)packet[pos + 1];
+}
+
+
+/*
+ * Publish the given number of readings, once the broker has answered
+ * with the given CONNACK, acknowledging each as the broker would.
+ *
+ * Returns the bytes each later publish took, on average, or zero if
+ * any failed.
+ */
+static double run(const char *name, const std::string &connack, unsigned long count)
+{
+    FakeClient net;
+    PubSubClient client(net);
+    char payload[128];
+    size_t length = reading(payload, sizeof(payload));
+
+    client.setServer("fake", 1883);
+    client.setInflightWindow(4);
+    net.feed(connack);
+
+    if (!client.connect("d1-temp"))
+    {
+        fprintf(stderr, "Failed to connect, state %d\n", client.state());
+        return 0;
+    }
+
+    size_t connect = net.written().size();
+    size_t first = 0;
+    size_t later = 0;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        net.written().clear();
+
+        if (!client.publish(TOPIC, (const uint8_t *)payload, length, false, 1))
+        {
+            fprintf(stderr, "Publish %lu failed, state %d\n", i, client.state());
+            return 0;
+        }
+
+        if (i == 0)
+            first = net.written().size();
+        else
+            later += net.written().size();
+
+        uint16_t id = packet_id(net.written());
+        const uint8_t puback[] = { MQTTPUBACK, 2, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF) };
+
+        net.feed(puback, sizeof(puback));
+        client.loop();
+    }
+
+    if (client.getStats().acknowledged != count)
+    {
+        fprintf(stderr, "%lu of %lu publishes acknowledged\n", client.getStats().acknowledged, count);
+        return 0;
+    }
+
+    double each = (double)later / (count - 1);
+
+    printf(" %s, %u bytes of payload:\n", name, (unsigned)length);
+    report("CONNECT", connect, "bytes");
+    report("first PUBLISH", first, "bytes");
+    report("each later PUBLISH", each, "bytes");
+    report("all PUBLISHes", first + later, "bytes");
+
+    return each;
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = 10000;
+
+    if ((argc > 1) && (strcmp(argv[1], "--quick") == 0))
+        count /= 100;
+
+    printf("PubSubClient, QoS 1 readings from d1-temp to \"%s\", %lu times:\n", TOPIC, count);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+    //
+    // A CONNACK without properties, and one granting four aliases.
+    //
+    const std::string plain("\x20\x03\x00\x00\x00", 5);
+    const std::string aliased("\x20\x06\x00\x00\x03\x22\x00\x04", 8);
+
+    double without = run("MQTT 5, no topic aliases", plain, count);
+    double with = run("MQTT 5, topic aliases", aliased, count);
+
+    if ((without == 0) || (with == 0))
+        return 1;
+
+    //
+    // Once the broker knows the alias, the topic isn't sent again; just
+    // the alias, a property of three bytes.
+    //
+    double expected = without - strlen(TOPIC) + 3;
+
+    if (with != expected)
+    {
+        fprintf(stderr, "Aliased publishes take %.2f bytes, not %.2f\n", with, expected);
+        return 1;
+    }
+#else
+    const std::string plain("\x20\x02\x00\x00", 4);
+
+    if (run("MQTT 3.1.1", plain, count) == 0)
+        return 1;
+#endif
+
+    return 0;
+}
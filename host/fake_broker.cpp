@@ -0,0 +1,520 @@
+//
+// Our header.
+//
+#include "fake_broker.h"
+
+//
+// For serving over loopback sockets.
+//
+#include <ESP8266WiFi.h>
+
+
+//
+// The packet types we handle; their values match PubSubClient.h.
+//
+#define CONNECT     0x10
+#define CONNACK     0x20
+#define PUBLISH     0x30
+#define PUBACK      0x40
+#define SUBSCRIBE   0x80
+#define SUBACK      0x90
+#define UNSUBSCRIBE 0xA0
+#define UNSUBACK    0xB0
+#define PINGREQ     0xC0
+#define PINGRESP    0xD0
+#define DISCONNECT  0xE0
+
+
+/*
+ * Append a packet, with its remaining-length.
+ */
+static void append_packet(std::string *out, uint8_t header, const std::string &body)
+{
+    size_t length = body.size();
+
+    out->push_back(header);
+
+    do
+    {
+        uint8_t digit = length % 128;
+        length /= 128;
+        out->push_back((length > 0) ? (digit | 0x80) : digit);
+    }
+    while (length > 0);
+
+    out->append(body);
+}
+
+
+static void append_short(std::string &body, uint16_t value)
+{
+    body.push_back(value >> 8);
+    body.push_back(value & 0xFF);
+}
+
+
+/*
+ * Read a length-prefixed string from a packet body, moving `pos` past
+ * it.  Returns false if it overruns the body.
+ */
+static bool read_string(const std::string &body, size_t &pos, std::string &value)
+{
+    if (pos + 2 > body.size())
+        return false;
+
+    size_t length = ((uint8_t)body[pos] << 8) | (uint8_t)body[pos + 1];
+
+    if (pos + 2 + length > body.size())
+        return false;
+
+    value = body.substr(pos + 2, length);
+    pos += 2 + length;
+    return true;
+}
+
+
+static bool read_short(const std::string &body, size_t &pos, uint16_t &value)
+{
+    if (pos + 2 > body.size())
+        return false;
+
+    value = ((uint8_t)body[pos] << 8) | (uint8_t)body[pos + 1];
+    pos += 2;
+    return true;
+}
+
+
+FakeBroker::FakeBroker()
+{
+}
+
+
+FakeBroker::~FakeBroker()
+{
+}
+
+
+FakeSession *FakeBroker::open(std::string *out)
+{
+    m_sessions.emplace_back();
+    m_sessions.back().out = out;
+    return &m_sessions.back();
+}
+
+
+void FakeBroker::close(FakeSession *session)
+{
+    for (auto it = m_sessions.begin(); it != m_sessions.end(); ++it)
+    {
+        if (&*it == session)
+        {
+            m_sessions.erase(it);
+            return;
+        }
+    }
+}
+
+
+/*
+ * Gather bytes until we have a whole packet, then handle it.
+ */
+void FakeBroker::receive(FakeSession *session, const uint8_t *data, size_t len)
+{
+    session->in.append((const char *)data, len);
+
+    while (!session->closed)
+    {
+        const std::string &in = session->in;
+        size_t length = 0;
+        size_t pos = 1;
+        size_t multiplier = 1;
+
+        //
+        // The remaining-length is at most four bytes.
+        //
+        while (true)
+        {
+            if (pos >= in.size())
+                return;
+
+            uint8_t digit = in[pos++];
+            length += (digit & 0x7F) * multiplier;
+            multiplier *= 128;
+
+            if ((digit & 0x80) == 0)
+                break;
+
+            if (pos > 4)
+            {
+                m_stats.errors += 1;
+                session->closed = true;
+                return;
+            }
+        }
+
+        if (in.size() < pos + length)
+            return;
+
+        uint8_t header = in[0];
+        std::string body = in.substr(pos, length);
+        session->in.erase(0, pos + length);
+
+        if (!handle(session, header, body))
+        {
+            m_stats.errors += 1;
+            session->closed = true;
+        }
+    }
+}
+
+
+/*
+ * Handle a single packet, returning false if it was malformed.
+ */
+bool FakeBroker::handle(FakeSession *session, uint8_t header, const std::string &body)
+{
+    uint8_t type = header & 0xF0;
+    size_t pos = 0;
+
+    if (!session->connected && (type != CONNECT))
+        return false;
+
+    switch (type)
+    {
+    case CONNECT:
+    {
+        std::string protocol;
+        std::string reply;
+
+        if (session->connected || !read_string(body, pos, protocol) || (pos + 4 > body.size()))
+            return false;
+
+        //
+        // Skip the level, flags & keep-alive, to the client ID.
+        //
+        uint8_t level = body[pos];
+        pos += 4;
+
+        if (!read_string(body, pos, session->client_id))
+            return false;
+
+        uint8_t code = m_refuse;
+
+        if ((level != 3) && (level != 4))
+            code = 1;
+
+        reply.push_back(0);
+        reply.push_back(code);
+        append_packet(session->out, CONNACK, reply);
+
+        if (code != 0)
+        {
+            m_stats.refused += 1;
+            session->closed = true;
+            return true;
+        }
+
+        m_stats.connects += 1;
+        session->connected = true;
+        return true;
+    }
+
+    case PUBLISH:
+    {
+        uint8_t qos = (header >> 1) & 0x03;
+        std::string topic;
+        uint16_t id = 0;
+
+        if (!read_string(body, pos, topic) || (qos > 1) || ((qos > 0) && !read_short(body, pos, id)))
+            return false;
+
+        m_stats.publishes += 1;
+        m_stats.payload_bytes += body.size() - pos;
+
+        if (qos > 0)
+        {
+            std::string reply;
+            append_short(reply, id);
+            append_packet(session->out, PUBACK, reply);
+        }
+
+        route(topic, body.substr(pos), qos);
+        return true;
+    }
+
+    case PUBACK:
+        m_stats.acks += 1;
+        return true;
+
+    case SUBSCRIBE:
+    {
+        std::string reply;
+        uint16_t id;
+
+        if ((header != (SUBSCRIBE | 0x02)) || !read_short(body, pos, id))
+            return false;
+
+        append_short(reply, id);
+
+        while (pos < body.size())
+        {
+            std::string filter;
+
+            if (!read_string(body, pos, filter) || (pos >= body.size()))
+                return false;
+
+            uint8_t granted = min((uint8_t)body[pos++], (uint8_t)1);
+            bool replaced = false;
+
+            for (auto &f : session->filters)
+            {
+                if (f.first == filter)
+                {
+                    f.second = granted;
+                    replaced = true;
+                }
+            }
+
+            if (!replaced)
+                session->filters.push_back(std::make_pair(filter, granted));
+
+            reply.push_back(granted);
+        }
+
+        m_stats.subscribes += 1;
+        append_packet(session->out, SUBACK, reply);
+        return true;
+    }
+
+    case UNSUBSCRIBE:
+    {
+        std::string reply;
+        uint16_t id;
+
+        if ((header != (UNSUBSCRIBE | 0x02)) || !read_short(body, pos, id))
+            return false;
+
+        while (pos < body.size())
+        {
+            std::string filter;
+
+            if (!read_string(body, pos, filter))
+                return false;
+
+            for (auto it = session->filters.begin(); it != session->filters.end(); ++it)
+            {
+                if (it->first == filter)
+                {
+                    session->filters.erase(it);
+                    break;
+                }
+            }
+        }
+
+        m_stats.unsubscribes += 1;
+        append_short(reply, id);
+        append_packet(session->out, UNSUBACK, reply);
+        return true;
+    }
+
+    case PINGREQ:
+        m_stats.pings += 1;
+        append_packet(session->out, PINGRESP, "");
+        return true;
+
+    case DISCONNECT:
+        session->closed = true;
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Send a message to each session subscribed to its topic, once, with
+ * the highest QoS of the filters which match.
+ */
+void FakeBroker::route(const std::string &topic, const std::string &payload, uint8_t qos)
+{
+    for (auto &session : m_sessions)
+    {
+        int granted = -1;
+
+        if (!session.connected || session.closed)
+            continue;
+
+        for (auto &f : session.filters)
+        {
+            if (matches(f.first, topic))
+                granted = max(granted, (int)f.second);
+        }
+
+        if (granted < 0)
+            continue;
+
+        uint8_t sent = min((int)qos, granted);
+        std::string body;
+
+        append_short(body, topic.size());
+        body.append(topic);
+
+        if (sent > 0)
+        {
+            session.next_id += 1;
+
+            if (session.next_id == 0)
+                session.next_id = 1;
+
+            append_short(body, session.next_id);
+        }
+
+        body.append(payload);
+        append_packet(session.out, PUBLISH | (sent << 1), body);
+        m_stats.delivered += 1;
+    }
+}
+
+
+void FakeBroker::inject(const std::string &topic, const std::string &payload, uint8_t qos)
+{
+    m_stats.publishes += 1;
+    m_stats.payload_bytes += payload.size();
+
+    route(topic, payload, min(qos, (uint8_t)1));
+}
+
+
+void FakeBroker::refuse(uint8_t code)
+{
+    m_refuse = code;
+}
+
+
+bool FakeBroker::listen(uint16_t port)
+{
+    m_server.reset(new WiFiServer(port));
+    m_server->begin();
+
+    return m_server->listening();
+}
+
+
+/*
+ * Pass bytes between each socket and its session.
+ */
+void FakeBroker::serve(std::atomic<bool> &running)
+{
+    struct Connection
+    {
+        WiFiClient client;
+        std::string out;
+        FakeSession *session;
+    };
+
+    std::list<Connection> connections;
+    uint8_t buf[1460];
+
+    while (running && m_server)
+    {
+        bool idle = true;
+
+        while (m_server->hasClient())
+        {
+            WiFiClient client = m_server->available();
+
+            if (!client)
+                break;
+
+            connections.emplace_back();
+            connections.back().client = client;
+            connections.back().session = open(&connections.back().out);
+        }
+
+        for (auto it = connections.begin(); it != connections.end();)
+        {
+            int n;
+
+            while ((n = it->client.read(buf, sizeof(buf))) > 0)
+            {
+                receive(it->session, buf, n);
+                idle = false;
+            }
+
+            if (!it->out.empty())
+            {
+                it->client.write((const uint8_t *)it->out.data(), it->out.size());
+                it->out.clear();
+                idle = false;
+            }
+
+            if (it->session->closed || !it->client.connected())
+            {
+                it->client.stop();
+                close(it->session);
+                it = connections.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        if (idle)
+            yield();
+    }
+
+    for (auto &c : connections)
+        close(c.session);
+}
+
+
+const FakeBrokerStats &FakeBroker::stats()
+{
+    return m_stats;
+}
+
+
+/*
+ * Match a topic against a filter, level by level.
+ */
+bool FakeBroker::matches(const std::string &filter, const std::string &topic)
+{
+    size_t f = 0;
+    size_t t = 0;
+
+    while (true)
+    {
+        size_t f_end = filter.find('/', f);
+        size_t t_end = topic.find('/', t);
+
+        if (f_end == std::string::npos)
+            f_end = filter.size();
+
+        if (t_end == std::string::npos)
+            t_end = topic.size();
+
+        std::string level = filter.substr(f, f_end - f);
+
+        if (level == "#")
+            return true;
+
+        if ((level != "+") && (level != topic.substr(t, t_end - t)))
+            return false;
+
+        bool filter_done = (f_end == filter.size());
+        bool topic_done = (t_end == topic.size());
+
+        if (filter_done || topic_done)
+        {
+            //
+            // "a/#" matches "a" too.
+            //
+            if (topic_done && !filter_done)
+                return filter.compare(f_end, std::string::npos, "/#") == 0;
+
+            return filter_done && topic_done;
+        }
+
+        f = f_end + 1;
+        t = t_end + 1;
+    }
+}
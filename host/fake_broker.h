@@ -0,0 +1,139 @@
+#ifndef FAKE_BROKER_H
+#define FAKE_BROKER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+class WiFiServer;
+
+
+/*
+ * A connection to the broker.
+ */
+struct FakeSession
+{
+    /*
+     * Where the broker's packets for this session are appended.
+     */
+    std::string *out;
+
+    /*
+     * What's been received of a packet which isn't yet complete.
+     */
+    std::string in;
+
+    /*
+     * The topic filters subscribed to, with the QoS granted.
+     */
+    std::vector<std::pair<std::string, uint8_t>> filters;
+
+    std::string client_id;
+    bool connected = false;
+    bool closed = false;
+    uint16_t next_id = 0;
+};
+
+
+/*
+ * Counters, so that tests may check what the broker saw.
+ */
+struct FakeBrokerStats
+{
+    unsigned long connects = 0;
+    unsigned long refused = 0;
+    unsigned long publishes = 0;     // PUBLISH packets received
+    unsigned long payload_bytes = 0; // The bytes of their payloads
+    unsigned long delivered = 0;     // PUBLISH packets sent to subscribers
+    unsigned long acks = 0;          // PUBACKs received
+    unsigned long subscribes = 0;
+    unsigned long unsubscribes = 0;
+    unsigned long pings = 0;
+    unsigned long errors = 0;        // Malformed packets, closing the session
+};
+
+
+/*
+ * A stand-in for an MQTT 3.1.1 broker, for host builds.
+ *
+ * It accepts any client, and routes QoS 0 & 1 publishes to sessions
+ * whose subscriptions match, with the "+" & "#" wildcards, at the
+ * lower of the two QoS.  There are no retained messages, no wills and
+ * no persistent sessions, and QoS 2 is granted as QoS 1.
+ *
+ * Packets are handled as soon as they have been received in full, so
+ * a `FakeClient` attached to the broker finds any reply waiting as
+ * soon as its write returns.  Alternatively the broker may listen on
+ * a loopback TCP port, and be run on a thread of its own:
+ *
+ *   FakeBroker broker;
+ *   std::atomic<bool> running(true);
+ *
+ *   broker.listen(18830);
+ *   std::thread server([&] { broker.serve(running); });
+ */
+class FakeBroker
+{
+public:
+
+    FakeBroker();
+    ~FakeBroker();
+
+    /*
+     * Start a session, whose replies are appended to `out`.
+     */
+    FakeSession *open(std::string *out);
+
+    /*
+     * End a session, which may not be used again.
+     */
+    void close(FakeSession *session);
+
+    /*
+     * Handle bytes received from a session, in pieces of any size.
+     */
+    void receive(FakeSession *session, const uint8_t *data, size_t len);
+
+    /*
+     * Publish a message from within, as a gateway relaying for its own
+     * clients would, to each session subscribed to its topic.
+     */
+    void inject(const std::string &topic, const std::string &payload, uint8_t qos);
+
+    /*
+     * Refuse the following connections with the given CONNACK return
+     * code, or accept them again if it is zero.
+     */
+    void refuse(uint8_t code);
+
+    /*
+     * Accept connections on the given loopback port, returning false if
+     * it is in use.  They are handled by `serve()`, until `running`
+     * becomes false.
+     */
+    bool listen(uint16_t port);
+    void serve(std::atomic<bool> &running);
+
+    const FakeBrokerStats &stats();
+
+    /*
+     * Does the topic match the given filter?
+     */
+    static bool matches(const std::string &filter, const std::string &topic);
+
+private:
+
+    bool handle(FakeSession *session, uint8_t header, const std::string &body);
+    void route(const std::string &topic, const std::string &payload, uint8_t qos);
+
+    std::list<FakeSession> m_sessions;
+    FakeBrokerStats m_stats;
+    uint8_t m_refuse = 0;
+    std::unique_ptr<WiFiServer> m_server;
+};
+
+#endif /* FAKE_BROKER_H */
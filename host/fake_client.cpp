@@ -0,0 +1,215 @@
+//
+// Our header.
+//
+#include "fake_client.h"
+
+//
+// We may be attached to a broker.
+//
+#include "fake_broker.h"
+
+
+FakeClient::FakeClient()
+{
+}
+
+
+FakeClient::FakeClient(FakeBroker &broker) : m_broker(&broker)
+{
+}
+
+
+FakeClient::~FakeClient()
+{
+    stop();
+}
+
+
+int FakeClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+
+/*
+ * Connect, to our broker if we have one.
+ */
+int FakeClient::connect(const char *host, uint16_t port)
+{
+    stop();
+
+    m_connected = true;
+    m_hung_up = false;
+
+    //
+    // A new session starts afresh; otherwise what's been fed is kept,
+    // as it may be the reply to the connection we're making.
+    //
+    if (m_broker != NULL)
+    {
+        m_in.clear();
+        m_in_pos = 0;
+        m_session = m_broker->open(&m_in);
+    }
+
+    return 1;
+}
+
+
+size_t FakeClient::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+
+/*
+ * Pass what's written to our broker, or keep it.
+ */
+size_t FakeClient::write(const uint8_t *buf, size_t size)
+{
+    if (!m_connected || m_hung_up)
+        return 0;
+
+    m_writes += 1;
+
+    if (m_session == NULL)
+    {
+        m_out.append((const char *)buf, size);
+        return size;
+    }
+
+    m_broker->receive(m_session, buf, size);
+
+    //
+    // The broker may have closed the session, such as on DISCONNECT.
+    //
+    if (m_session->closed)
+        hang_up();
+
+    return size;
+}
+
+
+int FakeClient::available()
+{
+    size_t n = pending();
+
+    if ((m_fragment > 0) && (n > m_fragment))
+        n = m_fragment;
+
+    return n;
+}
+
+
+int FakeClient::read()
+{
+    uint8_t c;
+
+    return (read(&c, 1) == 1) ? c : -1;
+}
+
+
+int FakeClient::read(uint8_t *buf, size_t size)
+{
+    size_t n = min(size, (size_t)available());
+
+    if (n == 0)
+        return -1;
+
+    memcpy(buf, m_in.data() + m_in_pos, n);
+    m_in_pos += n;
+
+    //
+    // Forget what's been read, once there's enough to be worth it.
+    //
+    if ((m_in_pos == m_in.size()) || (m_in_pos > 4096))
+    {
+        m_in.erase(0, m_in_pos);
+        m_in_pos = 0;
+    }
+
+    return n;
+}
+
+
+int FakeClient::peek()
+{
+    return (pending() > 0) ? (uint8_t)m_in[m_in_pos] : -1;
+}
+
+
+void FakeClient::flush()
+{
+}
+
+
+void FakeClient::stop()
+{
+    if (m_session != NULL)
+        m_broker->close(m_session);
+
+    m_session = NULL;
+    m_connected = false;
+}
+
+
+/*
+ * Like a socket we're connected while there's something to read.
+ */
+uint8_t FakeClient::connected()
+{
+    return m_connected && (!m_hung_up || (pending() > 0));
+}
+
+
+FakeClient::operator bool()
+{
+    return m_connected;
+}
+
+
+void FakeClient::feed(const uint8_t *data, size_t len)
+{
+    m_in.append((const char *)data, len);
+}
+
+
+void FakeClient::feed(const std::string &data)
+{
+    m_in.append(data);
+}
+
+
+void FakeClient::hang_up()
+{
+    m_hung_up = true;
+
+    if (m_session != NULL)
+        m_broker->close(m_session);
+
+    m_session = NULL;
+}
+
+
+void FakeClient::set_fragment(size_t bytes)
+{
+    m_fragment = bytes;
+}
+
+
+std::string &FakeClient::written()
+{
+    return m_out;
+}
+
+
+size_t FakeClient::pending()
+{
+    return m_in.size() - m_in_pos;
+}
+
+
+unsigned long FakeClient::writes()
+{
+    return m_writes;
+}
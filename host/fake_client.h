@@ -0,0 +1,97 @@
+#ifndef FAKE_CLIENT_H
+#define FAKE_CLIENT_H
+
+#include <string>
+
+#include <Arduino.h>
+#include <Client.h>
+
+class FakeBroker;
+struct FakeSession;
+
+
+/*
+ * An in-memory Client, for host tests and benchmarks.
+ *
+ * Attached to a `FakeBroker` it connects to that, and each packet we
+ * write is answered before `write()` returns.  Otherwise `connect()`
+ * always succeeds, what we write is kept for the test to inspect, and
+ * the bytes we read are those given to `feed()`, before or after
+ * connecting:
+ *
+ *   FakeClient net;
+ *   PubSubClient client(net);
+ *
+ *   net.feed(connack, sizeof(connack));
+ *   client.connect("id");
+ *
+ * `set_fragment()` limits the bytes each call to `available()` or
+ * `read()` will offer, as if they arrived in small TCP segments.
+ */
+class FakeClient : public Client
+{
+public:
+
+    FakeClient();
+    FakeClient(FakeBroker &broker);
+    ~FakeClient();
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+
+    using Print::write;
+
+    /*
+     * Add bytes for us to read.
+     */
+    void feed(const uint8_t *data, size_t len);
+    void feed(const std::string &data);
+
+    /*
+     * Close the connection from the far end; what's unread may still
+     * be read.
+     */
+    void hang_up();
+
+    /*
+     * The most bytes each read may return, or zero for no limit.
+     */
+    void set_fragment(size_t bytes);
+
+    /*
+     * Everything we've written, when not attached to a broker.
+     */
+    std::string &written();
+
+    /*
+     * The bytes waiting to be read, and the number of writes made.
+     */
+    size_t pending();
+    unsigned long writes();
+
+private:
+
+    FakeBroker *m_broker = NULL;
+    FakeSession *m_session = NULL;
+
+    bool m_connected = false;
+    bool m_hung_up = false;
+    size_t m_fragment = 0;
+
+    std::string m_in;
+    size_t m_in_pos = 0;
+    std::string m_out;
+    unsigned long m_writes = 0;
+};
+
+#endif /* FAKE_CLIENT_H */
@@ -0,0 +1,311 @@
+//
+// Our header.
+//
+#include "fake_gateway.h"
+
+//
+// Where we relay messages.
+//
+#include "fake_broker.h"
+
+
+//
+// The packet types we handle; their values match mqtt_sn_client.cpp.
+//
+#define CONNECT    0x04
+#define CONNACK    0x05
+#define REGISTER   0x0A
+#define REGACK     0x0B
+#define PUBLISH    0x0C
+#define PUBACK     0x0D
+#define PINGREQ    0x16
+#define PINGRESP   0x17
+#define DISCONNECT 0x18
+
+//
+// Flags, topic types and return codes.
+//
+#define FLAG_DUP    0x80
+#define FLAG_RETAIN 0x10
+#define FLAG_CLEAN  0x04
+
+#define TOPIC_NORMAL     0x00
+#define TOPIC_PREDEFINED 0x01
+#define TOPIC_SHORT      0x02
+
+#define ACCEPTED         0x00
+#define INVALID_TOPIC_ID 0x02
+#define NOT_SUPPORTED    0x03
+
+
+/*
+ * Build a packet, with a one-byte length; ours are always short.
+ */
+static std::string packet(uint8_t type, const std::string &body)
+{
+    return std::string(1, (char)(2 + body.size())) + (char)type + body;
+}
+
+
+static std::string bytes(uint16_t value)
+{
+    return std::string(1, (char)(value >> 8)) + (char)(value & 0xFF);
+}
+
+
+static uint16_t read_short(const std::string &body, size_t pos)
+{
+    return ((uint8_t)body[pos] << 8) | (uint8_t)body[pos + 1];
+}
+
+
+FakeGateway::FakeGateway()
+{
+}
+
+
+FakeGateway::FakeGateway(FakeBroker &broker) : m_broker(&broker)
+{
+}
+
+
+/*
+ * Handle a datagram, unless we're to ignore it or its replies.
+ */
+void FakeGateway::receive(const uint8_t *data, size_t length, std::deque<std::string> &replies)
+{
+    std::deque<std::string> answers;
+
+    if (m_silent || (length < 2))
+        return;
+
+    //
+    // A length of 0x01 means the next two bytes hold it.
+    //
+    size_t offset = (data[0] == 0x01) ? 3 : 1;
+
+    if (length < offset + 1)
+        return;
+
+    uint8_t type = data[offset];
+    std::string body((const char *)data + offset + 1, length - offset - 1);
+
+    m_received[type] += 1;
+    handle(type, body, answers);
+
+    if (m_drop > 0)
+    {
+        m_drop -= 1;
+        return;
+    }
+
+    replies.insert(replies.end(), answers.begin(), answers.end());
+}
+
+
+void FakeGateway::handle(uint8_t type, const std::string &body, std::deque<std::string> &replies)
+{
+    switch (type)
+    {
+    case CONNECT:
+        if (body.size() < 4)
+            return;
+
+        m_clean = (body[0] & FLAG_CLEAN) != 0;
+        m_keepalive = read_short(body, 2);
+        m_client_id = body.substr(4);
+        m_connected = true;
+        m_asleep = false;
+
+        if (m_clean)
+            m_topics.clear();
+
+        replies.push_back(packet(CONNACK, std::string(1, ACCEPTED)));
+        break;
+
+    case REGISTER:
+    {
+        if (body.size() < 4)
+            return;
+
+        uint16_t msg_id = read_short(body, 2);
+
+        if (!m_connected)
+        {
+            replies.push_back(packet(REGACK, bytes(0) + bytes(msg_id) + (char)NOT_SUPPORTED));
+            return;
+        }
+
+        uint16_t id = m_next_topic++;
+
+        m_topics[id] = body.substr(4);
+        m_registrations.push_back(body.substr(4));
+        replies.push_back(packet(REGACK, bytes(id) + bytes(msg_id) + (char)ACCEPTED));
+        break;
+    }
+
+    case PUBLISH:
+        publish(body, replies);
+        break;
+
+    case PINGREQ:
+        m_ping_id = body;
+        replies.push_back(packet(PINGRESP, ""));
+        break;
+
+    case DISCONNECT:
+        //
+        // With a duration the client is going to sleep.
+        //
+        m_connected = false;
+        m_asleep = (body.size() >= 2);
+        m_sleep = m_asleep ? read_short(body, 0) : 0;
+
+        replies.push_back(packet(DISCONNECT, ""));
+        break;
+    }
+}
+
+
+/*
+ * Accept a message, if we know its topic, acknowledging it if asked.
+ */
+void FakeGateway::publish(const std::string &body, std::deque<std::string> &replies)
+{
+    if (body.size() < 5)
+        return;
+
+    uint8_t flags = body[0];
+    uint16_t topic_id = read_short(body, 1);
+    uint16_t msg_id = read_short(body, 3);
+    int qos = (flags >> 5) & 0x03;
+
+    if (qos == 3)
+        qos = -1;
+
+    //
+    // Only QoS -1 may be sent without a connection.
+    //
+    if ((qos >= 0) && !m_connected)
+        return;
+
+    std::string topic;
+
+    switch (flags & 0x03)
+    {
+    case TOPIC_NORMAL:
+        if (m_topics.count(topic_id) && (qos >= 0))
+            topic = m_topics[topic_id];
+        break;
+
+    case TOPIC_PREDEFINED:
+        if (m_predefined.count(topic_id))
+            topic = m_predefined[topic_id];
+        break;
+
+    case TOPIC_SHORT:
+        topic = body.substr(1, 2);
+        break;
+    }
+
+    if (topic.empty())
+    {
+        if (qos >= 0)
+            replies.push_back(packet(PUBACK, bytes(topic_id) + bytes(msg_id) + (char)INVALID_TOPIC_ID));
+
+        return;
+    }
+
+    FakeGatewayMessage message = { topic, body.substr(5), qos, (flags & FLAG_DUP) != 0, (flags & FLAG_RETAIN) != 0 };
+    m_messages.push_back(message);
+
+    if (m_broker != NULL)
+        m_broker->inject(topic, message.payload, (qos > 0) ? qos : 0);
+
+    if (qos == 1)
+        replies.push_back(packet(PUBACK, bytes(topic_id) + bytes(msg_id) + (char)ACCEPTED));
+}
+
+
+void FakeGateway::predefine(uint16_t id, const std::string &name)
+{
+    m_predefined[id] = name;
+}
+
+
+void FakeGateway::drop(unsigned int count)
+{
+    m_drop = count;
+}
+
+
+void FakeGateway::set_silent(bool silent)
+{
+    m_silent = silent;
+}
+
+
+void FakeGateway::forget()
+{
+    m_topics.clear();
+}
+
+
+std::vector<FakeGatewayMessage> &FakeGateway::messages()
+{
+    return m_messages;
+}
+
+
+std::vector<std::string> &FakeGateway::registrations()
+{
+    return m_registrations;
+}
+
+
+unsigned long FakeGateway::received(uint8_t type)
+{
+    return m_received[type];
+}
+
+
+bool FakeGateway::connected()
+{
+    return m_connected;
+}
+
+
+bool FakeGateway::asleep()
+{
+    return m_asleep;
+}
+
+
+bool FakeGateway::clean()
+{
+    return m_clean;
+}
+
+
+uint16_t FakeGateway::keepalive()
+{
+    return m_keepalive;
+}
+
+
+uint16_t FakeGateway::sleep_duration()
+{
+    return m_sleep;
+}
+
+
+const std::string &FakeGateway::client_id()
+{
+    return m_client_id;
+}
+
+
+const std::string &FakeGateway::ping_id()
+{
+    return m_ping_id;
+}
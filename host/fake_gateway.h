@@ -0,0 +1,122 @@
+#ifndef FAKE_GATEWAY_H
+#define FAKE_GATEWAY_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+class FakeBroker;
+
+
+/*
+ * A message the gateway accepted.
+ */
+struct FakeGatewayMessage
+{
+    std::string topic;
+    std::string payload;
+    int qos;
+    bool dup;
+    bool retained;
+};
+
+
+/*
+ * A stand-in for an MQTT-SN gateway, for host tests, serving a single
+ * client through a `FakeUDP`.
+ *
+ * It answers CONNECT, REGISTER, PUBLISH at QoS -1, 0 & 1, PINGREQ and
+ * DISCONNECT - with a duration, to sleep - and records what it saw.
+ * Given a `FakeBroker` it relays each message it accepts to that, so
+ * that a `PubSubClient` may subscribe to them.
+ *
+ * Tests may make it lose replies, forget registrations, or go silent.
+ */
+class FakeGateway
+{
+public:
+
+    FakeGateway();
+    FakeGateway(FakeBroker &broker);
+
+    /*
+     * Handle a datagram, appending any replies.
+     */
+    void receive(const uint8_t *packet, size_t length, std::deque<std::string> &replies);
+
+    /*
+     * Know a topic by the given ID, without it being registered.
+     */
+    void predefine(uint16_t id, const std::string &name);
+
+    /*
+     * Don't answer the next `count` datagrams, though they're handled.
+     */
+    void drop(unsigned int count);
+
+    /*
+     * Ignore everything while silent, as if the gateway were gone.
+     */
+    void set_silent(bool silent);
+
+    /*
+     * Forget the topics registered so far, so publishing to them is
+     * refused with "invalid topic ID".
+     */
+    void forget();
+
+    /*
+     * The messages accepted, the topics registered - in order, though
+     * they may since have been forgotten - and the number of datagrams
+     * of each type received.
+     */
+    std::vector<FakeGatewayMessage> &messages();
+    std::vector<std::string> &registrations();
+    unsigned long received(uint8_t type);
+
+    /*
+     * The state of the client, as it last told us.
+     */
+    bool connected();
+    bool asleep();
+    bool clean();
+    uint16_t keepalive();
+    uint16_t sleep_duration();
+    const std::string &client_id();
+
+    /*
+     * The client ID sent with the most recent PINGREQ, if any.
+     */
+    const std::string &ping_id();
+
+private:
+
+    void handle(uint8_t type, const std::string &body, std::deque<std::string> &replies);
+    void publish(const std::string &body, std::deque<std::string> &replies);
+
+    FakeBroker *m_broker = NULL;
+
+    std::map<uint16_t, std::string> m_topics;
+    std::map<uint16_t, std::string> m_predefined;
+    uint16_t m_next_topic = 1;
+
+    unsigned int m_drop = 0;
+    bool m_silent = false;
+
+    std::vector<FakeGatewayMessage> m_messages;
+    std::vector<std::string> m_registrations;
+    std::map<uint8_t, unsigned long> m_received;
+
+    bool m_connected = false;
+    bool m_asleep = false;
+    bool m_clean = false;
+    uint16_t m_keepalive = 0;
+    uint16_t m_sleep = 0;
+    std::string m_client_id;
+    std::string m_ping_id;
+};
+
+#endif /* FAKE_GATEWAY_H */
@@ -0,0 +1,144 @@
+//
+// Our header.
+//
+#include "fake_udp.h"
+
+//
+// Where our datagrams go.
+//
+#include "fake_gateway.h"
+
+
+FakeUDP::FakeUDP(FakeGateway &gateway) : m_gateway(&gateway)
+{
+}
+
+
+uint8_t FakeUDP::begin(uint16_t port)
+{
+    return 1;
+}
+
+
+void FakeUDP::stop()
+{
+    m_inbox.clear();
+    m_packet.clear();
+    m_packet_pos = 0;
+}
+
+
+int FakeUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+    m_out.clear();
+    return 1;
+}
+
+
+int FakeUDP::beginPacket(const char *host, uint16_t port)
+{
+    m_out.clear();
+    return 1;
+}
+
+
+/*
+ * Hand the datagram to the gateway, queueing its replies.
+ */
+int FakeUDP::endPacket()
+{
+    m_sent += 1;
+    m_gateway->receive((const uint8_t *)m_out.data(), m_out.size(), m_inbox);
+    m_out.clear();
+
+    return 1;
+}
+
+
+size_t FakeUDP::write(uint8_t c)
+{
+    m_out.push_back(c);
+    return 1;
+}
+
+
+size_t FakeUDP::write(const uint8_t *buf, size_t size)
+{
+    m_out.append((const char *)buf, size);
+    return size;
+}
+
+
+/*
+ * Move on to the next datagram, discarding what's unread of this one.
+ */
+int FakeUDP::parsePacket()
+{
+    m_packet.clear();
+    m_packet_pos = 0;
+
+    if (m_inbox.empty())
+        return 0;
+
+    m_packet = m_inbox.front();
+    m_inbox.pop_front();
+
+    return m_packet.size();
+}
+
+
+int FakeUDP::available()
+{
+    return m_packet.size() - m_packet_pos;
+}
+
+
+int FakeUDP::read()
+{
+    unsigned char c;
+
+    return (read(&c, 1) == 1) ? c : -1;
+}
+
+
+int FakeUDP::read(unsigned char *buf, size_t len)
+{
+    size_t n = min(len, (size_t)available());
+
+    if (n == 0)
+        return -1;
+
+    memcpy(buf, m_packet.data() + m_packet_pos, n);
+    m_packet_pos += n;
+
+    return n;
+}
+
+
+int FakeUDP::peek()
+{
+    return (available() > 0) ? (uint8_t)m_packet[m_packet_pos] : -1;
+}
+
+
+void FakeUDP::flush()
+{
+}
+
+
+IPAddress FakeUDP::remoteIP()
+{
+    return IPAddress(127, 0, 0, 1);
+}
+
+
+uint16_t FakeUDP::remotePort()
+{
+    return 1884;
+}
+
+
+unsigned long FakeUDP::sent()
+{
+    return m_sent;
+}
@@ -0,0 +1,69 @@
+#ifndef FAKE_UDP_H
+#define FAKE_UDP_H
+
+#include <deque>
+#include <string>
+
+#include <Arduino.h>
+#include <Udp.h>
+
+class FakeGateway;
+
+
+/*
+ * An in-memory UDP socket, for host tests, whose datagrams go to a
+ * `FakeGateway`, wherever they're addressed.
+ *
+ * The gateway's replies are queued for `parsePacket()` before
+ * `endPacket()` returns, as if they arrived at once:
+ *
+ *   FakeGateway gateway;
+ *   FakeUDP udp(gateway);
+ *   MQTTSNClient sn(udp);
+ */
+class FakeUDP : public UDP
+{
+public:
+
+    FakeUDP(FakeGateway &gateway);
+
+    uint8_t begin(uint16_t port);
+    void stop();
+    int beginPacket(IPAddress ip, uint16_t port);
+    int beginPacket(const char *host, uint16_t port);
+    int endPacket();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buf, size_t size);
+    int parsePacket();
+    int available();
+    int read();
+    int read(unsigned char *buf, size_t len);
+    int peek();
+    void flush();
+    IPAddress remoteIP();
+    uint16_t remotePort();
+
+    using Print::write;
+
+    /*
+     * The datagrams we've sent.
+     */
+    unsigned long sent();
+
+private:
+
+    FakeGateway *m_gateway;
+
+    /*
+     * The datagram being written, those waiting to be read, and the one
+     * being read.
+     */
+    std::string m_out;
+    std::deque<std::string> m_inbox;
+    std::string m_packet;
+    size_t m_packet_pos = 0;
+
+    unsigned long m_sent = 0;
+};
+
+#endif /* FAKE_UDP_H */
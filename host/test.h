@@ -0,0 +1,39 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+
+/*
+ * Helpers shared by the tests, each of which is a program of its own.
+ */
+
+
+static int failures = 0;
+
+
+/*
+ * Report a failed check, and carry on with the rest.
+ */
+#define CHECK(cond)                                                    \
+    do                                                                 \
+    {                                                                  \
+        if (!(cond))                                                   \
+        {                                                              \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures += 1;                                             \
+        }                                                              \
+    }                                                                  \
+    while (0)
+
+
+/*
+ * Report the result, and return the exit status.
+ */
+static inline int finish(const char *name)
+{
+    printf("%s: %s\n", name, (failures == 0) ? "ok" : "FAILED");
+    return (failures == 0) ? 0 : 1;
+}
+
+#endif /* TEST_H */
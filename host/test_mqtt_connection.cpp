@@ -0,0 +1,158 @@
+//
+// Test that MQTTConnection never waits for the broker: each attempt
+// only sends the CONNECT, and the CONNACK is read by later calls to
+// loop(), as it arrives.
+//
+#include <string>
+
+#include <PubSubClient.h>
+#include <host.h>
+#include <mqtt_connection.h>
+
+#include "fake_client.h"
+#include "test.h"
+
+
+//
+// loop() should never take as long as this, in nanoseconds.
+//
+#define LOOP_LIMIT 10000000
+
+//
+// How long we'll wait for a CONNACK, in milliseconds.
+//
+#define TIMEOUT 2000
+
+
+static String announcement()
+{
+    return "{\"id\":\"test\"}";
+}
+
+
+/*
+ * Call loop(), checking it returns at once.
+ */
+static bool timed_loop(MQTTConnection &connection)
+{
+    uint64_t started = host_nanos();
+    bool connected = connection.loop();
+
+    CHECK(host_nanos() - started < LOOP_LIMIT);
+    return connected;
+}
+
+
+/*
+ * The CONNACK may arrive a byte at a time; we're connected once it's
+ * whole, and then subscribe and announce ourselves in one write.
+ */
+static void test_connect()
+{
+    FakeClient net;
+    PubSubClient client(net);
+    MQTTConnection connection(client);
+
+    client.setServer("fake", 1883);
+    connection.begin("test");
+    connection.announce("meta", announcement);
+    CHECK(client.subscribe("a/b"));
+
+    CHECK(!timed_loop(connection));
+    CHECK(client.state() == MQTT_CONNECTING);
+    CHECK(!client.connected());
+    CHECK((uint8_t)net.written()[0] == MQTTCONNECT);
+    CHECK(!client.publish("a/b", "early"));
+
+    net.feed(std::string("\x20", 1));
+    CHECK(!timed_loop(connection));
+    CHECK(client.state() == MQTT_CONNECTING);
+
+    net.feed(std::string("\x02\x00", 2));
+    CHECK(!timed_loop(connection));
+
+    net.written().clear();
+    unsigned long writes = net.writes();
+
+    net.feed(std::string("\x00", 1));
+    CHECK(timed_loop(connection));
+    CHECK(client.connected());
+    CHECK(connection.connects() == 1);
+    CHECK(connection.failures() == 0);
+
+    CHECK(net.writes() == writes + 1);
+    CHECK((uint8_t)net.written()[0] == (MQTTSUBSCRIBE | MQTTQOS1));
+    CHECK(net.written().find("meta") != std::string::npos);
+}
+
+
+/*
+ * A broker which never answers is given up on after our timeout, and
+ * we back off before trying again.
+ */
+static void test_timeout()
+{
+    FakeClient net;
+    PubSubClient client(net);
+    MQTTConnection connection(client);
+
+    client.setServer("fake", 1883);
+    connection.begin("test");
+    connection.set_timeout(TIMEOUT);
+    connection.set_backoff(1000, 1000);
+
+    CHECK(!timed_loop(connection));
+    host_advance(TIMEOUT - 1);
+    CHECK(!timed_loop(connection));
+    CHECK(client.state() == MQTT_CONNECTING);
+
+    host_advance(1);
+    CHECK(!timed_loop(connection));
+    CHECK(client.state() == MQTT_CONNECTION_TIMEOUT);
+    CHECK(connection.failures() == 1);
+    CHECK(client.getStats().connectTimeouts == 1);
+
+    //
+    // No new attempt is made until the delay has passed.
+    //
+    unsigned long writes = net.writes();
+
+    CHECK(!timed_loop(connection));
+    CHECK(net.writes() == writes);
+
+    host_advance(1000);
+    net.feed(std::string("\x20\x02\x00\x00", 4));
+    CHECK(timed_loop(connection));
+    CHECK(net.writes() == writes + 1);
+    CHECK(connection.connects() == 1);
+}
+
+
+/*
+ * A refusal is a failure, with the broker's reason as our state.
+ */
+static void test_refused()
+{
+    FakeClient net;
+    PubSubClient client(net);
+    MQTTConnection connection(client);
+
+    client.setServer("fake", 1883);
+    connection.begin("test");
+
+    net.feed(std::string("\x20\x02\x00\x05", 4));
+    CHECK(!timed_loop(connection));
+    CHECK(client.state() == MQTT_CONNECT_UNAUTHORIZED);
+    CHECK(connection.failures() == 1);
+    CHECK(client.getStats().connectRefused == 1);
+}
+
+
+int main()
+{
+    test_connect();
+    test_timeout();
+    test_refused();
+
+    return finish("test_mqtt_connection");
+}
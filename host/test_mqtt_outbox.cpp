@@ -0,0 +1,169 @@
+//
+// Test where MQTTOutbox keeps what it can't send: in RAM while we're
+// connected, and in flash once we've been disconnected for a moment.
+//
+#include <string>
+
+#include <FS.h>
+#include <PubSubClient.h>
+#include <host.h>
+#include <mqtt_outbox.h>
+
+#include "fake_client.h"
+#include "test.h"
+
+
+static const std::string connack("\x20\x02\x00\x00", 4);
+
+
+static void connect(PubSubClient &client, FakeClient &net)
+{
+    net.feed(connack);
+    CHECK(client.connect("test_mqtt_outbox"));
+    net.written().clear();
+}
+
+
+/*
+ * Were the given payloads written, in this order?
+ */
+static bool sent_in_order(FakeClient &net, const char *const payloads[], size_t count)
+{
+    size_t pos = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pos = net.written().find(payloads[i], pos);
+
+        if (pos == std::string::npos)
+            return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * While we're connected a backlog stays in RAM, however long it waits.
+ */
+static void test_connected(PubSubClient &client, FakeClient &net)
+{
+    MQTTOutbox outbox(client);
+
+    outbox.begin();
+    outbox.set_rate(1);
+
+    CHECK(outbox.publish("temperature", "20.0"));
+    CHECK(outbox.queued() == 0);
+
+    CHECK(outbox.publish("temperature", "20.1"));
+    CHECK(outbox.publish("temperature", "20.2"));
+    CHECK(outbox.queued() == 2);
+
+    host_advance(MQTT_OUTBOX_SPILL_DELAY);
+    outbox.loop();
+    CHECK(outbox.queued() == 1);
+    CHECK(!SPIFFS.exists(MQTT_OUTBOX_FILE));
+
+    host_advance(1000);
+    outbox.loop();
+    CHECK(outbox.queued() == 0);
+
+    const char *const payloads[] = { "20.0", "20.1", "20.2" };
+    CHECK(sent_in_order(net, payloads, 3));
+}
+
+
+/*
+ * Once we've been disconnected for a moment what's queued moves to
+ * flash, where it outlasts a reboot, and is sent in order when we
+ * connect again.
+ */
+static void test_disconnected(PubSubClient &client, FakeClient &net)
+{
+    {
+        MQTTOutbox outbox(client);
+
+        outbox.begin();
+        net.hang_up();
+
+        CHECK(outbox.publish("temperature", "first"));
+        CHECK(outbox.publish("humidity", "second"));
+        outbox.loop();
+        CHECK(outbox.queued() == 2);
+        CHECK(!SPIFFS.exists(MQTT_OUTBOX_FILE));
+
+        host_advance(MQTT_OUTBOX_SPILL_DELAY);
+        outbox.loop();
+        CHECK(SPIFFS.exists(MQTT_OUTBOX_FILE));
+        CHECK(outbox.queued() == 2);
+
+        CHECK(outbox.publish("temperature", "third"));
+        host_advance(MQTT_OUTBOX_SPILL_DELAY);
+        outbox.loop();
+        CHECK(outbox.queued() == 3);
+    }
+
+    //
+    // Reboot, without flush().
+    //
+    MQTTOutbox outbox(client);
+
+    outbox.begin();
+    outbox.set_rate(0);
+    CHECK(outbox.queued() == 3);
+
+    connect(client, net);
+
+    for (int i = 0; i < 3; i++)
+        outbox.loop();
+
+    CHECK(outbox.queued() == 0);
+    CHECK(!SPIFFS.exists(MQTT_OUTBOX_FILE));
+
+    const char *const payloads[] = { "first", "second", "third" };
+    CHECK(sent_in_order(net, payloads, 3));
+}
+
+
+/*
+ * Without flash the messages stay in RAM, and are sent on connecting.
+ */
+static void test_no_flash(PubSubClient &client, FakeClient &net)
+{
+    MQTTOutbox outbox(client);
+
+    outbox.begin();
+    outbox.set_rate(0);
+    net.hang_up();
+    SPIFFS.set_failing(true);
+
+    CHECK(outbox.publish("temperature", "kept"));
+    host_advance(MQTT_OUTBOX_SPILL_DELAY);
+    outbox.loop();
+    CHECK(outbox.queued() == 1);
+
+    SPIFFS.set_failing(false);
+    connect(client, net);
+    outbox.loop();
+
+    CHECK(outbox.queued() == 0);
+    CHECK(net.written().find("kept") != std::string::npos);
+    CHECK(outbox.dropped() == 0);
+}
+
+
+int main()
+{
+    FakeClient net;
+    PubSubClient client(net);
+
+    client.setServer("fake", 1883);
+    connect(client, net);
+
+    test_connected(client, net);
+    test_disconnected(client, net);
+    test_no_flash(client, net);
+
+    return finish("test_mqtt_outbox");
+}
@@ -0,0 +1,303 @@
+//
+// Test MQTTSNClient against the loopback gateway: connecting,
+// registering, publishing at each QoS, resending, sleeping, and
+// losing the gateway.
+//
+#include <string>
+
+#include <PubSubClient.h>
+#include <host.h>
+#include <mqtt_sn_client.h>
+
+#include "fake_broker.h"
+#include "fake_client.h"
+#include "fake_gateway.h"
+#include "fake_udp.h"
+#include "test.h"
+
+
+//
+// The packet types we count at the gateway.
+//
+#define CONNECT  0x04
+#define REGISTER 0x0A
+#define PUBLISH  0x0C
+#define PINGREQ  0x16
+
+//
+// The ID the gateway knows our predefined topic by.
+//
+#define PREDEFINED_ID 7
+
+
+/*
+ * Call loop() until we're connected, and have registered each topic,
+ * or have tried for long enough.
+ */
+static void settle(MQTTSNClient &sn)
+{
+    for (int i = 0; i < 10; i++)
+        sn.loop();
+}
+
+
+/*
+ * QoS -1 needs no connection, so only works for topics the gateway
+ * knows without being told.
+ */
+static void test_qos_none(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    CHECK(sn.publish("alarm/siren", "on", MQTT_SN_QOS_NONE));
+    CHECK(sn.publish("tt", "1", MQTT_SN_QOS_NONE));
+    CHECK(!sn.publish("temperature", "1", MQTT_SN_QOS_NONE));
+
+    CHECK(gateway.messages().size() == 2);
+    CHECK(gateway.messages()[0].topic == "alarm/siren");
+    CHECK(gateway.messages()[0].qos == -1);
+    CHECK(gateway.messages()[1].topic == "tt");
+    CHECK(!gateway.connected());
+
+    //
+    // Nor can we publish otherwise, before connecting.
+    //
+    CHECK(!sn.publish("temperature", "1"));
+}
+
+
+/*
+ * Connecting registers each normal topic, in turn.
+ */
+static void test_connect(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    settle(sn);
+
+    CHECK(sn.connected());
+    CHECK(sn.connects() == 1);
+    CHECK(gateway.connected());
+    CHECK(gateway.clean());
+    CHECK(gateway.client_id() == "d1-temp");
+    CHECK(gateway.keepalive() == MQTT_SN_KEEPALIVE);
+    CHECK(gateway.registrations() == std::vector<std::string>({ "temperature", "humidity" }));
+}
+
+
+static void test_publish(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    size_t before = gateway.messages().size();
+    unsigned long publishes = sn.publishes();
+
+    CHECK(sn.publish("temperature", "21.5"));
+    CHECK(sn.publish("humidity", "40", MQTT_SN_QOS_1));
+
+    //
+    // One QoS 1 publish at a time; it's acknowledged on the next loop().
+    //
+    CHECK(!sn.publish("humidity", "41", MQTT_SN_QOS_1));
+    CHECK(sn.publishes() == publishes + 1);
+
+    sn.loop();
+    CHECK(sn.publishes() == publishes + 2);
+    CHECK(sn.publish("humidity", "41", MQTT_SN_QOS_1));
+    sn.loop();
+
+    CHECK(gateway.messages().size() == before + 3);
+    CHECK(gateway.messages()[before].topic == "temperature");
+    CHECK(gateway.messages()[before].payload == "21.5");
+    CHECK(gateway.messages()[before].qos == 0);
+    CHECK(gateway.messages()[before + 1].qos == 1);
+    CHECK(gateway.messages().back().payload == "41");
+}
+
+
+/*
+ * An unanswered QoS 1 publish is sent again, marked as a duplicate.
+ */
+static void test_retransmit(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    unsigned long publishes = sn.publishes();
+
+    gateway.drop(1);
+    CHECK(sn.publish("temperature", "22.0", MQTT_SN_QOS_1));
+    sn.loop();
+    CHECK(sn.publishes() == publishes);
+
+    host_advance(MQTT_SN_RETRY_TIMEOUT);
+    sn.loop();
+    sn.loop();
+
+    CHECK(sn.retransmits() == 1);
+    CHECK(sn.publishes() == publishes + 1);
+    CHECK(!gateway.messages()[gateway.messages().size() - 2].dup);
+    CHECK(gateway.messages().back().dup);
+}
+
+
+/*
+ * A gateway which has forgotten our topic refuses the publish; the
+ * topic is registered again, and the next publish succeeds.
+ */
+static void test_forgotten(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    unsigned long failures = sn.failures();
+
+    gateway.forget();
+    CHECK(sn.publish("temperature", "22.5", MQTT_SN_QOS_1));
+    sn.loop();
+    CHECK(sn.failures() == failures + 1);
+
+    settle(sn);
+    CHECK(gateway.registrations().back() == "temperature");
+    CHECK(sn.publish("temperature", "22.5", MQTT_SN_QOS_1));
+    sn.loop();
+    CHECK(gateway.messages().back().payload == "22.5");
+}
+
+
+static void test_keepalive(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    unsigned long pings = gateway.received(PINGREQ);
+
+    host_advance(MQTT_SN_KEEPALIVE * 1000UL);
+    sn.loop();
+    sn.loop();
+
+    CHECK(gateway.received(PINGREQ) == pings + 1);
+    CHECK(gateway.ping_id().empty());
+    CHECK(sn.connected());
+}
+
+
+/*
+ * Asleep we send nothing until it's time to check in, with our ID, and
+ * waking reconnects without registering our topics again.
+ */
+static void test_sleep(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    unsigned long pings = gateway.received(PINGREQ);
+    size_t registrations = gateway.registrations().size();
+
+    sn.sleep(100);
+    sn.loop();
+    CHECK(!sn.connected());
+    CHECK(gateway.asleep());
+    CHECK(gateway.sleep_duration() == 100);
+
+    host_advance(74000);
+    sn.loop();
+    CHECK(gateway.received(PINGREQ) == pings);
+
+    host_advance(2000);
+    sn.loop();
+    sn.loop();
+    CHECK(gateway.received(PINGREQ) == pings + 1);
+    CHECK(gateway.ping_id() == "d1-temp");
+
+    sn.wake();
+    settle(sn);
+    CHECK(sn.connected());
+    CHECK(!gateway.clean());
+    CHECK(gateway.registrations().size() == registrations);
+    CHECK(sn.publish("temperature", "23.0"));
+}
+
+
+/*
+ * A silent gateway is given up on, after a few tries, and we connect
+ * afresh once it returns.
+ */
+static void test_lost(MQTTSNClient &sn, FakeGateway &gateway)
+{
+    unsigned long failures = sn.failures();
+    unsigned long connects = gateway.received(CONNECT);
+
+    gateway.set_silent(true);
+    CHECK(sn.publish("temperature", "24.0", MQTT_SN_QOS_1));
+
+    for (int i = 0; i <= MQTT_SN_RETRIES; i++)
+    {
+        host_advance(MQTT_SN_RETRY_TIMEOUT);
+        sn.loop();
+    }
+
+    CHECK(!sn.connected());
+    CHECK(sn.failures() == failures + 1);
+
+    gateway.set_silent(false);
+    host_advance(MQTT_SN_RETRY_TIMEOUT);
+    settle(sn);
+
+    CHECK(sn.connected());
+    CHECK(gateway.received(CONNECT) == connects + 1);
+    CHECK(gateway.clean());
+    CHECK(gateway.registrations().back() == "humidity");
+}
+
+
+static unsigned long relayed = 0;
+static std::string relayed_payload;
+
+
+static void on_relayed(char *topic, uint8_t *payload, unsigned int length)
+{
+    relayed += 1;
+    relayed_payload.assign((const char *)payload, length);
+}
+
+
+/*
+ * Messages reach an MQTT subscriber, through the gateway and broker.
+ */
+static void test_relay()
+{
+    FakeBroker broker;
+    FakeGateway gateway(broker);
+    FakeUDP udp(gateway);
+    MQTTSNClient sn(udp);
+    FakeClient net(broker);
+    PubSubClient client(net);
+
+    client.setServer("fake", 1883);
+    client.setCallback(on_relayed);
+    CHECK(client.connect("subscriber"));
+    CHECK(client.subscribe("temperature"));
+
+    sn.begin("gateway", MQTT_SN_DEFAULT_PORT, "d1-temp");
+    sn.add_topic("temperature");
+    settle(sn);
+
+    CHECK(sn.publish("temperature", "25.5", MQTT_SN_QOS_1));
+    sn.loop();
+    client.loop();
+
+    CHECK(relayed == 1);
+    CHECK(relayed_payload == "25.5");
+}
+
+
+int main()
+{
+    FakeGateway gateway;
+    FakeUDP udp(gateway);
+    MQTTSNClient sn(udp);
+
+    gateway.predefine(PREDEFINED_ID, "alarm/siren");
+
+    sn.begin("gateway", MQTT_SN_DEFAULT_PORT, "d1-temp");
+    CHECK(sn.add_topic("temperature"));
+    CHECK(sn.add_topic("humidity"));
+    CHECK(sn.add_topic("tt"));
+    CHECK(sn.add_topic("alarm/siren", PREDEFINED_ID));
+    CHECK(!sn.add_topic("temperature"));
+
+    test_qos_none(sn, gateway);
+    test_connect(sn, gateway);
+    test_publish(sn, gateway);
+    test_retransmit(sn, gateway);
+    test_forgotten(sn, gateway);
+    test_keepalive(sn, gateway);
+    test_sleep(sn, gateway);
+    test_lost(sn, gateway);
+    test_relay();
+
+    return finish("test_mqtt_sn");
+}
@@ -0,0 +1,259 @@
+//
+// Test that PubSubClient reads packets without blocking, by feeding them
+// to it a byte at a time, with a call to loop() after each.
+//
+#include <string>
+
+#include <PubSubClient.h>
+#include <host.h>
+
+#include "fake_client.h"
+#include "test.h"
+
+
+//
+// loop() should never take as long as this, in nanoseconds; it used to
+// wait up to MQTT_SOCKET_TIMEOUT seconds for the rest of a packet.
+//
+#define LOOP_LIMIT 10000000
+
+//
+// The messages delivered to our callback.
+//
+static unsigned long delivered = 0;
+static std::string last_topic;
+static std::string last_payload;
+
+
+static void on_message(char *topic, uint8_t *payload, unsigned int length)
+{
+    delivered += 1;
+    last_topic = topic;
+    last_payload.assign((const char *)payload, length);
+}
+
+
+/*
+ * Build a packet, with its remaining-length.
+ */
+static std::string packet(uint8_t header, const std::string &body)
+{
+    std::string out(1, (char)header);
+    size_t length = body.size();
+
+    do
+    {
+        uint8_t digit = length % 128;
+        length /= 128;
+        out.push_back((length > 0) ? (digit | 0x80) : digit);
+    }
+    while (length > 0);
+
+    return out + body;
+}
+
+
+static std::string encode(const std::string &s)
+{
+    std::string out;
+
+    out.push_back(s.size() >> 8);
+    out.push_back(s.size() & 0xFF);
+    return out + s;
+}
+
+
+static std::string publish(const std::string &topic, const std::string &payload, uint16_t id = 0)
+{
+    std::string body = encode(topic);
+
+    if (id != 0)
+    {
+        body.push_back(id >> 8);
+        body.push_back(id & 0xFF);
+    }
+
+    return packet(id ? (MQTTPUBLISH | MQTTQOS1) : MQTTPUBLISH, body + payload);
+}
+
+
+/*
+ * Feed all but the last byte of `data`, one per call to loop(), and
+ * check each call returns at once.
+ */
+static void feed_all_but_last(PubSubClient &client, FakeClient &net, const std::string &data)
+{
+    for (size_t i = 0; i + 1 < data.size(); i++)
+    {
+        net.feed((const uint8_t *)&data[i], 1);
+
+        uint64_t started = host_nanos();
+        CHECK(client.loop());
+        CHECK(host_nanos() - started < LOOP_LIMIT);
+    }
+}
+
+
+static void feed_last(PubSubClient &client, FakeClient &net, const std::string &data)
+{
+    net.feed((const uint8_t *)&data[data.size() - 1], 1);
+    CHECK(client.loop());
+}
+
+
+/*
+ * The message ID of the packet most recently written.
+ */
+static uint16_t written_id(FakeClient &net)
+{
+    std::string &w = net.written();
+
+    CHECK(w.size() >= 4);
+    return (w.size() >= 4) ? (((uint8_t)w[2] << 8) | (uint8_t)w[3]) : 0;
+}
+
+
+static void test_suback(PubSubClient &client, FakeClient &net)
+{
+    net.written().clear();
+    CHECK(client.subscribe("a/b", 1));
+    CHECK((uint8_t)net.written()[0] == (MQTTSUBSCRIBE | MQTTQOS1));
+
+    uint16_t id = written_id(net);
+    std::string suback = packet(MQTTSUBACK, std::string() + (char)(id >> 8) + (char)(id & 0xFF) + '\x01');
+
+    feed_all_but_last(client, net, suback);
+    CHECK(client.getSubscriptionResult("a/b") == MQTT_SUBSCRIPTION_PENDING);
+
+    feed_last(client, net, suback);
+    CHECK(client.getSubscriptionResult("a/b") == 1);
+}
+
+
+static void test_publish(PubSubClient &client, FakeClient &net, size_t size)
+{
+    std::string payload;
+
+    for (size_t i = 0; i < size; i++)
+        payload.push_back('a' + i % 26);
+
+    std::string data = publish("a/b", payload);
+    unsigned long before = delivered;
+
+    feed_all_but_last(client, net, data);
+    CHECK(delivered == before);
+
+    feed_last(client, net, data);
+    CHECK(delivered == before + 1);
+    CHECK(last_topic == "a/b");
+    CHECK(last_payload == payload);
+}
+
+
+/*
+ * A QoS 1 publish is acknowledged only once it has arrived in full.
+ */
+static void test_publish_qos1(PubSubClient &client, FakeClient &net)
+{
+    std::string data = publish("a/b", "qos1", 0x1234);
+    unsigned long before = delivered;
+
+    net.written().clear();
+    feed_all_but_last(client, net, data);
+    CHECK(net.written().empty());
+
+    feed_last(client, net, data);
+    CHECK(delivered == before + 1);
+    CHECK(net.written() == std::string("\x40\x02\x12\x34", 4));
+}
+
+
+/*
+ * A packet too large for the buffer is skipped, a byte at a time, and
+ * the one after it is still read.
+ */
+static void test_oversized(PubSubClient &client, FakeClient &net)
+{
+    std::string big = publish("a/b", std::string(client.getBufferSize() * 2, 'x'));
+    std::string small = publish("a/b", "after");
+    unsigned long oversized = client.getStats().oversizedPackets;
+    unsigned long before = delivered;
+
+    feed_all_but_last(client, net, big + small);
+    CHECK(client.getStats().oversizedPackets == oversized + 1);
+    CHECK(delivered == before);
+
+    feed_last(client, net, big + small);
+    CHECK(delivered == before + 1);
+    CHECK(last_payload == "after");
+}
+
+
+/*
+ * Two packets arriving together are both handled by one call.
+ */
+static void test_coalesced(PubSubClient &client, FakeClient &net)
+{
+    std::string data = publish("a/b", "one") + publish("a/b", "two");
+    unsigned long before = delivered;
+
+    net.feed(data);
+    CHECK(client.loop());
+    CHECK(delivered == before + 2);
+    CHECK(last_payload == "two");
+}
+
+
+/*
+ * A partial packet doesn't hold back the keep-alive, and the PINGRESP
+ * may arrive a byte at a time too.
+ */
+static void test_keepalive(PubSubClient &client, FakeClient &net)
+{
+    std::string data = publish("a/b", "late");
+    std::string pingresp = packet(MQTTPINGRESP, "");
+    unsigned long pings = client.getStats().pings;
+
+    feed_all_but_last(client, net, data);
+
+    net.written().clear();
+    host_advance(MQTT_KEEPALIVE * 1000 + 1);
+    CHECK(client.loop());
+    CHECK(net.written() == std::string("\xC0\x00", 2));
+
+    feed_last(client, net, data);
+    CHECK(last_payload == "late");
+
+    feed_all_but_last(client, net, pingresp);
+    CHECK(client.getStats().pings == pings);
+
+    feed_last(client, net, pingresp);
+    CHECK(client.getStats().pings == pings + 1);
+    CHECK(client.connected());
+}
+
+
+int main()
+{
+    FakeClient net;
+    PubSubClient client(net);
+
+    client.setServer("fake", 1883);
+    client.setCallback(on_message);
+    CHECK(client.setBufferSize(512));
+
+    net.feed(packet(MQTTCONNACK, std::string("\x00\x00", 2)));
+    CHECK(client.connect("test_pubsub"));
+    CHECK((uint8_t)net.written()[0] == MQTTCONNECT);
+
+    test_suback(client, net);
+    test_publish(client, net, 5);
+    test_publish(client, net, 300);
+    test_publish_qos1(client, net);
+    test_oversized(client, net);
+    test_coalesced(client, net);
+    test_keepalive(client, net);
+
+    CHECK(client.connected());
+    return finish("test_pubsub");
+}